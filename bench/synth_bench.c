@@ -0,0 +1,526 @@
+/*
+ 
+ This is free and unencumbered software released into the public domain.
+ 
+ Anyone is free to copy, modify, publish, use, compile, sell, or
+ distribute this software, either in source code form or as a compiled
+ binary, for any purpose, commercial or non-commercial, and by any
+ means.
+ 
+ In jurisdictions that recognize copyright laws, the author or authors
+ of this software dedicate any and all copyright interest in the
+ software to the public domain. We make this dedication for the benefit
+ of the public at large and to the detriment of our heirs and
+ successors. We intend this dedication to be an overt act of
+ relinquishment in perpetuity of all present and future rights to this
+ software under copyright law.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ OTHER DEALINGS IN THE SOFTWARE.
+ 
+ For more information, please refer to <http://unlicense.org>
+ 
+ ----------------------------------------------------------------
+ 
+ Synth Samples SDL2 C - benchmarks for the hot paths of sample 3.
+ 
+ The benchmarks link the engine of sample 3 (src/synth_engine.c, see synth_engine.h) and call
+ its kernels directly, next to whole blocks of engine_render the way the sample plays them.
+ Every case is run until it has taken at least bench_min_seconds, five times, and the fastest
+ run is reported. Results are printed as CSV, one line per case:
+ 
+    case,variant,buffer_frames,voices,ns_per_frame,cycles_per_frame
+ 
+ ns_per_frame is per output frame (for build_sine_table, per table entry). cycles_per_frame
+ is read from the time stamp counter on x86 and left empty elsewhere.
+ 
+ Build with optimizations, for example:
+    cc -O3 -std=c89 bench/synth_bench.c src/synth_engine.c `sdl2-config --cflags --libs` -lm -o synth_bench
+ or build the synth_bench target of CMakeLists.txt, which also takes the profile guided flags.
+ 
+ dialect: C89
+ dependencies: SDL2
+ 
+*/
+
+#include "../src/synth_engine.h"
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#define BENCH_HAS_CYCLES
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define BENCH_HAS_CYCLES
+#endif
+
+#define BENCH_MAX_FRAMES 4096 /* longest block bench_engine_render renders */
+
+struct bench_result {
+    double seconds;
+    double cycles;
+};
+
+static double bench_min_seconds = 0.02;
+static volatile float bench_sink = 0; /* keeps results alive so the compiler can't drop the work */
+static struct engine_settings bench_settings;
+static struct engine *bench_engine = NULL;
+
+struct bench_engine_thread {
+    SDL_Thread *thread;
+    SDL_sem *start;
+    SDL_sem *done;
+    struct engine *engine;
+    float *out;
+    int frames;
+    int quit;
+};
+
+static double read_cycles(void);
+static void bench_start_voices(struct engine *engine, int count, int parts);
+static void bench_report(const char *name, const char *variant, int buffer_frames, int voices, struct bench_result *result, double frames);
+static void bench_sine_table(void);
+static void bench_oscillators(void);
+static void bench_envelope(void);
+static void bench_filter(void);
+static void bench_effects(void);
+static void bench_write_samples(void);
+static void bench_engine_render(void);
+static int bench_render_s16(struct engine *engine, float *scratch, Sint16 *out, int frames);
+static void bench_engines(void);
+static int bench_engine_thread_main(void *data);
+
+int main(int argc, char* argv[]) {
+    
+    int i;
+    for(i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "--quick") == 0) {
+            bench_min_seconds = 0.002;
+        }
+    }
+    
+    /* room for a second engine for bench_engines, and the buffers of the block cases */
+    bench_settings.sample_rate = 44100;
+    bench_settings.chunk_frames = DEFAULT_CHUNK_FRAMES;
+    bench_settings.bus_frames = BENCH_MAX_FRAMES;
+    bench_settings.voice_count = MAX_VOICES; /* so the pool cases can play all of them */
+    bench_settings.oscillator_mode = OSCILLATOR_LINEAR;
+    bench_settings.use_pool = false;
+    init_engine_data(&bench_settings, 2, BENCH_MAX_FRAMES * 2 * (sizeof(float) + sizeof(Sint16)) + 2 * 512 * 2 * sizeof(float));
+    bench_engine = engine_create(&bench_settings);
+    if(bench_engine == NULL) {
+        printf("could not make an engine\n");
+        cleanup_engine_data();
+        return 1;
+    }
+    printf("case,variant,buffer_frames,voices,ns_per_frame,cycles_per_frame\n");
+    bench_sine_table();
+    bench_oscillators();
+    bench_envelope();
+    bench_filter();
+    bench_effects();
+    bench_write_samples();
+    bench_engine_render();
+    bench_engines();
+    engine_destroy(bench_engine);
+    cleanup_engine_data();
+    return 0;
+}
+
+static double read_cycles(void) {
+    
+#if defined(BENCH_HAS_CYCLES)
+    return (double)__rdtsc();
+#else
+    return 0;
+#endif
+}
+
+/*
+    Each benchmark runs its work in a loop like this. The number of iterations is doubled until a
+    run takes bench_min_seconds, then five more runs are timed and the fastest one is kept.
+*/
+#define BENCH_RUN(result, iterations, work) do { \
+    int bench_run; \
+    long bench_i; \
+    iterations = 1; \
+    for(;;) { \
+        Uint64 bench_start = SDL_GetPerformanceCounter(); \
+        for(bench_i = 0; bench_i < iterations; bench_i++) { work; } \
+        if((SDL_GetPerformanceCounter() - bench_start) / performance_frequency >= bench_min_seconds) { \
+            break; \
+        } \
+        iterations *= 2; \
+    } \
+    result.seconds = 1e30; \
+    result.cycles = 0; \
+    for(bench_run = 0; bench_run < 5; bench_run++) { \
+        double bench_cycles = read_cycles(); \
+        Uint64 bench_start = SDL_GetPerformanceCounter(); \
+        double bench_seconds; \
+        for(bench_i = 0; bench_i < iterations; bench_i++) { work; } \
+        bench_seconds = (SDL_GetPerformanceCounter() - bench_start) / performance_frequency; \
+        if(bench_seconds < result.seconds) { \
+            result.seconds = bench_seconds; \
+            result.cycles = read_cycles() - bench_cycles; \
+        } \
+    } \
+} while(0)
+
+static void bench_report(const char *name, const char *variant, int buffer_frames, int voices, struct bench_result *result, double frames) {
+    
+    printf("%s,%s,%d,%d,%.3f,", name, variant, buffer_frames, voices, result->seconds * 1e9 / frames);
+#if defined(BENCH_HAS_CYCLES)
+    printf("%.3f", result->cycles / frames);
+#endif
+    printf("\n");
+    fflush(stdout);
+}
+
+static void bench_start_voices(struct engine *engine, int count, int parts) {
+    
+    /* free the pool and start count held notes spread over a few octaves and the first parts */
+    
+    int v;
+    for(v = 0; v < MAX_VOICES; v++) {
+        engine->voice_note[v] = -1;
+        engine->voice_key_pressed[v] = false;
+    }
+    engine->active_voices = 0;
+    for(v = 0; v < count; v++) {
+        voice_note_on(engine, v % parts, v + 1, 36 + (v * 7) % 48, 1);
+    }
+}
+
+static void bench_sine_table(void) {
+    
+    struct bench_result result;
+    long iterations;
+    BENCH_RUN(result, iterations, build_sine_table(sine_wave_table, table_length));
+    bench_report("build_sine_table", "scalar", table_length, 0, &result, (double)iterations * table_length);
+}
+
+static void bench_oscillators(void) {
+    
+    /* every oscillator kernel the CPU supports, one chunk per call */
+    
+    struct engine *engine = bench_engine;
+    struct bench_result result;
+    long iterations;
+    int frames = MAX_CHUNK_FRAMES;
+    double phase = 0;
+    double increment = get_phase_increment(engine, 57, 0);
+    Uint32 phase_fixed = 0;
+    Uint32 step = get_phase_step(increment);
+    
+    BENCH_RUN(result, iterations, render_oscillator_scalar(wave_table, table_length, &phase, increment, engine->scratch.oscillator, frames); bench_sink += engine->scratch.oscillator[0]);
+    bench_report("render_oscillator", "scalar", frames, 1, &result, (double)iterations * frames);
+#if defined(SYNTH_SSE2)
+    if(SDL_HasSSE2()) {
+        BENCH_RUN(result, iterations, render_oscillator_sse2(wave_table, table_length, &phase, increment, engine->scratch.oscillator, frames); bench_sink += engine->scratch.oscillator[0]);
+        bench_report("render_oscillator", "sse2", frames, 1, &result, (double)iterations * frames);
+    }
+#endif
+#if defined(SYNTH_AVX2)
+    if(SDL_HasAVX2()) {
+        BENCH_RUN(result, iterations, render_oscillator_avx2(wave_table, table_length, &phase, increment, engine->scratch.oscillator, frames); bench_sink += engine->scratch.oscillator[0]);
+        bench_report("render_oscillator", "avx2", frames, 1, &result, (double)iterations * frames);
+    }
+#endif
+#if defined(SYNTH_NEON)
+    if(SDL_HasNEON()) {
+        BENCH_RUN(result, iterations, render_oscillator_neon(wave_table, table_length, &phase, increment, engine->scratch.oscillator, frames); bench_sink += engine->scratch.oscillator[0]);
+        bench_report("render_oscillator", "neon", frames, 1, &result, (double)iterations * frames);
+    }
+#endif
+    
+    BENCH_RUN(result, iterations, render_oscillator_linear_scalar(wave_table, table_bits, &phase_fixed, step, engine->scratch.oscillator, frames); bench_sink += engine->scratch.oscillator[0]);
+    bench_report("render_oscillator_linear", "scalar", frames, 1, &result, (double)iterations * frames);
+    BENCH_RUN(result, iterations, render_oscillator_cubic_scalar(wave_table, table_bits, &phase_fixed, step, engine->scratch.oscillator, frames); bench_sink += engine->scratch.oscillator[0]);
+    bench_report("render_oscillator_cubic", "scalar", frames, 1, &result, (double)iterations * frames);
+#if defined(SYNTH_SSE2)
+    if(SDL_HasSSE2()) {
+        BENCH_RUN(result, iterations, render_oscillator_linear_sse2(wave_table, table_bits, &phase_fixed, step, engine->scratch.oscillator, frames); bench_sink += engine->scratch.oscillator[0]);
+        bench_report("render_oscillator_linear", "sse2", frames, 1, &result, (double)iterations * frames);
+    }
+#endif
+#if defined(SYNTH_AVX2)
+    if(SDL_HasAVX2()) {
+        BENCH_RUN(result, iterations, render_oscillator_linear_avx2(wave_table, table_bits, &phase_fixed, step, engine->scratch.oscillator, frames); bench_sink += engine->scratch.oscillator[0]);
+        bench_report("render_oscillator_linear", "avx2", frames, 1, &result, (double)iterations * frames);
+        BENCH_RUN(result, iterations, render_oscillator_cubic_avx2(wave_table, table_bits, &phase_fixed, step, engine->scratch.oscillator, frames); bench_sink += engine->scratch.oscillator[0]);
+        bench_report("render_oscillator_cubic", "avx2", frames, 1, &result, (double)iterations * frames);
+    }
+#endif
+#if defined(SYNTH_NEON)
+    if(SDL_HasNEON()) {
+        BENCH_RUN(result, iterations, render_oscillator_linear_neon(wave_table, table_bits, &phase_fixed, step, engine->scratch.oscillator, frames); bench_sink += engine->scratch.oscillator[0]);
+        bench_report("render_oscillator_linear", "neon", frames, 1, &result, (double)iterations * frames);
+    }
+#endif
+}
+
+static void bench_envelope(void) {
+    
+    /*
+        The envelope is kept in its attack stage by restarting it before it runs out, so the
+        ramp is measured and not the cheaper sustain hold.
+    */
+    
+    struct engine *engine = bench_engine;
+    struct bench_result result;
+    long iterations;
+    int frames = MAX_CHUNK_FRAMES;
+    bench_start_voices(engine, 1, 1);
+    
+    BENCH_RUN(result, iterations,
+        if(engine->voice_envelope_stage[0] != ENVELOPE_ATTACK) { engine->voice_envelope_stage[0] = ENVELOPE_ATTACK; engine->voice_envelope_remaining[0] = engine->parts[0].envelope_stage_frames; }
+        render_envelope_block(engine, 0, engine->scratch.envelope, frames); bench_sink += engine->scratch.envelope[0]);
+    bench_report("render_envelope_block", "block", frames, 1, &result, (double)iterations * frames);
+}
+
+static void bench_filter(void) {
+    
+    /* every filter kernel on a full group of voices, reported per frame of each voice */
+    
+    struct engine *engine = bench_engine;
+    struct bench_result result;
+    long iterations;
+    int frames = MAX_CHUNK_FRAMES;
+    struct filter_lanes *filter = &engine->scratch.filter;
+    int i;
+    for(i = 0; i < MAX_FILTER_LANES; i++) {
+        engine->voice_filter_base[i] = -1;
+        update_filter_coefficients(engine, i, i * 0.5);
+        filter->a1[i] = engine->voice_filter_a1[i];
+        filter->a2[i] = engine->voice_filter_a2[i];
+        filter->a3[i] = engine->voice_filter_a3[i];
+        filter->ic1[i] = 0;
+        filter->ic2[i] = 0;
+    }
+    for(i = 0; i < frames * MAX_FILTER_LANES; i++) {
+        engine->scratch.lanes[i] = wave_table[(i * 37) & (table_length - 1)];
+    }
+    flush_denormals();
+    filter->lanes = 4;
+    BENCH_RUN(result, iterations, render_filter_scalar(filter, engine->scratch.lanes, frames); bench_sink += engine->scratch.lanes[0]);
+    bench_report("render_filter", "scalar", frames, 4, &result, (double)iterations * frames * 4);
+#if defined(SYNTH_SSE2)
+    if(SDL_HasSSE2()) {
+        BENCH_RUN(result, iterations, render_filter_sse2(filter, engine->scratch.lanes, frames); bench_sink += engine->scratch.lanes[0]);
+        bench_report("render_filter", "sse2", frames, 4, &result, (double)iterations * frames * 4);
+    }
+#endif
+#if defined(SYNTH_AVX2)
+    if(SDL_HasAVX2()) {
+        filter->lanes = 8;
+        BENCH_RUN(result, iterations, render_filter_avx2(filter, engine->scratch.lanes, frames); bench_sink += engine->scratch.lanes[0]);
+        bench_report("render_filter", "avx2", frames, 8, &result, (double)iterations * frames * 8);
+    }
+#endif
+#if defined(SYNTH_NEON)
+    if(SDL_HasNEON()) {
+        BENCH_RUN(result, iterations, render_filter_neon(filter, engine->scratch.lanes, frames); bench_sink += engine->scratch.lanes[0]);
+        bench_report("render_filter", "neon", frames, 4, &result, (double)iterations * frames * 4);
+    }
+#endif
+}
+
+static void bench_effects(void) {
+    
+    /* the delay and the reverb on a buffer of the buses, each on its own and both together */
+    
+    struct engine *engine = bench_engine;
+    struct bench_result result;
+    long iterations;
+    int frames = 512;
+    int i;
+    for(i = 0; i < frames; i++) {
+        engine->bus_left[i] = wave_table[(i * 37) & (table_length - 1)];
+        engine->bus_right[i] = wave_table[(i * 41) & (table_length - 1)];
+    }
+    flush_denormals();
+    engine->delay_mix = 0.3;
+    BENCH_RUN(result, iterations, process_master_bus(engine, engine->bus_left, engine->bus_right, frames); bench_sink += engine->bus_left[0]);
+    bench_report("process_master_bus", "delay", frames, 0, &result, (double)iterations * frames);
+    engine->delay_mix = 0;
+    engine->reverb_mix = 0.25;
+    BENCH_RUN(result, iterations, process_master_bus(engine, engine->bus_left, engine->bus_right, frames); bench_sink += engine->bus_left[0]);
+    bench_report("process_master_bus", "reverb", frames, 0, &result, (double)iterations * frames);
+    engine->delay_mix = 0.3;
+    BENCH_RUN(result, iterations, process_master_bus(engine, engine->bus_left, engine->bus_right, frames); bench_sink += engine->bus_left[0]);
+    bench_report("process_master_bus", "delay_reverb", frames, 0, &result, (double)iterations * frames);
+    engine->delay_mix = 0;
+    engine->reverb_mix = 0;
+    process_master_bus(engine, engine->bus_left, engine->bus_right, frames);
+    engine->effects_tail = 0;
+}
+
+static void bench_write_samples(void) {
+    
+    /* one chunk of all active voices into the float buses */
+    
+    struct engine *engine = bench_engine;
+    struct bench_result result;
+    long iterations;
+    int voice_counts[6] = {1, 8, 32, 64, 128, 256};
+    int frames = DEFAULT_CHUNK_FRAMES;
+    int i;
+    for(i = 0; i < 6; i++) {
+        bench_start_voices(engine, voice_counts[i], 1);
+        BENCH_RUN(result, iterations, write_samples(engine, engine->bus_left, engine->bus_right, 0, frames); bench_sink += engine->bus_left[0]);
+        bench_report("write_samples", "float_bus", frames, voice_counts[i], &result, (double)iterations * frames);
+    }
+    
+    /* without the filter, to see what it costs */
+    filter_enabled = false;
+    for(i = 0; i < 6; i++) {
+        bench_start_voices(engine, voice_counts[i], 1);
+        BENCH_RUN(result, iterations, write_samples(engine, engine->bus_left, engine->bus_right, 0, frames); bench_sink += engine->bus_left[0]);
+        bench_report("write_samples", "no_filter", frames, voice_counts[i], &result, (double)iterations * frames);
+    }
+    filter_enabled = true;
+    
+    /* the same notes spread over all parts, to see what the per-part state costs */
+    for(i = 0; i < 6; i++) {
+        bench_start_voices(engine, voice_counts[i], MAX_PARTS);
+        BENCH_RUN(result, iterations, write_samples(engine, engine->bus_left, engine->bus_right, 0, frames); bench_sink += engine->bus_left[0]);
+        bench_report("write_samples", "parts", frames, voice_counts[i], &result, (double)iterations * frames);
+    }
+    
+    /* the same on the worker pool, one thread per core */
+    pool_threads = get_pool_threads(0);
+    start_worker_pool();
+    if(pool_threads > 1) {
+        engine->use_pool = true;
+        engine->pool_enabled = true;
+        for(i = 0; i < 6; i++) {
+            bench_start_voices(engine, voice_counts[i], 1);
+            BENCH_RUN(result, iterations, write_samples(engine, engine->bus_left, engine->bus_right, 0, frames); bench_sink += engine->bus_left[0]);
+            bench_report("write_samples", "pool", frames, voice_counts[i], &result, (double)iterations * frames);
+        }
+        engine->use_pool = false;
+        engine->pool_enabled = false;
+        stop_worker_pool();
+    }
+    pool_threads = 1;
+}
+
+static void bench_engine_render(void) {
+    
+    /*
+        A whole device buffer for each output format, buffer size and voice count, filled the way
+        sample 3 does it: float stereo straight from engine_render, 16 bit through a float buffer
+        and convert_mix_bus.
+    */
+    
+    struct engine *engine = bench_engine;
+    struct bench_result result;
+    long iterations;
+    int buffer_sizes[6] = {64, 128, 256, 512, 1024, BENCH_MAX_FRAMES};
+    int voice_counts[4] = {0, 1, 16, 64}; /* no voices takes the silent path */
+    float *scratch = alloc_memory(BENCH_MAX_FRAMES * 2 * sizeof(float), "bench buffer");
+    Sint16 *samples = alloc_memory(BENCH_MAX_FRAMES * 2 * sizeof(Sint16), "bench samples");
+    int b, v, f;
+    for(f = 0; f < 2; f++) {
+        for(b = 0; b < 6; b++) {
+            int frames = buffer_sizes[b];
+            engine->chunk_frames = get_chunk_frames(frames, DEFAULT_CHUNK_FRAMES);
+            for(v = 0; v < 4; v++) {
+                bench_start_voices(engine, voice_counts[v], 1);
+                if(f == 0) {
+                    BENCH_RUN(result, iterations, engine_render(engine, scratch, frames); bench_sink += scratch[0]);
+                } else {
+                    BENCH_RUN(result, iterations, bench_render_s16(engine, scratch, samples, frames); bench_sink += samples[0]);
+                }
+                bench_report("engine_render", f == 0 ? "f32" : "s16", frames, voice_counts[v], &result, (double)iterations * frames);
+            }
+        }
+    }
+    engine->chunk_frames = DEFAULT_CHUNK_FRAMES;
+    free_memory(samples);
+    free_memory(scratch);
+}
+
+static int bench_render_s16(struct engine *engine, float *scratch, Sint16 *out, int frames) {
+    
+    /* a 16 bit stereo buffer, silence is written as it is instead of converted */
+    
+    if(!engine_render(engine, scratch, frames)) {
+        memset(out, 0, frames * 2 * sizeof(Sint16));
+        return false;
+    }
+    convert_mix_bus(scratch, out, frames);
+    return true;
+}
+
+static void bench_engines(void) {
+    
+    /*
+        A second engine made with the settings of bench_engine renders the same notes on a thread
+        of its own while bench_engine renders on this one, each into its own buffer. Reported per
+        frame of one engine, next to the case with bench_engine alone.
+    */
+    
+    struct engine_settings settings;
+    struct bench_engine_thread other;
+    struct bench_result result;
+    long iterations;
+    int frames = 512;
+    int voices = 32;
+    float *buffer = alloc_memory(2 * frames * 2 * sizeof(float), "bench buffer");
+    settings = bench_settings; /* use_pool stays off, the pool belongs to bench_engine */
+    other.engine = engine_create(&settings);
+    other.out = buffer + frames * 2;
+    other.frames = frames;
+    other.quit = false;
+    other.start = SDL_CreateSemaphore(0);
+    other.done = SDL_CreateSemaphore(0);
+    other.thread = NULL;
+    if(other.engine != NULL && other.start != NULL && other.done != NULL) {
+        other.thread = SDL_CreateThread(bench_engine_thread_main, "bench engine", &other);
+    }
+    if(other.thread == NULL) {
+        printf("could not start a second engine: %s\n", SDL_GetError());
+    } else {
+        flush_denormals();
+        bench_start_voices(bench_engine, voices, 1);
+        BENCH_RUN(result, iterations, engine_render(bench_engine, buffer, frames); bench_sink += buffer[0]);
+        bench_report("engine_render", "one_engine", frames, voices, &result, (double)iterations * frames);
+        bench_start_voices(other.engine, voices, 1);
+        BENCH_RUN(result, iterations, SDL_SemPost(other.start); engine_render(bench_engine, buffer, frames); SDL_SemWait(other.done); bench_sink += buffer[0] + other.out[0]);
+        bench_report("engine_render", "two_engines", frames, voices, &result, (double)iterations * frames);
+        other.quit = true;
+        SDL_SemPost(other.start);
+        SDL_WaitThread(other.thread, NULL);
+    }
+    if(other.done != NULL) {
+        SDL_DestroySemaphore(other.done);
+    }
+    if(other.start != NULL) {
+        SDL_DestroySemaphore(other.start);
+    }
+    engine_destroy(other.engine);
+    free_memory(buffer);
+}
+
+static int bench_engine_thread_main(void *data) {
+    
+    /* render a block of the second engine each time start is posted */
+    
+    struct bench_engine_thread *other = data;
+    flush_denormals();
+    for(;;) {
+        SDL_SemWait(other->start);
+        if(other->quit) {
+            break;
+        }
+        engine_render(other->engine, other->out, other->frames);
+        SDL_SemPost(other->done);
+    }
+    return 0;
+}
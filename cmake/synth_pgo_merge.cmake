@@ -0,0 +1,14 @@
+#
+# Merges the raw profiles clang wrote during synth_pgo_train into the file SYNTH_PGO=use reads.
+#
+#   cmake -DPROFDATA=llvm-profdata -DDIR=<profile dir> -DOUTPUT=<file.profdata> -P synth_pgo_merge.cmake
+#
+
+file(GLOB raw_profiles "${DIR}/*.profraw")
+if(NOT raw_profiles)
+    message(FATAL_ERROR "no raw profiles in ${DIR}, was the build configured with SYNTH_PGO=generate?")
+endif()
+execute_process(COMMAND "${PROFDATA}" merge "-output=${OUTPUT}" ${raw_profiles} RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+    message(FATAL_ERROR "llvm-profdata merge failed")
+endif()
@@ -0,0 +1,4081 @@
+/*
+ 
+ This is free and unencumbered software released into the public domain.
+ 
+ Anyone is free to copy, modify, publish, use, compile, sell, or
+ distribute this software, either in source code form or as a compiled
+ binary, for any purpose, commercial or non-commercial, and by any
+ means.
+ 
+ In jurisdictions that recognize copyright laws, the author or authors
+ of this software dedicate any and all copyright interest in the
+ software to the public domain. We make this dedication for the benefit
+ of the public at large and to the detriment of our heirs and
+ successors. We intend this dedication to be an overt act of
+ relinquishment in perpetuity of all present and future rights to this
+ software under copyright law.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ OTHER DEALINGS IN THE SOFTWARE.
+ 
+ For more information, please refer to <http://unlicense.org>
+ 
+ ----------------------------------------------------------------
+ 
+ Synth Samples SDL2 C - the engine of sample 3, see synth_engine.h.
+ 
+ dialect: C89
+ dependencies: SDL2
+ 
+*/
+
+#include "synth_engine.h"
+
+#if defined(SYNTH_SSE2)
+#include <emmintrin.h>
+#endif
+#if defined(SYNTH_AVX2)
+#include <immintrin.h>
+#endif
+#if defined(SYNTH_NEON)
+#include <arm_neon.h>
+#endif
+
+/* tells the CPU a thread is spinning, so it backs off and leaves the core to the other hardware thread */
+#if defined(SYNTH_SSE2)
+#define SYNTH_CPU_PAUSE() _mm_pause()
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__aarch64__) || defined(__arm__))
+#define SYNTH_CPU_PAUSE() __asm__ __volatile__("yield")
+#else
+#define SYNTH_CPU_PAUSE()
+#endif
+
+/* small samples and the table cache are mapped into memory, where the platform has a way to do it */
+#if defined(_WIN32)
+#define SYNTH_MAP_WIN32
+#include <windows.h>
+#elif defined(__unix__) || defined(__APPLE__)
+#define SYNTH_MAP_POSIX
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+/* general */
+int debuglog = 0;
+static int alloc_count = 0;
+double performance_frequency = 1; /* SDL_GetPerformanceFrequency, set in init_engine_data */
+
+/* arena */
+#define ARENA_ALIGNMENT 64 /* of the arena and of every allocation, also the size of a block header */
+#define ARENA_SLACK 65536 /* for allocations that can't be known up front, like the score */
+struct arena_header {
+    size_t size; /* of the block, header included */
+    size_t below; /* offset of the block below */
+    int freed;
+};
+struct arena {
+    void *memory; /* from malloc */
+    Uint8 *base; /* memory rounded up to ARENA_ALIGNMENT */
+    size_t size;
+    size_t used;
+    size_t top; /* offset of the last block */
+};
+static void arena_init(size_t size);
+static void arena_destroy(void);
+static size_t get_arena_size(const struct engine_settings *settings, int engines, size_t extra_size);
+static size_t get_engine_size(const struct engine_settings *settings);
+#ifndef NDEBUG
+static int on_render_thread(void); /* only the asserts ask */
+#endif
+static struct arena arena;
+SDL_atomic_t in_audio_callback; /* set by the program while it renders audio */
+SDL_threadID audio_thread_id = 0;
+
+/* mapped files, read only */
+static void *map_file(const char *path, Sint64 length);
+static void unmap_file(void *map, Sint64 length);
+
+/* voice */
+static const double pi = 3.14159265358979323846;
+static const double chromatic_ratio = 1.059463094359295264562;
+int table_length = 1024; /* must be a power of two, the oscillator wraps with a mask */
+int table_bits = 10; /* log2 of table_length */
+int16_t *sine_wave_table;
+float *wave_table; /* sine_wave_table as float in the range -1.0 to 1.0, read by the oscillator kernels */
+
+/* wavetable bank */
+#define MAX_WAVE_LEVELS 16
+static void build_wave_bank(void);
+static void get_wave_harmonics(int waveform, double *sine_amps, double *cosine_amps, int harmonics);
+static void get_user_wave_harmonics(double *sine_amps, double *cosine_amps, int harmonics);
+static void build_wave_levels(int waveform, const double *sine_amps, const double *cosine_amps, int harmonics);
+static void normalize_wave(int waveform);
+static int load_user_wave(const char *path);
+static int get_wave_level(double phase_increment);
+static void update_wave_level(struct engine *engine, int voice);
+static float *wave_bank[WAVE_COUNT][MAX_WAVE_LEVELS]; /* mip levels of each waveform, level 0 has the most harmonics */
+static int wave_levels = 0;
+static double *wave_sines; /* one cycle of sine in double precision, used to build the bank */
+static float *user_wave = NULL; /* single cycle loaded with --wave */
+static int user_wave_length = 0;
+const char *user_wave_path = NULL;
+const char *wave_names[WAVE_COUNT] = {"sine", "saw", "square", "triangle", "user"};
+static int wave_ready[WAVE_COUNT]; /* the levels were built or mapped, set on the main thread before the waveform is used */
+
+/* table cache */
+#define TABLE_CACHE_VERSION 1
+struct table_cache_header {
+    char magic[8]; /* "SYNTHTBL" */
+    Uint32 version;
+    Uint32 waveform;
+    Uint32 table_length;
+    Uint32 levels;
+    float check; /* 0.25f, so a file from a machine with another float layout is not used */
+    Uint32 padding; /* keeps the tables 8 byte aligned */
+};
+static void set_table_cache_directory(void);
+static int get_table_cache_path(int waveform, char *path, size_t size);
+static int map_cached_wave(int waveform);
+static void write_cached_wave(int waveform);
+static Sint64 get_cached_wave_size(void);
+const char *table_cache_option = NULL; /* --cache, a directory or off */
+static char table_cache_directory[512]; /* empty when there is no cache */
+static void *wave_map[WAVE_COUNT]; /* cache file the levels of a waveform are read from, NULL when they were built */
+
+/* pitch table */
+#define PITCH_TABLE_CENTS 100 /* fine tune resolution, steps per halfnote */
+static void update_pitch_table(struct engine *engine);
+int max_note = 131;
+int min_note = 12;
+static double pitch_cents_ratio[PITCH_TABLE_CENTS + 1]; /* pitch ratio for 0-100 cents, the same at every rate */
+
+/* functions */
+static void write_voice_samples(struct engine *engine, int voice, float *left, float *right, int frames, int overwrite, struct voice_scratch *scratch);
+static void write_voice_group(struct engine *engine, const int *voices, int count, float *left, float *right, int frames, int overwrite, struct voice_scratch *scratch);
+static void render_voice_oscillator(struct engine *engine, int voice, float *out, int frames);
+static void render_mix_bus(struct engine *engine, float *left, float *right, int frames);
+
+/* oscillator kernels */
+static void select_simd_kernels(void);
+static void (*render_oscillator)(const float *table, int length, double *phase, double phase_increment, float *out, int frames) = render_oscillator_scalar;
+
+/* fixed point oscillator */
+#define FRACTION_SCALE (1.0f / 16777216.0f) /* the fraction is taken as the 24 bits below the index */
+static float cubic_hermite(float y0, float y1, float y2, float y3, float fraction);
+static void (*render_oscillator_linear)(const float *table, int bits, Uint32 *phase, Uint32 step, float *out, int frames) = render_oscillator_linear_scalar;
+static void (*render_oscillator_cubic)(const float *table, int bits, Uint32 *phase, Uint32 step, float *out, int frames) = render_oscillator_cubic_scalar;
+
+/* mix bus and output conversion */
+static void convert_mix_bus_scalar(const float *in, Sint16 *out, int frames);
+static void interleave_bus_scalar(const float *left, const float *right, float *out, int frames);
+#if defined(SYNTH_SSE2)
+static void convert_mix_bus_sse2(const float *in, Sint16 *out, int frames);
+static void interleave_bus_sse2(const float *left, const float *right, float *out, int frames);
+#endif
+#if defined(SYNTH_NEON)
+static void convert_mix_bus_neon(const float *in, Sint16 *out, int frames);
+static void interleave_bus_neon(const float *left, const float *right, float *out, int frames);
+#endif
+void (*convert_mix_bus)(const float *in, Sint16 *out, int frames) = convert_mix_bus_scalar;
+static void (*interleave_bus)(const float *left, const float *right, float *out, int frames) = interleave_bus_scalar;
+static Uint32 dither_state[4] = {0x12345678, 0x9abcdef1, 0x2468ace1, 0x13579bdf}; /* xorshift state, one per SIMD lane */
+
+/* master effects */
+#define MAX_DELAY_SECONDS 2.0
+#define REVERB_MAX_SECONDS 0.08 /* room for the longest line, 59 ms */
+#define REVERB_OUTPUT_GAIN 0.25
+#define HADAMARD_SCALE 0.35355339f /* 1 / sqrt(REVERB_LINES), keeps the matrix from adding energy */
+static int get_ring_length(double seconds, int rate);
+#define DELAY_DAMPING 0.3 /* 0.0-1.0, how much darker each repeat gets */
+static void init_effects(struct engine *engine);
+static int get_effects_tail(struct engine *engine);
+static void process_delay(struct engine *engine, float *left, float *right, int frames);
+static void update_reverb_rates(struct engine *engine);
+static void process_reverb(struct engine *engine, float *left, float *right, int frames);
+static const int reverb_base_lengths[REVERB_LINES] = {1031, 1327, 1523, 1733, 1913, 2129, 2357, 2621}; /* primes, frames at 44.1kHz */
+
+/* parameter smoothing, works on blocks so any parameter (gain, pan, cutoff) can use it */
+static void smoother_init(struct smoother *smoother, int type, double seconds, int rate, float value);
+static void smoother_set_time(struct smoother *smoother, double seconds, int rate);
+static void smooth_block(struct smoother *smoother, float target, float *out, int frames);
+static void update_smoothing_rates(struct engine *engine);
+
+/* voice pool */
+static void voice_note_off(struct engine *engine, Sint32 key);
+static int find_free_voice(struct engine *engine);
+static double voice_mix_gain = 0.25; /* headroom for stacked voices */
+
+/* control envelopes, for the filter and the modulation matrix */
+static double update_control_envelope(struct engine *engine, const struct control_envelope *envelope, int *stage, double *level, int pressed, int frames);
+
+/* filter */
+#define FILTER_RECALC_OCTAVES (1.0 / 72) /* a sixth of a halfnote, smaller cutoff changes keep the coefficients */
+static void (*render_filter)(struct filter_lanes *filter, float *lanes, int frames) = render_filter_scalar;
+static int filter_lanes = 4; /* voices in a group, the width of the filter kernel, engines take both when they are made */
+int filter_enabled = true; /* --filter off leaves it out */
+
+/* modulation */
+static void update_lfos(struct engine *engine, struct synth_part *part, int frames);
+static double update_modulation(struct engine *engine, int voice, int frames);
+static const char *lfo_shape_names[LFO_SHAPE_COUNT] = {"sine", "triangle", "square", "saw"};
+static const char *mod_source_names[MOD_SOURCE_COUNT] = {"lfo1", "lfo2", "envelope", "velocity"};
+static const char *mod_destination_names[MOD_DESTINATION_COUNT] = {"pitch", "amp", "cutoff"};
+
+/* worker pool */
+#define POOL_MIN_FRAMES 256 /* smaller callbacks are rendered on the audio thread alone */
+#define POOL_MIN_COST 16 /* as are chunks with less work than this, about 5 filtered oscillators */
+#define POOL_SPIN_SECONDS 0.0002 /* how long a worker spins for the next chunk before it sleeps */
+#define POOL_WAIT_SECONDS 0.0005 /* how long the audio thread spins for a worker before it yields */
+#define POOL_IDLE 0 /* worker states for the current chunk */
+#define POOL_ASSIGNED 1
+#define POOL_RUNNING 2
+struct pool_worker {
+    SDL_Thread *thread;
+    SDL_sem *wake;
+    SDL_atomic_t sleeping;
+    SDL_atomic_t state; /* POOL_ASSIGNED when handed a chunk, POOL_RUNNING once it started on it */
+    int index;
+    int rendered; /* voices rendered in the current chunk */
+    float *left; /* where the voices are rendered, partial buses or the chunk itself for worker 0 */
+    float *right;
+    float partial_left[MAX_CHUNK_FRAMES];
+    float partial_right[MAX_CHUNK_FRAMES];
+    struct voice_scratch scratch;
+};
+static int get_voice_cost(struct engine *engine, int voice);
+static int pool_worker_main(void *data);
+static int wait_for_work(struct pool_worker *worker, int seen);
+static void render_worker_voices(struct pool_worker *worker);
+static int render_voices_parallel(struct engine *engine, float *left, float *right, int frames);
+int pool_threads = 1; /* set with --threads and always 1-MAX_WORKERS, 1 renders on the audio thread only */
+static struct pool_worker pool_workers[MAX_WORKERS];
+static int pool_list[MAX_WORKERS][MAX_VOICES]; /* voices given to each worker for the chunk */
+static int pool_list_length[MAX_WORKERS];
+static SDL_atomic_t pool_cursor[MAX_WORKERS]; /* next voice to take from each list */
+static SDL_atomic_t pool_generation; /* increased for every chunk handed out */
+static SDL_atomic_t pool_pending; /* workers that have not finished the chunk */
+static SDL_atomic_t pool_quit;
+static int pool_frames = 0;
+static Uint64 pool_spin_ticks = 0;
+static Uint64 pool_wait_ticks = 0;
+static struct engine *pool_engine = NULL; /* the engine whose chunk the workers render */
+
+/* sampler */
+#define SAMPLE_PATH_LENGTH 512
+#define SAMPLE_MAP_BYTES (16 * 1024 * 1024) /* files up to this size are mapped whole, larger ones are streamed */
+#define SAMPLE_ATTACK_FRAMES 32768 /* frames at the start of a streamed sample that stay in memory */
+#define MAX_SAMPLE_FRAME_BYTES 8 /* two channels of 32 bits */
+#define MAX_SAMPLER_RATIO 4 /* fastest playback, two octaves above the root */
+#define STREAM_RING_FRAMES 16384 /* per voice, must be a power of two */
+#define STREAM_READ_FRAMES 4096 /* frames the prefetch thread reads at a time */
+#define STREAM_POLL_MILLISECONDS 5 /* how often the prefetch thread tops up the rings without a request */
+#define STREAM_WAIT_MILLISECONDS 1000 /* longest a headless render waits for the data of one chunk */
+#define STREAM_MAX_GENERATION (INT_MAX / MAX_SAMPLES - 1)
+#define SAMPLE_PCM16 0
+#define SAMPLE_PCM24 1
+#define SAMPLE_PCM32 2
+#define SAMPLE_FLOAT32 3
+struct sample {
+    char path[SAMPLE_PATH_LENGTH];
+    int root_note; /* note the file plays at its own rate */
+    int low_note; /* notes low_note to high_note play this sample */
+    int high_note;
+    int format;
+    int channels; /* 1 or 2, stereo is mixed to mono */
+    int frame_bytes;
+    int rate;
+    int frames;
+    Sint64 data_offset; /* of the first frame in the file */
+    Sint64 file_size;
+    const Uint8 *data; /* first frame of the mapped file or of the resident attack */
+    int resident_frames; /* frames in data, all of them when the file is mapped */
+    void *map; /* the mapped file, NULL when it is streamed */
+    Uint8 *attack; /* arena copy of the attack of a streamed sample */
+};
+static int read_instrument(const char *path);
+static int read_sample_header(struct sample *sample);
+static void open_samples(void);
+static void close_samples(void);
+static int find_sample_zone(int note);
+static void start_sample_stream(struct engine *engine, int voice);
+static double get_sample_ratio(struct engine *engine, int voice, const struct sample *sample);
+static void render_sampler_voice(struct engine *engine, int voice, float *out, int frames);
+static int get_stream_available(struct engine *engine, int voice, const struct sample *sample);
+static void wait_for_stream(struct engine *engine, int voice, const struct sample *sample, int end);
+static float decode_sample_frame(const struct sample *sample, const Uint8 *frame);
+static void start_prefetch_thread(struct engine *engine);
+static void stop_prefetch_thread(struct engine *engine);
+static int prefetch_thread_main(void *data);
+static int fill_stream_ring(struct engine *engine, int voice, int request, int fill);
+const char *sampler_path = NULL;
+static struct sample samples[MAX_SAMPLES];
+static int sample_count = 0;
+static int streamed_samples = 0; /* samples too large to map, set in read_instrument */
+int stream_wait = false; /* headless renders wait for streamed data instead of playing silence */
+SDL_atomic_t stream_misses;
+
+/* event queue */
+static int pop_event(struct event_queue *queue, struct synth_event *event);
+static int event_queue_empty(struct event_queue *queue);
+static void process_event(struct engine *engine, const struct synth_event *event);
+static void start_event_block(struct engine *engine);
+static void schedule_events(struct engine *engine);
+static void schedule_queue_events(struct engine *engine, struct event_queue *queue);
+static int apply_events(struct engine *engine, int begin, int length);
+
+/* amplitude envelope */
+static void next_envelope_stage(struct engine *engine, int voice);
+static void update_envelope_rates(struct engine *engine, struct synth_part *part);
+static int envelope_rates_changed(struct engine *engine, struct synth_part *part);
+
+/* amplitude smoothing */
+double smoothing_time = 0.0023; /* seconds for a full 0-1 change, about 100 frames at 44.1kHz */
+double smoothing_enabled = true;
+
+/* patches */
+#define PATCH_FRESH 4 /* set in patch_middle while the middle slot holds a patch the audio thread has not taken */
+static void apply_patch(struct engine *engine, int part_index, const struct patch *patch);
+static void take_patch(struct engine *engine, int part_index);
+struct patch default_patch = { /* the settings from the command line, what a patch file leaves out */
+    WAVE_SINE, {1.0, 0.5, 0.5, 0.0}, 1, 0, 0, /* waveform, ADSR amp range 0.0-1.0, envelope speed 1-8, fine tune and pan */
+    FILTER_DEFAULT_CUTOFF, 0.2, 3, /* cutoff, resonance 0.0-1.0 and how far the filter envelope opens the cutoff */
+    {{0.005, 0.4, 0.4}, 0.25}, {{0.3, 1.0, 0.5}, 0.0}, /* filter and modulation envelopes */
+    {{LFO_SINE, 5.0, 0, 0}, {LFO_TRIANGLE, 0.5, 0, 0}},
+    {{MOD_SOURCE_LFO1, MOD_PITCH, 0}}, 1, /* route 0 is the vibrato, --mod adds more */
+    {0.375, 0.5}, 0.35, 0, /* delay seconds left and right, feedback 0.0-0.95 and send level, 0 turns it off */
+    2.0, 0.4, 0 /* seconds for the reverb tail to fall 60 dB, damping 0.0-1.0 and send level */
+};
+
+int parse_mod_route(const char *text, struct mod_route *routes, int *count) {
+    
+    /* add a route written as source:destination:amount to routes, returns 0 if it was added */
+    
+    char source[16];
+    char destination[16];
+    double amount;
+    int i;
+    struct mod_route route;
+    if(*count == MAX_MOD_ROUTES || sscanf(text, "%15[^:]:%15[^:]:%lf", source, destination, &amount) != 3) {
+        return 1;
+    }
+    route.source = -1;
+    route.destination = -1;
+    route.amount = amount;
+    for(i = 0; i < MOD_SOURCE_COUNT; i++) {
+        if(strcmp(source, mod_source_names[i]) == 0) {
+            route.source = i;
+        }
+    }
+    for(i = 0; i < MOD_DESTINATION_COUNT; i++) {
+        if(strcmp(destination, mod_destination_names[i]) == 0) {
+            route.destination = i;
+        }
+    }
+    if(route.source < 0 || route.destination < 0) {
+        return 1;
+    }
+    routes[*count] = route;
+    (*count)++;
+    return 0;
+}
+
+int parse_lfo(const char *text, struct lfo *lfo_settings) {
+    
+    /* set an LFO written as number:rate:shape, like 1:5:sine, returns 0 if it was set */
+    
+    char shape[16];
+    int number;
+    double rate;
+    int i;
+    if(sscanf(text, "%d:%lf:%15s", &number, &rate, shape) != 3 || number < 1 || number > MAX_LFOS || rate <= 0) {
+        return 1;
+    }
+    for(i = 0; i < LFO_SHAPE_COUNT; i++) {
+        if(strcmp(shape, lfo_shape_names[i]) == 0) {
+            lfo_settings[number - 1].shape = i;
+            lfo_settings[number - 1].rate = rate;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int parse_effect(const char *text, int delay, struct patch *patch) {
+    
+    /* set the delay from left:right:feedback:mix or the reverb from seconds:damping:mix, returns 0 if it was set */
+    
+    double v[4];
+    if(delay) {
+        if(sscanf(text, "%lf:%lf:%lf:%lf", &v[0], &v[1], &v[2], &v[3]) != 4 || v[0] <= 0 || v[0] > MAX_DELAY_SECONDS ||
+           v[1] <= 0 || v[1] > MAX_DELAY_SECONDS || v[2] < 0 || v[2] > 0.95 || v[3] < 0 || v[3] > 1) {
+            return 1;
+        }
+        patch->delay_times[0] = v[0];
+        patch->delay_times[1] = v[1];
+        patch->delay_feedback = v[2];
+        patch->delay_mix = v[3];
+    } else {
+        if(sscanf(text, "%lf:%lf:%lf", &v[0], &v[1], &v[2]) != 3 || v[0] < 0.1 || v[0] > 30 ||
+           v[1] < 0 || v[1] > 1 || v[2] < 0 || v[2] > 1) {
+            return 1;
+        }
+        patch->reverb_time = v[0];
+        patch->reverb_damping = v[1];
+        patch->reverb_mix = v[2];
+    }
+    return 0;
+}
+
+static void apply_patch(struct engine *engine, int part_index, const struct patch *patch) {
+    
+    /*
+        Use a patch on the render thread. Sounding notes keep their waveform and pan, the envelope
+        rates and filter coefficients are worked out again at the next chunk since they are
+        compared against the settings they were made for. The master effects are shared, so
+        they follow the patch of part 0.
+    */
+    
+    struct synth_part *part = &engine->parts[part_index];
+    int i;
+    part->waveform = patch->waveform;
+    for(i = 0; i < 4; i++) {
+        part->envelope_data[i] = patch->envelope_data[i];
+    }
+    part->envelope_speed_scale = patch->envelope_speed_scale;
+    part->fine_tune_cents = patch->fine_tune_cents;
+    part->note_pan = patch->pan;
+    part->filter_cutoff = patch->filter_cutoff;
+    part->filter_resonance = patch->filter_resonance;
+    part->filter_envelope_octaves = patch->filter_envelope_octaves;
+    part->filter_envelope = patch->filter_envelope;
+    part->mod_envelope = patch->mod_envelope;
+    for(i = 0; i < MAX_LFOS; i++) {
+        part->lfos[i].shape = patch->lfos[i].shape;
+        part->lfos[i].rate = patch->lfos[i].rate;
+    }
+    for(i = 0; i < patch->mod_route_count; i++) {
+        part->mod_routes[i] = patch->mod_routes[i];
+    }
+    part->mod_route_count = patch->mod_route_count;
+    if(part_index != 0) {
+        return;
+    }
+    engine->delay_times[0] = patch->delay_times[0];
+    engine->delay_times[1] = patch->delay_times[1];
+    engine->delay_feedback = patch->delay_feedback;
+    engine->delay_mix = patch->delay_mix;
+    engine->reverb_time = patch->reverb_time;
+    engine->reverb_damping = patch->reverb_damping;
+    engine->reverb_mix = patch->reverb_mix;
+}
+
+int load_patch(const char *path, struct patch *patch) {
+    
+    /*
+        A patch is a text file with one setting per line, what it leaves out keeps the value
+        the synth was started with:
+            waveform <sine|saw|square|triangle|user>
+            envelope <node 0> <node 1> <node 2> <node 3>   amp levels 0.0-1.0
+            speed <1-8>                                    envelope speed
+            tune <cents>
+            pan <-1.0 to 1.0>
+            cutoff <Hz>
+            resonance <0.0-1.0>
+            filter_amount <octaves>
+            filter_envelope <attack> <decay> <release> <sustain>
+            mod_envelope <attack> <decay> <release> <sustain>
+            lfo <number:rate:shape>
+            vibrato <cents>                                amount of route 0
+            mod <source:destination:amount>                replaces the routes after route 0
+            delay <left:right:feedback:mix>                seconds, seconds, 0.0-0.95, 0.0-1.0
+            reverb <seconds:damping:mix>
+        Lines starting with # are ignored. Returns 0 if the whole file was read, the patch
+        should not be used otherwise.
+    */
+    
+    char line[256];
+    int line_number = 0;
+    int routes_replaced = false;
+    FILE *file = fopen(path, "r");
+    if(file == NULL) {
+        printf("could not open patch %s\n", path);
+        return 1;
+    }
+    *patch = default_patch;
+    while(fgets(line, sizeof(line), file) != NULL) {
+        char name[32];
+        char text[64];
+        double v[4];
+        int values;
+        int i;
+        int valid = true;
+        line_number++;
+        if(line[0] == '#' || sscanf(line, "%31s", name) != 1) {
+            continue;
+        }
+        values = sscanf(line, "%*s %lf %lf %lf %lf", &v[0], &v[1], &v[2], &v[3]);
+        if(strcmp(name, "waveform") == 0) {
+            valid = false;
+            if(sscanf(line, "%*s %63s", text) == 1) {
+                for(i = 0; i < WAVE_COUNT; i++) {
+                    if(strcmp(text, wave_names[i]) == 0) {
+                        patch->waveform = i;
+                        valid = true;
+                    }
+                }
+            }
+        } else if(strcmp(name, "envelope") == 0) {
+            valid = values == 4;
+            for(i = 0; i < 4 && valid; i++) {
+                valid = v[i] >= 0 && v[i] <= 1;
+                patch->envelope_data[i] = v[i];
+            }
+        } else if(strcmp(name, "speed") == 0) {
+            valid = values == 1 && v[0] >= 1 && v[0] <= 8;
+            patch->envelope_speed_scale = floor(v[0]);
+        } else if(strcmp(name, "tune") == 0) {
+            valid = values == 1 && fabs(v[0]) <= 100;
+            patch->fine_tune_cents = v[0];
+        } else if(strcmp(name, "pan") == 0) {
+            valid = values == 1 && fabs(v[0]) <= 1;
+            patch->pan = v[0];
+        } else if(strcmp(name, "cutoff") == 0) {
+            valid = values == 1 && v[0] >= 20 && v[0] <= 20000;
+            patch->filter_cutoff = v[0];
+        } else if(strcmp(name, "resonance") == 0) {
+            valid = values == 1 && v[0] >= 0 && v[0] <= 1;
+            patch->filter_resonance = v[0];
+        } else if(strcmp(name, "filter_amount") == 0) {
+            valid = values == 1 && fabs(v[0]) <= 8;
+            patch->filter_envelope_octaves = v[0];
+        } else if(strcmp(name, "filter_envelope") == 0 || strcmp(name, "mod_envelope") == 0) {
+            struct control_envelope *envelope = (name[0] == 'f') ? &patch->filter_envelope : &patch->mod_envelope;
+            valid = values == 4 && v[0] > 0 && v[1] > 0 && v[2] > 0 && v[3] >= 0 && v[3] <= 1;
+            for(i = 0; i < 3; i++) {
+                envelope->times[i] = v[i];
+            }
+            envelope->sustain = v[3];
+        } else if(strcmp(name, "lfo") == 0) {
+            valid = sscanf(line, "%*s %63s", text) == 1 && parse_lfo(text, patch->lfos) == 0;
+        } else if(strcmp(name, "delay") == 0 || strcmp(name, "reverb") == 0) {
+            valid = sscanf(line, "%*s %63s", text) == 1 && parse_effect(text, name[0] == 'd', patch) == 0;
+        } else if(strcmp(name, "vibrato") == 0) {
+            valid = values == 1;
+            patch->mod_routes[0].amount = v[0];
+        } else if(strcmp(name, "mod") == 0) {
+            if(!routes_replaced) {
+                patch->mod_route_count = 1;
+                routes_replaced = true;
+            }
+            valid = sscanf(line, "%*s %63s", text) == 1 && parse_mod_route(text, patch->mod_routes, &patch->mod_route_count) == 0;
+        } else {
+            printf("patch line %d: unknown setting %s\n", line_number, name);
+            fclose(file);
+            return 1;
+        }
+        if(!valid) {
+            printf("patch line %d: bad value for %s\n", line_number, name);
+            fclose(file);
+            return 1;
+        }
+    }
+    fclose(file);
+    return 0;
+}
+
+void publish_patch(struct synth_part *part, const struct patch *patch) {
+    
+    /*
+        Write the patch into the back slot and swap it into the middle, marked fresh. Whatever
+        was in the middle becomes the new back slot, it is either an older patch the audio
+        thread never took or the slot it just let go of. Only the main thread calls this.
+    */
+    
+    part->patch_slots[part->patch_back] = *patch;
+    part->patch_back = SDL_AtomicSet(&part->patch_middle, part->patch_back | PATCH_FRESH) & ~PATCH_FRESH;
+}
+
+static void take_patch(struct engine *engine, int part_index) {
+    
+    /* at the start of a block, swap a fresh middle slot of a part with its front slot and use it */
+    
+    struct synth_part *part = &engine->parts[part_index];
+    if((SDL_AtomicGet(&part->patch_middle) & PATCH_FRESH) == 0) {
+        return;
+    }
+    part->patch_front = SDL_AtomicSet(&part->patch_middle, part->patch_front) & ~PATCH_FRESH;
+    apply_patch(engine, part_index, &part->patch_slots[part->patch_front]);
+}
+
+void init_engine_data(const struct engine_settings *settings, int engines, size_t extra_size) {
+    
+    /*
+        Set up what every engine shares, on the main thread before the first engine_create:
+        the arena, with room for engines engines made with settings and extra_size bytes the
+        program allocates itself, the tables, the kernels for this CPU and the instrument.
+    */
+    
+    int i;
+    
+    /* the headers of the instrument samples tell how much of them the arena has to hold */
+    sample_count = 0;
+    streamed_samples = 0;
+    if(sampler_path != NULL && read_instrument(sampler_path) != 0) {
+        sample_count = 0;
+        streamed_samples = 0;
+    }
+    
+    /* everything below is allocated from one arena */
+    arena_init(get_arena_size(settings, engines, extra_size));
+    
+    /* allocate memory for sine table and build it */
+    table_bits = 0;
+    while((1 << table_bits) < table_length) {
+        table_bits++;
+    }
+    sine_wave_table = alloc_memory(sizeof(int16_t)*table_length, "PCM table");
+    build_sine_table(sine_wave_table, table_length);
+    
+    /* the oscillator kernels read a float copy of the table */
+    wave_table = alloc_memory(sizeof(float)*table_length, "oscillator table");
+    for(i = 0; i < table_length; i++) {
+        wave_table[i] = sine_wave_table[i] / (float)INT16_MAX;
+    }
+    select_simd_kernels();
+    
+    /* build the band limited tables for the other waveforms */
+    wave_sines = alloc_memory(sizeof(double)*table_length, "sine");
+    for(i = 0; i < table_length; i++) {
+        wave_sines[i] = sin(2.0 * pi * i / table_length);
+    }
+    if(user_wave_path != NULL) {
+        load_user_wave(user_wave_path);
+    }
+    build_wave_bank();
+    
+    performance_frequency = (double)SDL_GetPerformanceFrequency();
+    
+    /* the pitch ratio of every cent between two halfnotes, each engine makes its own phase increments */
+    for(i = 0; i <= PITCH_TABLE_CENTS; i++) {
+        pitch_cents_ratio[i] = pow(chromatic_ratio, i / (double)PITCH_TABLE_CENTS);
+    }
+    
+    /* map the small samples and read the attacks of the large ones, the engines stream the rest */
+    open_samples();
+}
+
+void cleanup_engine_data(void) {
+    
+    /* after the last engine_destroy, with everything the program allocated given back */
+    
+    int w;
+    int level;
+    close_samples();
+    for(w = WAVE_SAW; w < WAVE_COUNT; w++) {
+        if(wave_map[w] != NULL) {
+            unmap_file(wave_map[w], get_cached_wave_size());
+            wave_map[w] = NULL;
+            for(level = 0; level < MAX_WAVE_LEVELS; level++) {
+                wave_bank[w][level] = NULL;
+            }
+        }
+        for(level = 0; level < MAX_WAVE_LEVELS; level++) {
+            wave_bank[w][level] = free_memory(wave_bank[w][level]);
+        }
+        wave_ready[w] = false;
+    }
+    free_memory(wave_sines);
+    free_memory(user_wave);
+    free_memory(sine_wave_table);
+    free_memory(wave_table);
+    printf("alloc count:%d\n", alloc_count);
+    arena_destroy();
+}
+
+static void arena_init(size_t size) {
+    
+    /*
+        Take one block from the heap for everything the synth allocates. The block is aligned to
+        ARENA_ALIGNMENT and so is every allocation in it, which suits any SIMD load.
+    */
+    
+    size_t address;
+    arena.memory = malloc(size + ARENA_ALIGNMENT);
+    if(arena.memory == NULL) {
+        printf("arena_init error: malloc with size %lu returned NULL.\n", (unsigned long)size);
+        arena.base = NULL;
+        arena.size = 0;
+        return;
+    }
+    address = (size_t)arena.memory;
+    arena.base = (Uint8*)arena.memory + (ARENA_ALIGNMENT - address % ARENA_ALIGNMENT) % ARENA_ALIGNMENT;
+    arena.size = size;
+    arena.used = 0;
+    arena.top = 0;
+    if(debuglog) { printf("arena size:%lu bytes\n", (unsigned long)size); }
+}
+
+static void arena_destroy(void) {
+    if(arena.used > 0) {
+        printf("arena_destroy: %lu bytes still in use\n", (unsigned long)arena.used);
+    }
+    free(arena.memory);
+    arena.memory = NULL;
+    arena.base = NULL;
+    arena.size = 0;
+    arena.used = 0;
+}
+
+static size_t get_arena_size(const struct engine_settings *settings, int engines, size_t extra_size) {
+    
+    /* what init_engine_data and engines engines take, extra_size and room for a score and a user wave */
+    
+    size_t levels = 1;
+    size_t size = 0;
+    int i;
+    while(((size_t)table_length >> levels) > 0) {
+        levels++;
+    }
+    size += table_length * (sizeof(int16_t) + sizeof(float) + sizeof(double)); /* sine table, wave_table, wave_sines */
+    size += (WAVE_COUNT - 1) * levels * table_length * sizeof(float); /* wave bank */
+    size += (2 * (table_length / 2 + 1) + table_length) * sizeof(double); /* harmonics and sums while building a waveform */
+    size += engines * get_engine_size(settings);
+    size += extra_size;
+    for(i = 0; i < sample_count; i++) {
+        if(samples[i].file_size > SAMPLE_MAP_BYTES) {
+            size += (size_t)(samples[i].frames < SAMPLE_ATTACK_FRAMES ? samples[i].frames : SAMPLE_ATTACK_FRAMES) * samples[i].frame_bytes; /* attack */
+        }
+    }
+    size += (32 + sample_count) * ARENA_ALIGNMENT; /* block headers */
+    size += ARENA_SLACK;
+    return size;
+}
+
+static size_t get_engine_size(const struct engine_settings *settings) {
+    
+    /* what engine_create takes for settings */
+    
+    size_t size = sizeof(struct engine);
+    size += (max_note - min_note + 1) * sizeof(double); /* pitch table */
+    size += 2 * (size_t)settings->bus_frames * sizeof(float); /* buses */
+    size += 2 * (size_t)get_ring_length(MAX_DELAY_SECONDS, settings->sample_rate) * sizeof(float); /* delay lines */
+    size += REVERB_LINES * (size_t)get_ring_length(REVERB_MAX_SECONDS, settings->sample_rate) * sizeof(float); /* reverb lines */
+    if(streamed_samples > 0) {
+        size += (size_t)settings->voice_count * STREAM_RING_FRAMES * MAX_SAMPLE_FRAME_BYTES; /* stream rings */
+    }
+    size += 8 * ARENA_ALIGNMENT; /* block headers */
+    return size;
+}
+
+int get_chunk_frames(int buffer_frames, int largest) {
+    
+    /*
+        The largest chunk up to largest that divides buffer_frames evenly, so that no block ends
+        with a short chunk. If nothing down to 8 frames divides it, largest, and the last chunk of
+        each block is shorter.
+    */
+    
+    int size = largest;
+    if(buffer_frames < size) {
+        size = buffer_frames;
+    } else {
+        while(size > 8 && buffer_frames % size != 0) {
+            size--;
+        }
+        if(buffer_frames % size != 0) {
+            size = largest;
+        }
+    }
+    return size;
+}
+
+#ifndef NDEBUG
+static int on_render_thread(void) {
+    
+    /* true on the audio thread while the program has in_audio_callback set, and on the worker pool threads */
+    
+    int w;
+    SDL_threadID id = SDL_ThreadID();
+    if(SDL_AtomicGet(&in_audio_callback) && id == audio_thread_id) {
+        return true;
+    }
+    for(w = 1; w < pool_threads; w++) {
+        if(pool_workers[w].thread != NULL && id == SDL_GetThreadID(pool_workers[w].thread)) {
+            return true;
+        }
+    }
+    return false;
+}
+#endif
+
+static void *map_file(const char *path, Sint64 length) {
+    
+    /* map a whole file of length bytes, returns NULL if it can't be mapped or has another length */
+    
+    void *map = NULL;
+#if defined(SYNTH_MAP_WIN32)
+    HANDLE mapping;
+    LARGE_INTEGER size;
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if(file == INVALID_HANDLE_VALUE) {
+        return NULL;
+    }
+    if(!GetFileSizeEx(file, &size) || size.QuadPart != length || length == 0) {
+        CloseHandle(file);
+        return NULL;
+    }
+    mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if(mapping == NULL) {
+        return NULL;
+    }
+    /* the view keeps the mapping open */
+    map = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+#elif defined(SYNTH_MAP_POSIX)
+    struct stat status;
+    int file = open(path, O_RDONLY);
+    if(file < 0) {
+        return NULL;
+    }
+    if(fstat(file, &status) != 0 || status.st_size != length || length == 0) {
+        close(file);
+        return NULL;
+    }
+    map = mmap(NULL, (size_t)length, PROT_READ, MAP_PRIVATE, file, 0);
+    close(file);
+    if(map == MAP_FAILED) {
+        map = NULL;
+    }
+#else
+    (void)path;
+    (void)length;
+#endif
+    return map;
+}
+
+static void unmap_file(void *map, Sint64 length) {
+    
+#if defined(SYNTH_MAP_WIN32)
+    (void)length;
+    UnmapViewOfFile(map);
+#elif defined(SYNTH_MAP_POSIX)
+    munmap(map, (size_t)length);
+#else
+    (void)map;
+    (void)length;
+#endif
+}
+
+void *alloc_memory(size_t size, char *name) {
+    
+    /*
+        Allocate from the arena. Every block starts with a header that links back to the block
+        below it, so freed blocks on top of the arena are given back. Blocks freed further down
+        are given back once everything above them is freed. If the arena is full the heap is used
+        instead, with a message so the size can be adjusted.
+        Nothing may be allocated while rendering, which is checked with an assert in debug builds.
+    */
+    
+    void *ptr = NULL;
+    size_t block_size = ARENA_ALIGNMENT + (size + ARENA_ALIGNMENT - 1) / ARENA_ALIGNMENT * ARENA_ALIGNMENT;
+    assert(!on_render_thread() && "alloc_memory called while rendering audio");
+    if(arena.base != NULL && arena.used + block_size <= arena.size) {
+        struct arena_header *header = (struct arena_header*)(arena.base + arena.used);
+        header->size = block_size;
+        header->below = arena.top;
+        header->freed = false;
+        arena.top = arena.used;
+        arena.used += block_size;
+        ptr = (Uint8*)header + ARENA_ALIGNMENT;
+    } else {
+        if(arena.base != NULL) {
+            printf("alloc_memory: arena full, %s taken from the heap.\n", name);
+        }
+        ptr = malloc(size);
+    }
+    if(ptr == NULL) {
+        if(debuglog) {
+            printf("alloc_memory error: malloc with size %lu returned NULL.\n name:%s", (unsigned long)size, name);
+        }
+    } else {
+        alloc_count++;
+    }
+    return ptr;
+}
+
+void *free_memory(void *ptr) {
+    
+    Uint8 *block = ptr;
+    if(ptr == NULL) {
+        return NULL;
+    }
+    assert(!on_render_thread() && "free_memory called while rendering audio");
+    alloc_count--;
+    if(arena.base == NULL || block < arena.base || block >= arena.base + arena.size) {
+        free(ptr);
+        return NULL;
+    }
+    ((struct arena_header*)(block - ARENA_ALIGNMENT))->freed = true;
+    
+    /* give back every freed block on top of the arena */
+    while(arena.used > 0) {
+        struct arena_header *top = (struct arena_header*)(arena.base + arena.top);
+        if(!top->freed) {
+            break;
+        }
+        arena.used = arena.top;
+        arena.top = top->below;
+    }
+    return NULL;
+}
+
+static void build_wave_bank(void) {
+    
+    /*
+        Set up the mip levels of every waveform. Level 0 holds all harmonics the table can hold
+        (table_length / 2), and every level above has half as many as the one below, so each
+        level is clean for one more octave. Sine has only one harmonic, so all its levels use
+        wave_table. The other waveforms are built or read from the table cache the first time
+        they are used, see prepare_waveform, so only the waveform new notes start with is made
+        here.
+    */
+    
+    int w;
+    int level;
+    int harmonics = table_length / 2;
+    
+    wave_levels = 0;
+    while((harmonics >> wave_levels) > 0 && wave_levels < MAX_WAVE_LEVELS) {
+        wave_levels++;
+    }
+    
+    for(level = 0; level < wave_levels; level++) {
+        wave_bank[WAVE_SINE][level] = wave_table;
+    }
+    for(w = 0; w < WAVE_COUNT; w++) {
+        wave_ready[w] = (w == WAVE_SINE);
+        wave_map[w] = NULL;
+    }
+    set_table_cache_directory();
+    prepare_waveform(default_patch.waveform);
+}
+
+void prepare_waveform(int w) {
+    
+    /*
+        Make sure the levels of a waveform exist before the audio thread is told to use it, only
+        called on the main thread. They are mapped from the table cache when it has them, and
+        built and written to the cache otherwise.
+    */
+    
+    int level;
+    int harmonics = table_length / 2;
+    double *sine_amps;
+    double *cosine_amps;
+    if(w < 0 || w >= WAVE_COUNT || wave_ready[w]) {
+        return;
+    }
+    if(map_cached_wave(w) == 0) {
+        wave_ready[w] = true;
+        return;
+    }
+    
+    /* the levels stay, so they go below the scratch that is given back when they are built */
+    for(level = 0; level < wave_levels; level++) {
+        if(wave_bank[w][level] == NULL) {
+            wave_bank[w][level] = alloc_memory(sizeof(float) * table_length, "wave bank");
+        }
+    }
+    sine_amps = alloc_memory(sizeof(double) * (harmonics + 1), "harmonics");
+    cosine_amps = alloc_memory(sizeof(double) * (harmonics + 1), "harmonics");
+    if(w == WAVE_USER) {
+        get_user_wave_harmonics(sine_amps, cosine_amps, harmonics);
+    } else {
+        get_wave_harmonics(w, sine_amps, cosine_amps, harmonics);
+    }
+    build_wave_levels(w, sine_amps, cosine_amps, harmonics);
+    normalize_wave(w);
+    free_memory(sine_amps);
+    free_memory(cosine_amps);
+    wave_ready[w] = true;
+    write_cached_wave(w);
+}
+
+static void get_wave_harmonics(int waveform, double *sine_amps, double *cosine_amps, int harmonics) {
+    
+    /* the fourier series of the classic waveforms, all built from sines */
+    
+    int h;
+    for(h = 0; h <= harmonics; h++) {
+        sine_amps[h] = 0;
+        cosine_amps[h] = 0;
+        if(h == 0) {
+            continue;
+        }
+        switch(waveform) {
+            case WAVE_SAW:
+                sine_amps[h] = ((h % 2) ? 2.0 : -2.0) / (pi * h);
+                break;
+            case WAVE_SQUARE:
+                if(h % 2) {
+                    sine_amps[h] = 4.0 / (pi * h);
+                }
+                break;
+            case WAVE_TRIANGLE:
+                if(h % 2) {
+                    sine_amps[h] = ((h % 4 == 1) ? 8.0 : -8.0) / (pi * pi * h * h);
+                }
+                break;
+        }
+    }
+}
+
+static void get_user_wave_harmonics(double *sine_amps, double *cosine_amps, int harmonics) {
+    
+    /*
+        Analyse the user cycle with a discrete fourier transform. The cycle is first resampled to
+        table_length with linear interpolation. Without a user cycle an organ like set of harmonics
+        is used instead.
+    */
+    
+    int h;
+    int i;
+    if(user_wave == NULL) {
+        for(h = 0; h <= harmonics; h++) {
+            sine_amps[h] = 0;
+            cosine_amps[h] = 0;
+        }
+        sine_amps[1] = 0.6;
+        if(harmonics >= 8) {
+            sine_amps[2] = 0.4;
+            sine_amps[3] = 0.25;
+            sine_amps[4] = 0.2;
+            sine_amps[6] = 0.1;
+            sine_amps[8] = 0.08;
+        }
+        return;
+    }
+    
+    for(h = 0; h <= harmonics; h++) {
+        double re = 0;
+        double im = 0;
+        for(i = 0; i < table_length; i++) {
+            double position = i * user_wave_length / (double)table_length;
+            int index = (int)position;
+            double fraction = position - index;
+            double sample = user_wave[index] + (user_wave[(index + 1) % user_wave_length] - user_wave[index]) * fraction;
+            /* sin and cos of 2*pi*h*i/table_length, read from the sine table in double precision */
+            int sine_index = (int)(((long)h * i) & (table_length - 1));
+            int cosine_index = (sine_index + table_length / 4) & (table_length - 1);
+            re += sample * wave_sines[cosine_index];
+            im += sample * wave_sines[sine_index];
+        }
+        sine_amps[h] = (h == 0) ? 0 : 2.0 * im / table_length;
+        cosine_amps[h] = (h == 0) ? 0 : 2.0 * re / table_length;
+    }
+}
+
+static void build_wave_levels(int w, const double *sine_amps, const double *cosine_amps, int harmonics) {
+    
+    /*
+        Additive synthesis of all levels of a waveform. sin(2*pi*h*i/length) repeats every
+        table_length, so it is read from wave_sines with a mask instead of calling sin. The levels
+        are built from the top down: a level has the harmonics of the one above and the ones
+        between, so the sums of the level above are carried on with just those. Each sample still
+        adds its harmonics from the first one up, so every level comes out the same as when it
+        was summed on its own. Harmonics without amplitude, like the even ones of a square, are
+        skipped.
+    */
+    
+    int i;
+    int h;
+    int level;
+    int first_harmonic = 1;
+    int mask = table_length - 1;
+    int quarter = table_length / 4;
+    double *sums = alloc_memory(sizeof(double) * table_length, "harmonic sums");
+    for(i = 0; i < table_length; i++) {
+        sums[i] = 0;
+    }
+    for(level = wave_levels - 1; level >= 0; level--) {
+        int max_harmonic = harmonics >> level;
+        float *data = wave_bank[w][level];
+        for(h = first_harmonic; h <= max_harmonic; h++) {
+            double sine_amp = sine_amps[h];
+            double cosine_amp = cosine_amps[h];
+            int sine_index = 0;
+            if(sine_amp == 0 && cosine_amp == 0) {
+                continue;
+            }
+            for(i = 0; i < table_length; i++) {
+                sums[i] += sine_amp * wave_sines[sine_index] + cosine_amp * wave_sines[(sine_index + quarter) & mask];
+                sine_index = (sine_index + h) & mask;
+            }
+        }
+        for(i = 0; i < table_length; i++) {
+            data[i] = (float)sums[i];
+        }
+        first_harmonic = max_harmonic + 1;
+    }
+    free_memory(sums);
+}
+
+static void set_table_cache_directory(void) {
+    
+    /* --cache names the directory, by default it is the pref path SDL gives the sample */
+    
+    char *pref_path;
+    table_cache_directory[0] = '\0';
+    if(table_cache_option != NULL) {
+        if(strcmp(table_cache_option, "off") != 0 && strlen(table_cache_option) < sizeof(table_cache_directory) - 2) {
+            strcpy(table_cache_directory, table_cache_option);
+            if(table_cache_directory[strlen(table_cache_directory) - 1] != '/' && table_cache_directory[strlen(table_cache_directory) - 1] != '\\') {
+                strcat(table_cache_directory, "/");
+            }
+        }
+        return;
+    }
+    pref_path = SDL_GetPrefPath("lundstroem", "synth_samples_sdl2");
+    if(pref_path != NULL) {
+        if(strlen(pref_path) < sizeof(table_cache_directory)) {
+            strcpy(table_cache_directory, pref_path);
+        }
+        SDL_free(pref_path);
+    }
+}
+
+static int get_table_cache_path(int w, char *path, size_t size) {
+    
+    /*
+        The cache file of a waveform at the current table length, like wave_saw_1024.tbl. Returns
+        0 if the waveform can be cached, a user wave loaded with --wave is not since it depends on
+        the file.
+    */
+    
+    if(table_cache_directory[0] == '\0' || (w == WAVE_USER && user_wave != NULL) ||
+       strlen(table_cache_directory) + 32 > size) {
+        return 1;
+    }
+    sprintf(path, "%swave_%s_%d.tbl", table_cache_directory, wave_names[w], table_length);
+    return 0;
+}
+
+static Sint64 get_cached_wave_size(void) {
+    
+    return (Sint64)sizeof(struct table_cache_header) + (Sint64)wave_levels * table_length * sizeof(float);
+}
+
+static int map_cached_wave(int w) {
+    
+    /* point the levels of a waveform into its mapped cache file, returns 0 if the file was valid */
+    
+    char path[600];
+    const struct table_cache_header *header;
+    const float *tables;
+    int level;
+    if(get_table_cache_path(w, path, sizeof(path)) != 0) {
+        return 1;
+    }
+    wave_map[w] = map_file(path, get_cached_wave_size());
+    if(wave_map[w] == NULL) {
+        return 1;
+    }
+    header = wave_map[w];
+    if(memcmp(header->magic, "SYNTHTBL", 8) != 0 || header->version != TABLE_CACHE_VERSION || header->waveform != (Uint32)w ||
+       header->table_length != (Uint32)table_length || header->levels != (Uint32)wave_levels || header->check != 0.25f) {
+        unmap_file(wave_map[w], get_cached_wave_size());
+        wave_map[w] = NULL;
+        return 1;
+    }
+    tables = (const float*)(header + 1);
+    for(level = 0; level < wave_levels; level++) {
+        /* the mapping is read only, nothing writes to a level once it is built */
+        wave_bank[w][level] = (float*)(tables + (size_t)level * table_length);
+    }
+    if(debuglog) {
+        printf("mapped %s\n", path);
+    }
+    return 0;
+}
+
+static void write_cached_wave(int w) {
+    
+    /*
+        Write the levels of a waveform to the cache. The file is written under a temporary name
+        and renamed when it is complete, so another instance starting at the same time either
+        maps the whole file or does not find it.
+    */
+    
+    char path[600];
+    char temporary_path[640];
+    struct table_cache_header header;
+    FILE *file;
+    int level;
+    int written = true;
+    if(get_table_cache_path(w, path, sizeof(path)) != 0) {
+        return;
+    }
+    sprintf(temporary_path, "%s.%lu", path, (unsigned long)(SDL_GetPerformanceCounter() & 0xFFFFFF));
+    file = fopen(temporary_path, "wb");
+    if(file == NULL) {
+        return;
+    }
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "SYNTHTBL", 8);
+    header.version = TABLE_CACHE_VERSION;
+    header.waveform = w;
+    header.table_length = table_length;
+    header.levels = wave_levels;
+    header.check = 0.25f;
+    written = fwrite(&header, sizeof(header), 1, file) == 1;
+    for(level = 0; level < wave_levels && written; level++) {
+        written = fwrite(wave_bank[w][level], sizeof(float), table_length, file) == (size_t)table_length;
+    }
+    if(fclose(file) != 0 || !written || rename(temporary_path, path) != 0) {
+        remove(temporary_path);
+        return;
+    }
+    if(debuglog) {
+        printf("wrote %s\n", path);
+    }
+}
+
+static void normalize_wave(int waveform) {
+    
+    /* scale all levels by the same amount so level 0 peaks at 1.0 and every level is equally loud */
+    
+    int i;
+    int level;
+    float peak = 0;
+    for(i = 0; i < table_length; i++) {
+        float value = (float)fabs(wave_bank[waveform][0][i]);
+        if(value > peak) {
+            peak = value;
+        }
+    }
+    if(peak <= 0) {
+        return;
+    }
+    for(level = 0; level < wave_levels; level++) {
+        for(i = 0; i < table_length; i++) {
+            wave_bank[waveform][level][i] /= peak;
+        }
+    }
+}
+
+static int load_user_wave(const char *path) {
+    
+    /* read a single cycle from a text file with one sample (-1.0 to 1.0) per line */
+    
+    char line[64];
+    int count = 0;
+    FILE *file = fopen(path, "r");
+    if(file == NULL) {
+        printf("could not open wave %s\n", path);
+        return 1;
+    }
+    while(fgets(line, sizeof(line), file) != NULL) {
+        count++;
+    }
+    if(count < 2) {
+        printf("wave %s needs at least 2 samples\n", path);
+        fclose(file);
+        return 1;
+    }
+    user_wave = alloc_memory(sizeof(float) * count, "user wave");
+    rewind(file);
+    user_wave_length = 0;
+    while(user_wave_length < count && fgets(line, sizeof(line), file) != NULL) {
+        user_wave[user_wave_length++] = (float)atof(line);
+    }
+    fclose(file);
+    return 0;
+}
+
+static int get_wave_level(double phase_increment) {
+    
+    /*
+        A harmonic h plays at h * phase_increment * sample_rate / table_length, which has to stay
+        below half the sample rate. Level 0 is clean up to an increment of 1 and every level
+        above doubles that, so the level is the number of doublings from 1 to the increment.
+    */
+    
+    int level = 0;
+    double limit = 1;
+    while(limit < phase_increment && level < wave_levels - 1) {
+        limit *= 2;
+        level++;
+    }
+    return level;
+}
+
+static void update_wave_level(struct engine *engine, int voice) {
+    
+    /*
+        Pick the mip level with as many harmonics as the voice can play without aliasing. Bends
+        and pitch modulation change the increment while the note plays, so write_samples picks
+        it again every chunk.
+    */
+    
+    engine->voice_table[voice] = wave_bank[engine->voice_waveform[voice]][get_wave_level(engine->voice_phase_increment[voice])];
+    if(engine->voice_table[voice] == NULL) {
+        engine->voice_table[voice] = wave_table; /* a waveform that was never prepared plays as a sine */
+    }
+}
+
+void build_sine_table(int16_t *data, int wave_length) {
+    
+    /* 
+        Build sine table to use as oscillator:
+        Generate a 16bit signed integer sinewave table with 1024 samples.
+        This table will be used to produce the notes.
+        Different notes will be created by stepping through
+        the table at different intervals (phase).
+    */
+    int i;
+    double phase_increment = (2.0f * pi) / (double)wave_length;
+    double current_phase = 0;
+    for(i = 0; i < wave_length; i++) {
+        int sample = (int)(sin(current_phase) * INT16_MAX);
+        data[i] = (int16_t)sample;
+        current_phase += phase_increment;
+    }
+}
+
+double get_pitch(double note) {
+    
+    /*
+        Calculate pitch from note value.
+        offset note by 57 halfnotes to get correct pitch from the range we have chosen for the notes.
+    */
+    double p = pow(chromatic_ratio, note - 57);
+    p *= 440;
+    return p;
+}
+
+static void update_pitch_table(struct engine *engine) {
+    
+    /*
+        Precalculate the phase increment for every note, depending on the sample rate of the
+        engine and the table length. The pitch ratio for every cent between two halfnotes is
+        the same for all engines and made in init_engine_data.
+    */
+    
+    int i;
+    double d_sample_rate = engine->sample_rate;
+    double d_table_length = table_length;
+    for(i = min_note; i <= max_note; i++) {
+        engine->pitch_increments[i - min_note] = (get_pitch(i) / d_sample_rate) * d_table_length;
+    }
+}
+
+int push_event(struct event_queue *queue, const struct synth_event *event) {
+    
+    /*
+        Producer side of the ring buffer. The event is copied in first and the write index is
+        published afterwards, so the consumer never sees a half written event.
+        Returns false if the queue is full.
+    */
+    
+    int write_index = SDL_AtomicGet(&queue->write_index);
+    int next_index = (write_index + 1) & (EVENT_QUEUE_SIZE - 1);
+    if(next_index == SDL_AtomicGet(&queue->read_index)) {
+        return false;
+    }
+    queue->events[write_index] = *event;
+    SDL_MemoryBarrierRelease();
+    SDL_AtomicSet(&queue->write_index, next_index);
+    return true;
+}
+
+static int pop_event(struct event_queue *queue, struct synth_event *event) {
+    
+    /* consumer side of the ring buffer, returns false if there are no events */
+    
+    int read_index = SDL_AtomicGet(&queue->read_index);
+    if(read_index == SDL_AtomicGet(&queue->write_index)) {
+        return false;
+    }
+    SDL_MemoryBarrierAcquire();
+    *event = queue->events[read_index];
+    SDL_MemoryBarrierRelease();
+    SDL_AtomicSet(&queue->read_index, (read_index + 1) & (EVENT_QUEUE_SIZE - 1));
+    return true;
+}
+
+static int event_queue_empty(struct event_queue *queue) {
+    return SDL_AtomicGet(&queue->read_index) == SDL_AtomicGet(&queue->write_index);
+}
+
+void send_note_event(struct engine *engine, int type, Sint32 key, int note) {
+    
+    struct synth_event event;
+    event.type = type;
+    event.timestamp = SDL_GetPerformanceCounter();
+    event.frame = EVENT_FRAME_FROM_TIMESTAMP;
+    event.part = KEYBOARD_PART;
+    event.key = key;
+    event.note = note;
+    event.value = 1; /* the computer keyboard always plays at full velocity */
+    if(!push_event(&engine->input_queue, &event)) {
+        t_log("event queue full, note event dropped.");
+    }
+}
+
+void send_parameter_event(struct engine *engine, int parameter, double value) {
+    
+    struct synth_event event;
+    event.type = EVENT_PARAMETER;
+    event.timestamp = SDL_GetPerformanceCounter();
+    event.frame = EVENT_FRAME_FROM_TIMESTAMP;
+    event.part = KEYBOARD_PART;
+    event.key = 0;
+    event.note = parameter;
+    event.value = value;
+    if(!push_event(&engine->input_queue, &event)) {
+        t_log("event queue full, parameter event dropped.");
+    }
+}
+
+static void start_event_block(struct engine *engine) {
+    
+    /*
+        Called at the start of every block. Events with a timestamp are placed in the
+        buffer by how long after the start of the previous callback they were sent, so they are
+        all one buffer late but keep their exact distance to each other.
+    */
+    
+    engine->previous_block_ticks = engine->block_ticks;
+    engine->block_ticks = SDL_GetPerformanceCounter();
+    if(engine->previous_block_ticks == 0) {
+        engine->previous_block_ticks = engine->block_ticks;
+    }
+}
+
+static void schedule_events(struct engine *engine) {
+    
+    /* move the events that have arrived to the pending list, sorted by the frame they happen at */
+    
+    schedule_queue_events(engine, &engine->input_queue);
+    schedule_queue_events(engine, &engine->midi_queue);
+}
+
+static void schedule_queue_events(struct engine *engine, struct event_queue *queue) {
+    
+    struct synth_event event;
+    if(event_queue_empty(queue)) {
+        return;
+    }
+    while(true) {
+        int i;
+        if(engine->pending_last == EVENT_QUEUE_SIZE) {
+            if(engine->pending_first == 0) {
+                /* full, the rest stays in the queue until there is room */
+                return;
+            }
+            memmove(engine->pending_events, engine->pending_events + engine->pending_first, sizeof(struct synth_event) * (engine->pending_last - engine->pending_first));
+            engine->pending_last -= engine->pending_first;
+            engine->pending_first = 0;
+        }
+        if(!pop_event(queue, &event)) {
+            return;
+        }
+        if(event.frame == EVENT_FRAME_FROM_TIMESTAMP) {
+            double offset = 0;
+            if(event.timestamp > engine->previous_block_ticks) {
+                offset = (event.timestamp - engine->previous_block_ticks) * (double)engine->sample_rate / performance_frequency;
+            }
+            event.frame = engine->block_start_frame + (Uint64)offset;
+        }
+        /* events mostly arrive in order, so this rarely moves anything */
+        i = engine->pending_last;
+        while(i > engine->pending_first && engine->pending_events[i - 1].frame > event.frame) {
+            engine->pending_events[i] = engine->pending_events[i - 1];
+            i--;
+        }
+        engine->pending_events[i] = event;
+        engine->pending_last++;
+    }
+}
+
+static int apply_events(struct engine *engine, int begin, int length) {
+    
+    /*
+        Apply the pending events that are due at frame begin of the buffer, and return how many
+        frames can be rendered before the next one, at most length. With nothing pending this is
+        a single compare.
+    */
+    
+    Uint64 position = engine->rendered_frames + begin;
+    while(engine->pending_first < engine->pending_last && engine->pending_events[engine->pending_first].frame <= position) {
+        process_event(engine, &engine->pending_events[engine->pending_first]);
+        engine->pending_first++;
+    }
+    if(engine->pending_first == engine->pending_last) {
+        engine->pending_first = 0;
+        engine->pending_last = 0;
+        return length;
+    }
+    if(engine->pending_events[engine->pending_first].frame < position + length) {
+        length = (int)(engine->pending_events[engine->pending_first].frame - position);
+    }
+    return length;
+}
+
+static void process_event(struct engine *engine, const struct synth_event *event) {
+    
+    struct synth_part *part = &engine->parts[event->part];
+    switch(event->type) {
+        case EVENT_NOTE_ON:
+            voice_note_on(engine, event->part, event->key, event->note, event->value);
+            break;
+        case EVENT_NOTE_OFF:
+            voice_note_off(engine, event->key);
+            break;
+        case EVENT_PARAMETER:
+            switch(event->note) {
+                case PARAMETER_PITCH_BEND:
+                    part->pitch_bend_cents = event->value;
+                    break;
+                case PARAMETER_FINE_TUNE:
+                    part->fine_tune_cents = event->value;
+                    break;
+                case PARAMETER_ENVELOPE_SPEED:
+                    part->envelope_speed_scale = event->value;
+                    break;
+                case PARAMETER_WAVEFORM:
+                    part->waveform = (int)event->value;
+                    break;
+                case PARAMETER_PAN:
+                    part->note_pan = event->value;
+                    break;
+                case PARAMETER_FILTER_CUTOFF:
+                    part->filter_cutoff = event->value;
+                    break;
+                case PARAMETER_FILTER_RESONANCE:
+                    part->filter_resonance = event->value;
+                    break;
+                case PARAMETER_VIBRATO:
+                    part->mod_routes[0].amount = event->value;
+                    break;
+                case PARAMETER_DELAY_MIX:
+                    engine->delay_mix = event->value;
+                    break;
+                case PARAMETER_REVERB_MIX:
+                    engine->reverb_mix = event->value;
+                    break;
+            }
+            break;
+    }
+}
+
+double get_phase_increment(struct engine *engine, int note, double cents) {
+    
+    /* look up the phase increment for a note offset by cents, the result is kept within min_note and max_note */
+    
+    int total = (int)floor(note * PITCH_TABLE_CENTS + cents + 0.5);
+    int base_note = total / PITCH_TABLE_CENTS;
+    int base_cents = total % PITCH_TABLE_CENTS;
+    if(base_note < min_note) {
+        return engine->pitch_increments[0];
+    }
+    if(base_note >= max_note) {
+        return engine->pitch_increments[max_note - min_note];
+    }
+    return engine->pitch_increments[base_note - min_note] * pitch_cents_ratio[base_cents];
+}
+
+struct engine *engine_create(const struct engine_settings *settings) {
+    
+    /*
+        Make an engine with every part on default_patch and all voices free, on the main thread.
+        The tables, samples and kernels are only read by the engines, so they are set up once in
+        init_engine_data before the first engine and shared by all of them. An engine has its own
+        settings, pitch table, buses, effect lines and, with a streamed instrument, stream rings
+        and prefetch thread. Only one engine can have use_pool set.
+    */
+    
+    struct engine *engine = alloc_memory(sizeof(struct engine), "engine");
+    int i;
+    int v;
+    if(engine == NULL) {
+        return NULL;
+    }
+    memset(engine, 0, sizeof(struct engine));
+    engine->sample_rate = settings->sample_rate;
+    engine->chunk_frames = settings->chunk_frames;
+    engine->voice_count = settings->voice_count;
+    engine->oscillator_mode = settings->oscillator_mode;
+    engine->use_pool = settings->use_pool;
+    engine->filter_lanes = filter_lanes;
+    engine->render_filter = render_filter;
+    engine->pitch_increments = alloc_memory(sizeof(double)*(max_note - min_note + 1), "pitch table");
+    update_pitch_table(engine);
+    
+    /* slot 2 of each triple buffer starts in the middle */
+    for(i = 0; i < MAX_PARTS; i++) {
+        struct synth_part *part = &engine->parts[i];
+        apply_patch(engine, i, &default_patch);
+        part->patch_back = 0;
+        part->patch_front = 1;
+        SDL_AtomicSet(&part->patch_middle, 2);
+        update_envelope_rates(engine, part);
+    }
+    engine->delay_damping = DELAY_DAMPING;
+    
+    /* the float buses hold one pass per channel */
+    engine->bus_frames = settings->bus_frames;
+    engine->bus_left = alloc_memory(sizeof(float)*engine->bus_frames, "mix bus");
+    engine->bus_right = alloc_memory(sizeof(float)*engine->bus_frames, "mix bus");
+    init_effects(engine);
+    
+    /* all voices start out free */
+    for(v = 0; v < MAX_VOICES; v++) {
+        engine->voice_part[v] = 0;
+        engine->voice_note[v] = -1;
+        engine->voice_key[v] = 0;
+        engine->voice_key_pressed[v] = false;
+        engine->voice_age[v] = 0;
+        engine->voice_phase[v] = 0;
+        engine->voice_phase_fixed[v] = 0;
+        engine->voice_phase_increment[v] = 0;
+        engine->voice_waveform[v] = 0;
+        engine->voice_table[v] = wave_table;
+        engine->voice_pan_left[v] = 1;
+        engine->voice_pan_right[v] = 1;
+        engine->voice_envelope_stage[v] = ENVELOPE_IDLE;
+        engine->voice_envelope_level[v] = 0;
+        engine->voice_envelope_remaining[v] = 0;
+        smoother_init(&engine->voice_amp[v], SMOOTH_LINEAR, smoothing_time, engine->sample_rate, 0);
+        engine->voice_filter_stage[v] = CONTROL_ENVELOPE_RELEASE;
+        engine->voice_filter_level[v] = 0;
+        engine->voice_mod_stage[v] = CONTROL_ENVELOPE_RELEASE;
+        engine->voice_mod_level[v] = 0;
+        engine->voice_mod_pitch[v] = 0;
+        engine->voice_mod_amp[v] = 1;
+        engine->voice_mod_amp_start[v] = 1;
+        engine->voice_mod_cutoff[v] = 0;
+        engine->voice_filter_base[v] = -1;
+        engine->voice_filter_ic1[v] = 0;
+        engine->voice_filter_ic2[v] = 0;
+        engine->voice_sample[v] = -1;
+        engine->voice_sample_position[v] = 0;
+        engine->voice_stream_generation[v] = 0;
+        SDL_AtomicSet(&engine->voice_stream_request[v], 0);
+        SDL_AtomicSet(&engine->voice_stream_ready[v], 0);
+        SDL_AtomicSet(&engine->voice_stream_end[v], 0);
+        SDL_AtomicSet(&engine->voice_stream_used[v], 0);
+    }
+    
+    
+    /* the streamed samples are read through files of its own, so engines don't move each other's file positions */
+    if(streamed_samples > 0) {
+        engine->stream_rings = alloc_memory((size_t)engine->voice_count * STREAM_RING_FRAMES * MAX_SAMPLE_FRAME_BYTES, "stream rings");
+        for(i = 0; i < sample_count; i++) {
+            if(samples[i].resident_frames < samples[i].frames) {
+                engine->stream_files[i] = SDL_RWFromFile(samples[i].path, "rb");
+                if(engine->stream_files[i] == NULL) {
+                    printf("could not open sample %s, it stops after the attack\n", samples[i].path);
+                }
+            }
+        }
+        start_prefetch_thread(engine);
+    }
+    return engine;
+}
+
+void engine_destroy(struct engine *engine) {
+    
+    int i;
+    if(engine == NULL) {
+        return;
+    }
+    stop_prefetch_thread(engine);
+    for(i = 0; i < MAX_SAMPLES; i++) {
+        if(engine->stream_files[i] != NULL) {
+            SDL_RWclose(engine->stream_files[i]);
+        }
+    }
+    free_memory(engine->stream_rings);
+    free_memory(engine->reverb_data);
+    free_memory(engine->delay_data[1]);
+    free_memory(engine->delay_data[0]);
+    free_memory(engine->bus_right);
+    free_memory(engine->bus_left);
+    free_memory(engine->pitch_increments);
+    free_memory(engine);
+}
+
+int engine_begin_block(struct engine *engine, int frames) {
+    
+    /*
+        Start a block of frames on the render thread: take the patches that are new, start the
+        event timeline of the block and move the events that arrived to the pending list. Returns
+        false when nothing sounds and nothing is waiting, then the block counts as rendered and
+        the caller writes silence. Otherwise render the block with render_mix_bus, in passes of
+        at most bus_frames.
+    */
+    
+    int i;
+    for(i = 0; i < MAX_PARTS; i++) {
+        take_patch(engine, i);
+    }
+    start_event_block(engine);
+    engine->block_start_frame = engine->rendered_frames;
+    if(engine->active_voices == 0 && engine->effects_tail == 0 && engine->pending_first == engine->pending_last && event_queue_empty(&engine->input_queue) && event_queue_empty(&engine->midi_queue)) {
+        engine->rendered_frames += frames;
+        return false;
+    }
+    return true;
+}
+
+int engine_render(struct engine *engine, float *out, int frames) {
+    
+    /*
+        Render frames of interleaved float stereo into out. Returns false when nothing sounds and
+        out is only cleared. An engine is rendered by one thread at a time. What engines share
+        is not written while they render, and the worker pool is only used by the one engine
+        with use_pool, so each engine can be rendered on a thread of its own.
+    */
+    
+    int offset = 0;
+    if(!engine_begin_block(engine, frames)) {
+        memset(out, 0, sizeof(float) * 2 * frames);
+        return false;
+    }
+    
+    /* the pool only pays off if there is enough to render between waking it up and putting it to sleep */
+    engine->pool_enabled = (engine->use_pool && pool_threads > 1 && frames >= POOL_MIN_FRAMES);
+    while(offset < frames) {
+        int length = frames - offset;
+        if(length > engine->bus_frames) {
+            length = engine->bus_frames;
+        }
+        render_mix_bus(engine, engine->bus_left, engine->bus_right, length);
+        interleave_bus(engine->bus_left, engine->bus_right, out + offset * 2, length);
+        offset += length;
+    }
+    return true;
+}
+
+int engine_sounding(struct engine *engine) {
+    
+    /* true while a voice plays or the effects ring, only asked between blocks */
+    
+    int v;
+    for(v = 0; v < engine->voice_count; v++) {
+        if(engine->voice_note[v] > -1) {
+            return true;
+        }
+    }
+    return engine->effects_tail > 0;
+}
+
+static void render_mix_bus(struct engine *engine, float *left, float *right, int frames) {
+    
+    /* render frames of stereo into the buses, every frame is written */
+    
+    int begin = 0;
+
+    /* split the rendering up in chunks to make it buffersize agnostic, and again where events fall */
+    while (begin < frames) {
+        int length = engine->chunk_frames;
+        if (begin + length > frames) {
+            /* If the buffer is not divisible by the chunk length, write the remaining part here
+             so we don't miss it */
+            length = frames - begin;
+        }
+        schedule_events(engine);
+        length = apply_events(engine, begin, length);
+        write_samples(engine, left, right, begin, length);
+        begin += length;
+    }
+    process_master_bus(engine, left, right, frames);
+    engine->rendered_frames += frames;
+}
+
+static int get_ring_length(double seconds, int rate) {
+    
+    /* frames of a power of two ring buffer that holds seconds of audio at rate */
+    
+    int length = 1;
+    while(length < seconds * rate + 1) {
+        length <<= 1;
+    }
+    return length;
+}
+
+static void init_effects(struct engine *engine) {
+    
+    /* allocate the delay and reverb lines, they are cleared each time the effect is turned on */
+    
+    int c;
+    engine->delay_length = get_ring_length(MAX_DELAY_SECONDS, engine->sample_rate);
+    for(c = 0; c < 2; c++) {
+        engine->delay_data[c] = alloc_memory(sizeof(float) * engine->delay_length, "delay line");
+        memset(engine->delay_data[c], 0, sizeof(float) * engine->delay_length);
+    }
+    engine->reverb_length = get_ring_length(REVERB_MAX_SECONDS, engine->sample_rate);
+    engine->reverb_data = alloc_memory(sizeof(float) * engine->reverb_length * REVERB_LINES, "reverb lines");
+    memset(engine->reverb_data, 0, sizeof(float) * engine->reverb_length * REVERB_LINES);
+}
+
+void process_master_bus(struct engine *engine, float *left, float *right, int frames) {
+    
+    /*
+        Run the master effects over a pass of the buses, the delay first and then the reverb on
+        the dry signal and the echoes. Both are sends, the dry signal stays at full level. While
+        voices play the tail is set to how long the effects ring after them, and engine_sounding
+        stays true until it is over.
+    */
+    
+    if(engine->delay_mix > 0) {
+        if(!engine->delay_running) {
+            memset(engine->delay_data[0], 0, sizeof(float) * engine->delay_length);
+            memset(engine->delay_data[1], 0, sizeof(float) * engine->delay_length);
+            engine->delay_state[0] = 0;
+            engine->delay_state[1] = 0;
+            engine->delay_running = true;
+        }
+        process_delay(engine, left, right, frames);
+    } else {
+        engine->delay_running = false;
+    }
+    if(engine->reverb_mix > 0) {
+        if(!engine->reverb_running) {
+            memset(engine->reverb_data, 0, sizeof(float) * engine->reverb_length * REVERB_LINES);
+            memset(engine->reverb_state, 0, sizeof(engine->reverb_state));
+            engine->reverb_running = true;
+        }
+        if(engine->reverb_rates_sample_rate != engine->sample_rate || engine->reverb_rates_time != engine->reverb_time) {
+            update_reverb_rates(engine);
+        }
+        process_reverb(engine, left, right, frames);
+    } else {
+        engine->reverb_running = false;
+    }
+    if(engine->active_voices > 0) {
+        engine->effects_tail = get_effects_tail(engine);
+    } else {
+        engine->effects_tail = (engine->effects_tail > frames) ? engine->effects_tail - frames : 0;
+    }
+}
+
+static int get_effects_tail(struct engine *engine) {
+    
+    /* frames until the delay and reverb have fallen 100 dB after the input stops */
+    
+    double tail = 0;
+    if(engine->delay_mix > 0) {
+        double echoes = 1;
+        if(engine->delay_feedback > 0.001) {
+            echoes += ceil(log(0.00001) / log(engine->delay_feedback));
+        }
+        tail += echoes * (engine->delay_times[0] > engine->delay_times[1] ? engine->delay_times[0] : engine->delay_times[1]) * engine->sample_rate;
+    }
+    if(engine->reverb_mix > 0) {
+        tail += engine->reverb_time * 100 / 60 * engine->sample_rate;
+    }
+    return (int)tail;
+}
+
+static void process_delay(struct engine *engine, float *left, float *right, int frames) {
+    
+    /*
+        A delay line per channel, each with its own time. The echo is damped by a one pole
+        lowpass before it is fed back, so repeats get darker as they fade like tape echoes do.
+        The lines are power of two rings, so the read and write positions wrap with a mask.
+    */
+    
+    float *buses[2];
+    float feedback = (float)engine->delay_feedback;
+    float mix = (float)engine->delay_mix;
+    float damping = (float)(1 - engine->delay_damping);
+    int mask = engine->delay_length - 1;
+    int position = 0;
+    int c;
+    int i;
+    buses[0] = left;
+    buses[1] = right;
+    for(c = 0; c < 2; c++) {
+        float *bus = buses[c];
+        float *data = engine->delay_data[c];
+        float state = engine->delay_state[c];
+        int length = (int)(engine->delay_times[c] * engine->sample_rate + 0.5);
+        if(length < 1) {
+            length = 1;
+        }
+        if(length > mask) {
+            length = mask;
+        }
+        position = engine->delay_position;
+        for(i = 0; i < frames; i++) {
+            float echo = data[(position - length) & mask];
+            state += damping * (echo - state);
+            data[position] = bus[i] + state * feedback;
+            bus[i] += echo * mix;
+            position = (position + 1) & mask;
+        }
+        engine->delay_state[c] = state;
+    }
+    engine->delay_position = position;
+}
+
+static void update_reverb_rates(struct engine *engine) {
+    
+    /*
+        Scale the line lengths to the sample rate and give each line the gain that makes a trip
+        through it fall by its share of 60 dB in reverb_time, so every line fades at the same rate.
+    */
+    
+    int j;
+    for(j = 0; j < REVERB_LINES; j++) {
+        int length = (int)(reverb_base_lengths[j] * engine->sample_rate / 44100.0 + 0.5);
+        if(length > engine->reverb_length - 1) {
+            length = engine->reverb_length - 1;
+        }
+        engine->reverb_lengths[j] = length;
+        engine->reverb_gains[j] = (float)pow(10.0, -3.0 * length / (engine->reverb_time * engine->sample_rate));
+    }
+    engine->reverb_rates_sample_rate = engine->sample_rate;
+    engine->reverb_rates_time = engine->reverb_time;
+}
+
+static void process_reverb(struct engine *engine, float *left, float *right, int frames) {
+    
+    /*
+        A feedback delay network of eight lines. Every frame the line outputs are damped, scaled
+        by their decay gains and mixed with an eight point Hadamard matrix, which keeps the energy
+        and sends every line into every other, and written back with the input added. The left
+        input and output use the even lines and the right the odd ones, so the sides are
+        different but the tail is shared. The line lengths have no common factors so the echoes
+        smear into a dense tail instead of a pitched ring.
+    */
+    
+    float mix = (float)(engine->reverb_mix * REVERB_OUTPUT_GAIN);
+    float damping = (float)(1 - engine->reverb_damping);
+    float *lines[REVERB_LINES];
+    float state[REVERB_LINES]; /* the line state is kept in locals, stores to the lines could alias the globals */
+    int mask = engine->reverb_length - 1;
+    int position = engine->reverb_position;
+    int i;
+    int j;
+    int k;
+    int step;
+    for(j = 0; j < REVERB_LINES; j++) {
+        lines[j] = engine->reverb_data + j * engine->reverb_length;
+        state[j] = engine->reverb_state[j];
+    }
+    for(i = 0; i < frames; i++) {
+        float x[REVERB_LINES];
+        float out_left = 0;
+        float out_right = 0;
+        for(j = 0; j < REVERB_LINES; j++) {
+            state[j] += damping * (lines[j][(position - engine->reverb_lengths[j]) & mask] - state[j]);
+            x[j] = state[j] * engine->reverb_gains[j];
+        }
+        for(j = 0; j < REVERB_LINES; j += 2) {
+            out_left += x[j];
+            out_right += x[j + 1];
+        }
+        
+        /* fast Hadamard transform, log2(REVERB_LINES) rounds of butterflies */
+        for(step = 1; step < REVERB_LINES; step <<= 1) {
+            for(j = 0; j < REVERB_LINES; j += step * 2) {
+                for(k = j; k < j + step; k++) {
+                    float a = x[k];
+                    float b = x[k + step];
+                    x[k] = a + b;
+                    x[k + step] = a - b;
+                }
+            }
+        }
+        for(j = 0; j < REVERB_LINES; j += 2) {
+            lines[j][position] = x[j] * HADAMARD_SCALE + left[i];
+            lines[j + 1][position] = x[j + 1] * HADAMARD_SCALE + right[i];
+        }
+        left[i] += out_left * mix;
+        right[i] += out_right * mix;
+        position = (position + 1) & mask;
+    }
+    for(j = 0; j < REVERB_LINES; j++) {
+        engine->reverb_state[j] = state[j];
+    }
+    engine->reverb_position = position;
+}
+
+void write_samples(struct engine *engine, float *left, float *right, int begin, int frames) {
+    
+    /*
+        Mix every active voice into the chunk, voices are added on top of each other. The first
+        voice overwrites what was in the buses, and if no voice plays the chunk is cleared.
+        With the worker pool on and enough voices playing they are rendered on several threads.
+    */
+    
+    int i;
+    int v;
+    int rendered = 0;
+    int cost = 0;
+    if(left == NULL || right == NULL) {
+        return;
+    }
+    for(i = 0; i < MAX_PARTS; i++) {
+        struct synth_part *part = &engine->parts[i];
+        if(envelope_rates_changed(engine, part)) {
+            update_envelope_rates(engine, part);
+        }
+        update_lfos(engine, part, frames);
+    }
+    if(engine->smoothing_sample_rate != engine->sample_rate) {
+        update_smoothing_rates(engine);
+    }
+    engine->chunk_voice_count = 0;
+    for(v = 0; v < engine->voice_count; v++) {
+        if(engine->voice_note[v] > -1) {
+            struct synth_part *part = &engine->parts[engine->voice_part[v]];
+            double mod_cents = update_modulation(engine, v, frames);
+            engine->voice_phase_increment[v] = get_phase_increment(engine, engine->voice_note[v], part->pitch_bend_cents + part->fine_tune_cents + mod_cents);
+            update_wave_level(engine, v);
+            engine->chunk_voices[engine->chunk_voice_count] = v;
+            engine->chunk_voice_costs[engine->chunk_voice_count] = get_voice_cost(engine, v);
+            cost += engine->chunk_voice_costs[engine->chunk_voice_count];
+            engine->chunk_voice_count++;
+        }
+    }
+    
+    if(engine->pool_enabled && cost >= POOL_MIN_COST) {
+        rendered = render_voices_parallel(engine, left + begin, right + begin, frames);
+    } else {
+        for(i = 0; i < engine->chunk_voice_count; i += engine->filter_lanes) {
+            int count = engine->chunk_voice_count - i;
+            if(count > engine->filter_lanes) {
+                count = engine->filter_lanes;
+            }
+            write_voice_group(engine, &engine->chunk_voices[i], count, left + begin, right + begin, frames, rendered == 0, &engine->scratch);
+            rendered += count;
+        }
+    }
+    if(rendered == 0) {
+        memset(left + begin, 0, sizeof(float) * frames);
+        memset(right + begin, 0, sizeof(float) * frames);
+    }
+    
+    /* release the voices when the envelope has ended and the amp has faded out */
+    for(i = 0; i < engine->chunk_voice_count; i++) {
+        v = engine->chunk_voices[i];
+        if(engine->voice_envelope_stage[v] == ENVELOPE_IDLE && engine->voice_amp[v].current <= 0) {
+            engine->voice_note[v] = -1;
+            engine->active_voices--;
+        }
+    }
+}
+
+static void render_voice_oscillator(struct engine *engine, int voice, float *out, int frames) {
+    
+    if(engine->voice_sample[voice] >= 0) {
+        render_sampler_voice(engine, voice, out, frames);
+        return;
+    }
+    switch(engine->oscillator_mode) {
+        case OSCILLATOR_LINEAR:
+            render_oscillator_linear(engine->voice_table[voice], table_bits, &engine->voice_phase_fixed[voice], get_phase_step(engine->voice_phase_increment[voice]), out, frames);
+            break;
+        case OSCILLATOR_CUBIC:
+            render_oscillator_cubic(engine->voice_table[voice], table_bits, &engine->voice_phase_fixed[voice], get_phase_step(engine->voice_phase_increment[voice]), out, frames);
+            break;
+        default:
+            render_oscillator(engine->voice_table[voice], table_length, &engine->voice_phase[voice], engine->voice_phase_increment[voice], out, frames);
+            break;
+    }
+}
+
+static int read_instrument(const char *path) {
+    
+    /*
+        An instrument is a text file with one zone per line:
+            <root note> <low note> <high note> <file.wav>
+        Notes low to high play the file, pitched from the root note where it plays at its own
+        rate. Notes are numbered like the key notes, 12-131, and zones are cut to them. Wav
+        files can be 16, 24 or 32 bit PCM or 32 bit float, mono or stereo. File names are
+        relative to the instrument file and the whole path has to fit in SAMPLE_PATH_LENGTH.
+        Lines starting with # are ignored. Only the headers are read here, before the arena is
+        made, open_samples reads the rest. Returns 0 if every zone could be read.
+    */
+    
+    char line[SAMPLE_PATH_LENGTH + 64];
+    char name[SAMPLE_PATH_LENGTH];
+    int line_number = 0;
+    size_t directory_length = 0;
+    size_t prefix_length;
+    int i;
+    FILE *file = fopen(path, "r");
+    if(file == NULL) {
+        printf("could not open instrument %s\n", path);
+        return 1;
+    }
+    for(i = 0; path[i] != '\0'; i++) {
+        if(path[i] == '/' || path[i] == '\\') {
+            directory_length = i + 1;
+        }
+    }
+    while(fgets(line, sizeof(line), file) != NULL) {
+        struct sample *sample = &samples[sample_count];
+        line_number++;
+        if(line[0] == '#' || sscanf(line, "%511s", name) != 1) {
+            continue;
+        }
+        if(sample_count == MAX_SAMPLES) {
+            printf("instrument line %d: more than %d zones\n", line_number, MAX_SAMPLES);
+            fclose(file);
+            return 1;
+        }
+        if(sscanf(line, "%d %d %d %511[^\r\n]", &sample->root_note, &sample->low_note, &sample->high_note, name) != 4 ||
+           sample->root_note < min_note || sample->root_note > max_note) {
+            printf("instrument line %d: use root low high file.wav\n", line_number);
+            fclose(file);
+            return 1;
+        }
+        
+        /* a zone reaching past the notes there are plays the ones it covers */
+        if(sample->low_note > sample->high_note || sample->high_note < min_note || sample->low_note > max_note) {
+            printf("instrument line %d: the zone has to go from low to high and cover some of the notes %d-%d\n", line_number, min_note, max_note);
+            fclose(file);
+            return 1;
+        }
+        if(sample->low_note < min_note) {
+            sample->low_note = min_note;
+        }
+        if(sample->high_note > max_note) {
+            sample->high_note = max_note;
+        }
+        prefix_length = directory_length;
+        if(name[0] == '/' || name[0] == '\\' || (name[0] != '\0' && name[1] == ':')) {
+            prefix_length = 0;
+        }
+        if(prefix_length + strlen(name) >= SAMPLE_PATH_LENGTH) {
+            printf("instrument line %d: the path of %s is too long, it can have %d characters\n", line_number, name, SAMPLE_PATH_LENGTH - 1);
+            fclose(file);
+            return 1;
+        }
+        memcpy(sample->path, path, prefix_length);
+        strcpy(sample->path + prefix_length, name);
+        if(read_sample_header(sample) != 0) {
+            printf("instrument line %d: could not read %s, it has to be a 16, 24 or 32 bit wav file\n", line_number, sample->path);
+            fclose(file);
+            return 1;
+        }
+        if(sample->file_size > SAMPLE_MAP_BYTES) {
+            streamed_samples++;
+        }
+        sample_count++;
+    }
+    fclose(file);
+    printf("loaded instrument %s, %d zones, %d streamed\n", path, sample_count, streamed_samples);
+    return 0;
+}
+
+static int read_sample_header(struct sample *sample) {
+    
+    /* find the fmt and data chunks of a wav file, returns 0 if the sampler can play it */
+    
+    Uint8 header[40];
+    Sint64 offset = 12;
+    int found_format = false;
+    int bits = 0;
+    int tag = 0;
+    SDL_RWops *file = SDL_RWFromFile(sample->path, "rb");
+    if(file == NULL) {
+        return 1;
+    }
+    sample->file_size = SDL_RWsize(file);
+    if(SDL_RWread(file, header, 12, 1) != 1 || memcmp(header, "RIFF", 4) != 0 || memcmp(header + 8, "WAVE", 4) != 0) {
+        SDL_RWclose(file);
+        return 1;
+    }
+    while(offset + 8 <= sample->file_size) {
+        Uint32 chunk_size;
+        if(SDL_RWseek(file, offset, RW_SEEK_SET) < 0 || SDL_RWread(file, header, 8, 1) != 1) {
+            break;
+        }
+        chunk_size = header[4] | (header[5] << 8) | (header[6] << 16) | ((Uint32)header[7] << 24);
+        if(memcmp(header, "fmt ", 4) == 0 && chunk_size >= 16) {
+            if(SDL_RWread(file, header, chunk_size < sizeof(header) ? chunk_size : sizeof(header), 1) != 1) {
+                break;
+            }
+            tag = header[0] | (header[1] << 8);
+            if(tag == 0xFFFE && chunk_size >= 26) {
+                tag = header[24] | (header[25] << 8); /* WAVE_FORMAT_EXTENSIBLE, the subformat starts with the tag */
+            }
+            sample->channels = header[2] | (header[3] << 8);
+            sample->rate = header[4] | (header[5] << 8) | (header[6] << 16) | ((Uint32)header[7] << 24);
+            bits = header[14] | (header[15] << 8);
+            found_format = true;
+        } else if(memcmp(header, "data", 4) == 0 && found_format) {
+            Sint64 data_bytes = chunk_size;
+            SDL_RWclose(file);
+            if(tag == 1 && bits == 16) {
+                sample->format = SAMPLE_PCM16;
+            } else if(tag == 1 && bits == 24) {
+                sample->format = SAMPLE_PCM24;
+            } else if(tag == 1 && bits == 32) {
+                sample->format = SAMPLE_PCM32;
+            } else if(tag == 3 && bits == 32) {
+                sample->format = SAMPLE_FLOAT32;
+            } else {
+                return 1;
+            }
+            if(sample->channels < 1 || sample->channels > 2 || sample->rate < 1000) {
+                return 1;
+            }
+            /* a file that was not closed properly can have a data size that runs past its end */
+            sample->data_offset = offset + 8;
+            if(data_bytes > sample->file_size - sample->data_offset) {
+                data_bytes = sample->file_size - sample->data_offset;
+            }
+            sample->frame_bytes = sample->channels * bits / 8;
+            sample->frames = (int)(data_bytes / sample->frame_bytes < INT_MAX ? data_bytes / sample->frame_bytes : INT_MAX);
+            return sample->frames > 1 ? 0 : 1;
+        }
+        offset += 8 + (Sint64)chunk_size + (chunk_size & 1);
+    }
+    SDL_RWclose(file);
+    return 1;
+}
+
+static void open_samples(void) {
+    
+    /*
+        Map the samples read by read_instrument, or read the attack of the ones too large to map
+        into the arena, the rest of those is streamed by each engine. A file that can't be
+        mapped is streamed too. The pages of the attack are read once here, so the audio thread
+        does not wait on the disk when a mapped sample is first played.
+    */
+    
+    int i;
+    size_t page;
+    volatile Uint8 touched = 0;
+    for(i = 0; i < sample_count; i++) {
+        struct sample *sample = &samples[i];
+        SDL_RWops *file;
+        sample->map = NULL;
+        sample->attack = NULL;
+        sample->resident_frames = 0;
+        if(sample->file_size <= SAMPLE_MAP_BYTES) {
+            sample->map = map_file(sample->path, sample->file_size);
+        }
+        if(sample->map != NULL) {
+            sample->data = (const Uint8*)sample->map + sample->data_offset;
+            sample->resident_frames = sample->frames;
+            for(page = 0; page < (size_t)sample->frame_bytes * SAMPLE_ATTACK_FRAMES && page < (size_t)sample->file_size; page += 4096) {
+                touched ^= ((const Uint8*)sample->map)[page];
+            }
+            continue;
+        }
+        file = SDL_RWFromFile(sample->path, "rb");
+        if(file == NULL || SDL_RWseek(file, sample->data_offset, RW_SEEK_SET) < 0) {
+            printf("could not open sample %s\n", sample->path);
+            if(file != NULL) {
+                SDL_RWclose(file);
+            }
+            sample->frames = 0;
+            continue;
+        }
+        sample->resident_frames = sample->frames < SAMPLE_ATTACK_FRAMES ? sample->frames : SAMPLE_ATTACK_FRAMES;
+        sample->attack = alloc_memory((size_t)sample->resident_frames * sample->frame_bytes, "sample attack");
+        if(SDL_RWread(file, sample->attack, sample->frame_bytes, sample->resident_frames) != (size_t)sample->resident_frames) {
+            memset(sample->attack, 0, (size_t)sample->resident_frames * sample->frame_bytes);
+        }
+        SDL_RWclose(file);
+        sample->data = sample->attack;
+    }
+    
+    /* streamed_samples counted the files too large to map, now it counts the ones that are streamed */
+    streamed_samples = 0;
+    for(i = 0; i < sample_count; i++) {
+        if(samples[i].resident_frames < samples[i].frames) {
+            streamed_samples++;
+        }
+    }
+    (void)touched;
+}
+
+static void close_samples(void) {
+    
+    int i;
+    for(i = 0; i < sample_count; i++) {
+        if(samples[i].map != NULL) {
+            unmap_file(samples[i].map, samples[i].file_size);
+            samples[i].map = NULL;
+        }
+        samples[i].attack = free_memory(samples[i].attack);
+    }
+    sample_count = 0;
+    streamed_samples = 0;
+}
+
+static int find_sample_zone(int note) {
+    
+    /* the first zone the note falls in, -1 if the oscillator plays it */
+    
+    int i;
+    for(i = 0; i < sample_count; i++) {
+        if(samples[i].frames > 0 && note >= samples[i].low_note && note <= samples[i].high_note) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void start_sample_stream(struct engine *engine, int voice) {
+    
+    /*
+        Ask the prefetch thread to fill the ring of the voice from the end of the attack. The
+        request tells the thread which sample and carries a new generation, so data the thread
+        was still reading for the note the voice played before is never taken for this one.
+    */
+    
+    int zone = engine->voice_sample[voice];
+    engine->voice_stream_generation[voice] = engine->voice_stream_generation[voice] % STREAM_MAX_GENERATION + 1;
+    SDL_AtomicSet(&engine->voice_stream_used[voice], samples[zone].resident_frames);
+    SDL_AtomicSet(&engine->voice_stream_request[voice], engine->voice_stream_generation[voice] * MAX_SAMPLES + zone);
+    SDL_SemPost(engine->stream_wake);
+}
+
+static int get_stream_available(struct engine *engine, int voice, const struct sample *sample) {
+    
+    /* frames of the sample the voice can play, the attack plus what the ring holds for its request */
+    
+    int request = engine->voice_stream_generation[voice] * MAX_SAMPLES + engine->voice_sample[voice];
+    int end;
+    if(sample->resident_frames == sample->frames || SDL_AtomicGet(&engine->voice_stream_ready[voice]) != request) {
+        return sample->resident_frames;
+    }
+    end = SDL_AtomicGet(&engine->voice_stream_end[voice]);
+    SDL_MemoryBarrierAcquire();
+    return end;
+}
+
+static float decode_sample_frame(const struct sample *sample, const Uint8 *frame) {
+    
+    /* one frame of the file as a float, stereo is mixed to mono as the voices are */
+    
+    float value[2];
+    int c;
+    for(c = 0; c < sample->channels; c++) {
+        const Uint8 *p = frame + c * (sample->frame_bytes / sample->channels);
+        Uint32 bits;
+        switch(sample->format) {
+            case SAMPLE_PCM16:
+                value[c] = (Sint16)(p[0] | (p[1] << 8)) / 32768.0f;
+                break;
+            case SAMPLE_PCM24:
+                value[c] = (Sint32)(((Uint32)p[0] << 8) | ((Uint32)p[1] << 16) | ((Uint32)p[2] << 24)) / 2147483648.0f;
+                break;
+            case SAMPLE_PCM32:
+                value[c] = (Sint32)(p[0] | ((Uint32)p[1] << 8) | ((Uint32)p[2] << 16) | ((Uint32)p[3] << 24)) / 2147483648.0f;
+                break;
+            default:
+                bits = p[0] | ((Uint32)p[1] << 8) | ((Uint32)p[2] << 16) | ((Uint32)p[3] << 24);
+                memcpy(&value[c], &bits, sizeof(float));
+                break;
+        }
+    }
+    return sample->channels == 2 ? 0.5f * (value[0] + value[1]) : value[0];
+}
+
+static double get_sample_ratio(struct engine *engine, int voice, const struct sample *sample) {
+    
+    /* source frames the voice plays per output frame, up to MAX_SAMPLER_RATIO */
+    
+    double ratio = engine->voice_phase_increment[voice] / get_phase_increment(engine, sample->root_note, 0) * sample->rate / engine->sample_rate;
+    if(ratio > MAX_SAMPLER_RATIO) {
+        ratio = MAX_SAMPLER_RATIO;
+    }
+    return ratio;
+}
+
+static void render_sampler_voice(struct engine *engine, int voice, float *out, int frames) {
+    
+    /*
+        Play the sample of the voice zone at the voice pitch, with linear interpolation. The
+        source frames the chunk needs are decoded first, from the resident part of the sample or
+        from the voice ring past it. If the prefetch thread has not read them yet they play as
+        silence and the chunk counts as a stream miss, headless renders wait for them instead.
+    */
+    
+    float source[MAX_CHUNK_FRAMES * MAX_SAMPLER_RATIO + 2];
+    const struct sample *sample = &samples[engine->voice_sample[voice]];
+    const Uint8 *ring = NULL;
+    double ratio = get_sample_ratio(engine, voice, sample);
+    double position = engine->voice_sample_position[voice];
+    int first = (int)position;
+    int count;
+    int available;
+    int end;
+    int i;
+    if(first >= sample->frames) {
+        memset(out, 0, sizeof(float) * frames);
+        return;
+    }
+    if(engine->stream_rings != NULL) {
+        ring = engine->stream_rings + (size_t)voice * STREAM_RING_FRAMES * MAX_SAMPLE_FRAME_BYTES;
+    }
+    count = (int)(position + ratio * (frames - 1)) - first + 2;
+    end = first + count < sample->frames ? first + count : sample->frames;
+    available = get_stream_available(engine, voice, sample);
+    if(available < end && stream_wait && engine->prefetch_thread != NULL) {
+        wait_for_stream(engine, voice, sample, end);
+        available = get_stream_available(engine, voice, sample);
+    }
+    if(available < end) {
+        SDL_AtomicAdd(&stream_misses, 1);
+    }
+    for(i = 0; i < count; i++) {
+        int frame = first + i;
+        if(frame >= available) {
+            source[i] = 0;
+        } else if(frame < sample->resident_frames) {
+            source[i] = decode_sample_frame(sample, sample->data + (size_t)frame * sample->frame_bytes);
+        } else {
+            source[i] = decode_sample_frame(sample, ring + (size_t)(frame & (STREAM_RING_FRAMES - 1)) * sample->frame_bytes);
+        }
+    }
+    for(i = 0; i < frames; i++) {
+        double x = position + ratio * i - first;
+        int j = (int)x;
+        float fraction = (float)(x - j);
+        out[i] = source[j] + (source[j + 1] - source[j]) * fraction;
+    }
+    
+    /* the next chunk starts at the frame the position is on, the ring can be refilled up to it */
+    position += ratio * frames;
+    engine->voice_sample_position[voice] = position;
+    if(sample->resident_frames < sample->frames && position < sample->frames && (int)position > sample->resident_frames) {
+        SDL_AtomicSet(&engine->voice_stream_used[voice], (int)position);
+    }
+}
+
+static void wait_for_stream(struct engine *engine, int voice, const struct sample *sample, int end) {
+    
+    /*
+        Headless renders wait until the prefetch thread has read the voice up to end, sleeping on
+        stream_filled between its passes, for STREAM_WAIT_MILLISECONDS at most. The flag is set
+        before the check, so a pass that finishes in between still posts. Posts left over from an
+        earlier wait are taken first.
+    */
+    
+    Uint32 give_up = SDL_GetTicks() + STREAM_WAIT_MILLISECONDS;
+    while(SDL_SemTryWait(engine->stream_filled) == 0) {
+    }
+    for(;;) {
+        SDL_AtomicSet(&engine->stream_waiting, 1);
+        if(get_stream_available(engine, voice, sample) >= end || (Sint32)(SDL_GetTicks() - give_up) >= 0) {
+            break;
+        }
+        SDL_SemPost(engine->stream_wake);
+        SDL_SemWaitTimeout(engine->stream_filled, STREAM_POLL_MILLISECONDS);
+    }
+    SDL_AtomicSet(&engine->stream_waiting, 0);
+}
+
+static void start_prefetch_thread(struct engine *engine) {
+    
+    SDL_AtomicSet(&engine->prefetch_quit, 0);
+    SDL_AtomicSet(&engine->stream_waiting, 0);
+    engine->stream_wake = SDL_CreateSemaphore(0);
+    engine->stream_filled = SDL_CreateSemaphore(0);
+    engine->prefetch_thread = SDL_CreateThread(prefetch_thread_main, "prefetch", engine);
+    if(engine->prefetch_thread == NULL) {
+        printf("could not start the prefetch thread: %s\n", SDL_GetError());
+    }
+}
+
+static void stop_prefetch_thread(struct engine *engine) {
+    
+    if(engine->prefetch_thread != NULL) {
+        SDL_AtomicSet(&engine->prefetch_quit, 1);
+        SDL_SemPost(engine->stream_wake);
+        SDL_WaitThread(engine->prefetch_thread, NULL);
+        engine->prefetch_thread = NULL;
+    }
+    if(engine->stream_wake != NULL) {
+        SDL_DestroySemaphore(engine->stream_wake);
+        engine->stream_wake = NULL;
+    }
+    if(engine->stream_filled != NULL) {
+        SDL_DestroySemaphore(engine->stream_filled);
+        engine->stream_filled = NULL;
+    }
+}
+
+static int prefetch_thread_main(void *data) {
+    
+    /*
+        Keep the ring of every voice of an engine that plays a streamed sample filled ahead of it.
+        The thread wakes on a note on, or every STREAM_POLL_MILLISECONDS to top up the rings, and
+        it is the only one that reads the files of the engine and writes into its rings.
+    */
+    
+    struct engine *engine = data;
+    int requests[MAX_VOICES];
+    int fills[MAX_VOICES]; /* frame the ring is filled up to */
+    int v;
+    for(v = 0; v < engine->voice_count; v++) {
+        requests[v] = 0;
+        fills[v] = 0;
+    }
+    while(!SDL_AtomicGet(&engine->prefetch_quit)) {
+        SDL_SemWaitTimeout(engine->stream_wake, STREAM_POLL_MILLISECONDS);
+        for(v = 0; v < engine->voice_count; v++) {
+            int request = SDL_AtomicGet(&engine->voice_stream_request[v]);
+            if(request != requests[v]) {
+                /* a new note, the ring starts over after the attack */
+                requests[v] = request;
+                fills[v] = samples[request % MAX_SAMPLES].resident_frames;
+                SDL_AtomicSet(&engine->voice_stream_end[v], fills[v]);
+                SDL_AtomicSet(&engine->voice_stream_ready[v], request);
+            }
+            if(request != 0) {
+                fills[v] = fill_stream_ring(engine, v, request, fills[v]);
+            }
+        }
+        if(SDL_AtomicCAS(&engine->stream_waiting, 1, 0)) {
+            SDL_SemPost(engine->stream_filled);
+        }
+    }
+    return 0;
+}
+
+static int fill_stream_ring(struct engine *engine, int voice, int request, int fill) {
+    
+    /*
+        Read the sample into the ring from frame fill on, as far as the ring has room past the
+        frames the voice still needs. Stops early when the voice gets a new note. Returns the
+        frame the ring is filled up to.
+    */
+    
+    const struct sample *sample = &samples[request % MAX_SAMPLES];
+    SDL_RWops *file = engine->stream_files[request % MAX_SAMPLES];
+    Uint8 *ring = engine->stream_rings + (size_t)voice * STREAM_RING_FRAMES * MAX_SAMPLE_FRAME_BYTES;
+    while(fill < sample->frames && SDL_AtomicGet(&engine->voice_stream_request[voice]) == request) {
+        int count = sample->frames - fill < STREAM_READ_FRAMES ? sample->frames - fill : STREAM_READ_FRAMES;
+        int start = fill & (STREAM_RING_FRAMES - 1);
+        int first_part = STREAM_RING_FRAMES - start < count ? STREAM_RING_FRAMES - start : count;
+        size_t read = 0;
+        if(fill + count - SDL_AtomicGet(&engine->voice_stream_used[voice]) > STREAM_RING_FRAMES) {
+            break;
+        }
+        if(file != NULL) {
+            SDL_RWseek(file, sample->data_offset + (Sint64)fill * sample->frame_bytes, RW_SEEK_SET);
+            read = SDL_RWread(file, ring + (size_t)start * sample->frame_bytes, sample->frame_bytes, first_part);
+            if(count > first_part) {
+                read += SDL_RWread(file, ring, sample->frame_bytes, count - first_part);
+            }
+        }
+        if(read < (size_t)count) {
+            /* a read error plays as silence rather than what the ring held before */
+            int i;
+            for(i = (int)read; i < count; i++) {
+                memset(ring + (size_t)((fill + i) & (STREAM_RING_FRAMES - 1)) * sample->frame_bytes, 0, sample->frame_bytes);
+            }
+        }
+        fill += count;
+        SDL_MemoryBarrierRelease();
+        SDL_AtomicSet(&engine->voice_stream_end[voice], fill);
+    }
+    return fill;
+}
+
+static void write_voice_group(struct engine *engine, const int *voices, int count, float *left, float *right, int frames, int overwrite, struct voice_scratch *scratch) {
+    
+    /*
+        Render a group of up to engine->filter_lanes voices. The oscillators are written side by side into
+        scratch->lanes, one frame of every voice after the other, so that the filter kernel runs
+        the whole group at once with one voice in each SIMD lane. Lanes without a voice filter
+        silence. After that every voice gets its amp envelope and is added to the buses.
+    */
+    
+    int i;
+    int j;
+    int lanes = engine->filter_lanes;
+    if(!filter_enabled) {
+        for(j = 0; j < count; j++) {
+            render_voice_oscillator(engine, voices[j], scratch->oscillator, frames);
+            write_voice_samples(engine, voices[j], left, right, frames, overwrite && j == 0, scratch);
+        }
+        return;
+    }
+    for(j = 0; j < lanes; j++) {
+        if(j < count) {
+            int v = voices[j];
+            struct synth_part *part = &engine->parts[engine->voice_part[v]];
+            double level = update_control_envelope(engine, &part->filter_envelope, &engine->voice_filter_stage[v], &engine->voice_filter_level[v], engine->voice_key_pressed[v], frames);
+            update_filter_coefficients(engine, v, part->filter_envelope_octaves * level + engine->voice_mod_cutoff[v]);
+            render_voice_oscillator(engine, v, scratch->oscillator, frames);
+            for(i = 0; i < frames; i++) {
+                scratch->lanes[i * lanes + j] = scratch->oscillator[i];
+            }
+            scratch->filter.a1[j] = engine->voice_filter_a1[v];
+            scratch->filter.a2[j] = engine->voice_filter_a2[v];
+            scratch->filter.a3[j] = engine->voice_filter_a3[v];
+            scratch->filter.ic1[j] = engine->voice_filter_ic1[v];
+            scratch->filter.ic2[j] = engine->voice_filter_ic2[v];
+        } else {
+            for(i = 0; i < frames; i++) {
+                scratch->lanes[i * lanes + j] = 0;
+            }
+            scratch->filter.a1[j] = 0;
+            scratch->filter.a2[j] = 0;
+            scratch->filter.a3[j] = 0;
+            scratch->filter.ic1[j] = 0;
+            scratch->filter.ic2[j] = 0;
+        }
+    }
+    scratch->filter.lanes = lanes;
+    engine->render_filter(&scratch->filter, scratch->lanes, frames);
+    for(j = 0; j < count; j++) {
+        int v = voices[j];
+        engine->voice_filter_ic1[v] = scratch->filter.ic1[j];
+        engine->voice_filter_ic2[v] = scratch->filter.ic2[j];
+        for(i = 0; i < frames; i++) {
+            scratch->oscillator[i] = scratch->lanes[i * lanes + j];
+        }
+        write_voice_samples(engine, v, left, right, frames, overwrite && j == 0, scratch);
+    }
+}
+
+static void write_voice_samples(struct engine *engine, int voice, float *left, float *right, int frames, int overwrite, struct voice_scratch *scratch) {
+    
+    /*
+        Add one voice to the buses, scratch->oscillator already holds its (filtered) oscillator
+        and the envelope fills scratch->envelope for the whole chunk. With smoothing on, the gain
+        follows the envelope with a rate limited ramp per chunk instead. The amp from the
+        modulation matrix scales the target of the ramp, or gets a ramp of its own without it.
+        The voice is rendered in mono to scratch->mono and then added to each bus with its pan gain.
+        Only the state of this voice is written, so voices can be rendered on different threads
+        as long as each thread has its own scratch.
+    */
+    
+    int i;
+    float gain = (float)voice_mix_gain;
+    float gain_left = engine->voice_pan_left[voice];
+    float gain_right = engine->voice_pan_right[voice];
+    float velocity = engine->voice_velocity[voice];
+    float amp = engine->voice_mod_amp[voice];
+    float amp_start = engine->voice_mod_amp_start[voice];
+    
+    render_envelope_block(engine, voice, scratch->envelope, frames);
+    
+    /* the envelope buffer becomes the gain of each frame, velocity scales the target so a stolen voice is smoothed too */
+    if(smoothing_enabled) {
+        smooth_block(&engine->voice_amp[voice], scratch->envelope[frames - 1] * velocity * amp, scratch->envelope, frames);
+    } else {
+        engine->voice_amp[voice].current = scratch->envelope[frames - 1] * velocity;
+        gain *= velocity;
+        if(amp != amp_start) {
+            for (i = 0; i < frames; i++) {
+                scratch->envelope[i] *= amp_start + (amp - amp_start) * (i + 1) / frames;
+            }
+        } else {
+            gain *= amp;
+        }
+    }
+    
+    /* scale volume, then pan and add to what other voices have written */
+    for (i = 0; i < frames; i++) {
+        scratch->mono[i] = scratch->oscillator[i] * scratch->envelope[i] * gain;
+    }
+    if(overwrite) {
+        for (i = 0; i < frames; i++) {
+            left[i] = scratch->mono[i] * gain_left;
+            right[i] = scratch->mono[i] * gain_right;
+        }
+    } else {
+        for (i = 0; i < frames; i++) {
+            left[i] += scratch->mono[i] * gain_left;
+            right[i] += scratch->mono[i] * gain_right;
+        }
+    }
+}
+
+static int get_voice_cost(struct engine *engine, int voice) {
+    
+    /*
+        Relative time it takes to render the voice for a chunk, used to spread the voices evenly
+        over the pool. An oscillator costs more with cubic interpolation. A sampler voice decodes
+        every source frame it passes, so it costs more the higher it plays, and more again once
+        it reads from its stream ring past the resident attack. The filter adds its kernel, and
+        the coefficients are worked out again while its envelope or a route moves the cutoff.
+        Amp routes ramp the gain of the voice.
+    */
+    
+    struct synth_part *part = &engine->parts[engine->voice_part[voice]];
+    int cost = 2;
+    int moving = false;
+    int ramped = false;
+    int i;
+    if(engine->voice_sample[voice] >= 0) {
+        const struct sample *sample = &samples[engine->voice_sample[voice]];
+        cost += (int)get_sample_ratio(engine, voice, sample);
+        if(engine->voice_sample_position[voice] >= sample->resident_frames) {
+            cost++;
+        }
+    } else if(engine->oscillator_mode == OSCILLATOR_CUBIC) {
+        cost++;
+    }
+    if(filter_enabled) {
+        cost++;
+        moving = part->filter_envelope_octaves != 0 && engine->voice_filter_stage[voice] != CONTROL_ENVELOPE_SUSTAIN &&
+                 (engine->voice_filter_stage[voice] != CONTROL_ENVELOPE_RELEASE || engine->voice_filter_level[voice] > 0);
+    }
+    for(i = 0; i < part->mod_route_count; i++) {
+        if(part->mod_routes[i].destination == MOD_CUTOFF && filter_enabled) {
+            moving = true;
+        } else if(part->mod_routes[i].destination == MOD_AMP) {
+            ramped = true;
+        }
+    }
+    return cost + moving + ramped;
+}
+
+int get_pool_threads(int requested) {
+    
+    /* the number of render threads for --threads, where 0 means one per core */
+    
+    int cores = SDL_GetCPUCount();
+    int threads = requested;
+    
+    /* the threads spin while they wait for each other, more of them than cores would stall */
+    if(threads == 0 || threads > cores) {
+        threads = cores;
+    }
+    if(threads > MAX_WORKERS) {
+        threads = MAX_WORKERS;
+    }
+    if(threads < 1) {
+        threads = 1;
+    }
+    return threads;
+}
+
+void start_worker_pool(void) {
+    
+    /*
+        Start pool_threads - 1 worker threads, the audio thread itself is worker 0. Everything the
+        workers use is set up here so that nothing is allocated while rendering. SDL can't pin
+        threads to cores, so they get a high priority instead.
+    */
+    
+    int w;
+    pool_spin_ticks = (Uint64)(performance_frequency * POOL_SPIN_SECONDS);
+    pool_wait_ticks = (Uint64)(performance_frequency * POOL_WAIT_SECONDS);
+    SDL_AtomicSet(&pool_quit, 0);
+    SDL_AtomicSet(&pool_generation, 0);
+    for(w = 1; w < pool_threads; w++) {
+        struct pool_worker *worker = &pool_workers[w];
+        worker->index = w;
+        worker->left = worker->partial_left;
+        worker->right = worker->partial_right;
+        SDL_AtomicSet(&worker->sleeping, 0);
+        SDL_AtomicSet(&worker->state, POOL_IDLE);
+        worker->wake = SDL_CreateSemaphore(0);
+        worker->thread = (worker->wake != NULL) ? SDL_CreateThread(pool_worker_main, "synth worker", worker) : NULL;
+        if(worker->thread == NULL) {
+            /* keep going with the workers that did start */
+            printf("could not start worker %d: %s\n", w, SDL_GetError());
+            if(worker->wake != NULL) {
+                SDL_DestroySemaphore(worker->wake);
+                worker->wake = NULL;
+            }
+            pool_threads = w;
+            break;
+        }
+    }
+    pool_workers[0].index = 0;
+    if(debuglog) { printf("render threads:%d\n", pool_threads); }
+}
+
+void stop_worker_pool(void) {
+    
+    int w;
+    SDL_AtomicSet(&pool_quit, 1);
+    SDL_AtomicAdd(&pool_generation, 1);
+    for(w = 1; w < MAX_WORKERS; w++) {
+        struct pool_worker *worker = &pool_workers[w];
+        if(worker->thread != NULL) {
+            SDL_SemPost(worker->wake);
+            SDL_WaitThread(worker->thread, NULL);
+            worker->thread = NULL;
+        }
+        if(worker->wake != NULL) {
+            SDL_DestroySemaphore(worker->wake);
+            worker->wake = NULL;
+        }
+    }
+    pool_threads = 1;
+}
+
+static int pool_worker_main(void *data) {
+    
+    /*
+        Render a share of the voices for every chunk the audio thread hands out, until the pool
+        stops. A worker that wakes up after the audio thread gave up on it finds its chunk taken
+        back and leaves everything alone.
+    */
+    
+    struct pool_worker *worker = data;
+    int seen = 0;
+    SDL_SetThreadPriority(SDL_THREAD_PRIORITY_HIGH);
+    flush_denormals();
+    for(;;) {
+        seen = wait_for_work(worker, seen);
+        if(SDL_AtomicGet(&pool_quit)) {
+            break;
+        }
+        if(!SDL_AtomicCAS(&worker->state, POOL_ASSIGNED, POOL_RUNNING)) {
+            continue;
+        }
+        SDL_MemoryBarrierAcquire();
+        worker->rendered = 0;
+        render_worker_voices(worker);
+        SDL_MemoryBarrierRelease();
+        SDL_AtomicSet(&worker->state, POOL_IDLE);
+        SDL_AtomicAdd(&pool_pending, -1);
+    }
+    return 0;
+}
+
+static int wait_for_work(struct pool_worker *worker, int seen) {
+    
+    /*
+        The chunks of one callback follow each other closely, so spin on the generation for a
+        while. After that sleep on the semaphore until the audio thread wakes the worker up.
+        The sleeping flag makes sure a wake up is never lost, and a semaphore post is only paid
+        for once per callback.
+    */
+    
+    Uint64 spin_until = SDL_GetPerformanceCounter() + pool_spin_ticks;
+    int generation;
+    for(;;) {
+        generation = SDL_AtomicGet(&pool_generation);
+        if(generation != seen) {
+            return generation;
+        }
+        if(SDL_GetPerformanceCounter() < spin_until) {
+            SYNTH_CPU_PAUSE();
+            continue;
+        }
+        SDL_AtomicSet(&worker->sleeping, 1);
+        generation = SDL_AtomicGet(&pool_generation);
+        if(generation != seen) {
+            if(!SDL_AtomicCAS(&worker->sleeping, 1, 0)) {
+                /* the audio thread saw the flag and is posting, take the post */
+                SDL_SemWait(worker->wake);
+            }
+            return generation;
+        }
+        SDL_SemWait(worker->wake);
+        spin_until = SDL_GetPerformanceCounter() + pool_spin_ticks;
+    }
+}
+
+static void render_worker_voices(struct pool_worker *worker) {
+    
+    /*
+        Take voices from the worker's own list first, then steal from the lists of the other
+        workers. Every list has an atomic cursor so a voice is only ever taken once. Voices are
+        taken in groups of filter_lanes so that the filter kernel gets a full group.
+    */
+    
+    int lanes = pool_engine->filter_lanes;
+    int k;
+    for(k = 0; k < pool_threads; k++) {
+        int list = (worker->index + k) % pool_threads;
+        int i;
+        while((i = SDL_AtomicAdd(&pool_cursor[list], lanes)) < pool_list_length[list]) {
+            int count = pool_list_length[list] - i;
+            if(count > lanes) {
+                count = lanes;
+            }
+            write_voice_group(pool_engine, &pool_list[list][i], count, worker->left, worker->right, pool_frames, worker->rendered == 0, &worker->scratch);
+            worker->rendered += count;
+        }
+    }
+}
+
+static int render_voices_parallel(struct engine *engine, float *left, float *right, int frames) {
+    
+    /*
+        Spread the voices of one chunk over the pool and render them. The most expensive voices
+        are handed out first, each to the list with the least work so far. Every worker renders
+        to its own partial buses, which are added to the chunk when all are done.
+        Returns how many voices were rendered.
+    */
+    
+    int i;
+    int w;
+    int rendered;
+    int load[MAX_WORKERS];
+    Uint64 wait_until;
+    
+    /* sort by cost, largest first */
+    for(i = 1; i < engine->chunk_voice_count; i++) {
+        int voice = engine->chunk_voices[i];
+        int cost = engine->chunk_voice_costs[i];
+        int j = i - 1;
+        while(j >= 0 && engine->chunk_voice_costs[j] < cost) {
+            engine->chunk_voices[j + 1] = engine->chunk_voices[j];
+            engine->chunk_voice_costs[j + 1] = engine->chunk_voice_costs[j];
+            j--;
+        }
+        engine->chunk_voices[j + 1] = voice;
+        engine->chunk_voice_costs[j + 1] = cost;
+    }
+    for(w = 0; w < pool_threads; w++) {
+        load[w] = 0;
+        pool_list_length[w] = 0;
+        pool_workers[w].rendered = 0;
+        SDL_AtomicSet(&pool_cursor[w], 0);
+    }
+    for(i = 0; i < engine->chunk_voice_count; i++) {
+        int least = 0;
+        for(w = 1; w < pool_threads; w++) {
+            if(load[w] < load[least]) {
+                least = w;
+            }
+        }
+        pool_list[least][pool_list_length[least]++] = engine->chunk_voices[i];
+        load[least] += engine->chunk_voice_costs[i];
+    }
+    
+    /* hand out the chunk and wake the workers that went to sleep */
+    pool_engine = engine;
+    pool_frames = frames;
+    pool_workers[0].left = left;
+    pool_workers[0].right = right;
+    SDL_AtomicSet(&pool_pending, pool_threads - 1);
+    for(w = 1; w < pool_threads; w++) {
+        SDL_AtomicSet(&pool_workers[w].state, POOL_ASSIGNED);
+    }
+    SDL_MemoryBarrierRelease();
+    SDL_AtomicAdd(&pool_generation, 1);
+    for(w = 1; w < pool_threads; w++) {
+        if(SDL_AtomicCAS(&pool_workers[w].sleeping, 1, 0)) {
+            SDL_SemPost(pool_workers[w].wake);
+        }
+    }
+    
+    /*
+        The audio thread works too, and takes voices from the other lists once its own is done,
+        so when it returns every voice has been taken. A worker that has not started yet (it was
+        asleep, or its core went to another thread) would find nothing left, so its chunk is taken
+        back instead of waited for. Only workers busy with a group are waited for, and past
+        pool_wait_ticks the audio thread yields its core to them instead of spinning.
+    */
+    render_worker_voices(&pool_workers[0]);
+    for(w = 1; w < pool_threads; w++) {
+        if(SDL_AtomicCAS(&pool_workers[w].state, POOL_ASSIGNED, POOL_IDLE)) {
+            SDL_AtomicAdd(&pool_pending, -1);
+        }
+    }
+    wait_until = SDL_GetPerformanceCounter() + pool_wait_ticks;
+    while(SDL_AtomicGet(&pool_pending) > 0) {
+        if(SDL_GetPerformanceCounter() < wait_until) {
+            SYNTH_CPU_PAUSE();
+        } else {
+            SDL_Delay(0);
+        }
+    }
+    SDL_MemoryBarrierAcquire();
+    
+    /* sum the partial buses */
+    rendered = pool_workers[0].rendered;
+    for(w = 1; w < pool_threads; w++) {
+        struct pool_worker *worker = &pool_workers[w];
+        if(worker->rendered == 0) {
+            continue;
+        }
+        if(rendered == 0) {
+            memcpy(left, worker->left, sizeof(float) * frames);
+            memcpy(right, worker->right, sizeof(float) * frames);
+        } else {
+            for(i = 0; i < frames; i++) {
+                left[i] += worker->left[i];
+                right[i] += worker->right[i];
+            }
+        }
+        rendered += worker->rendered;
+    }
+    return rendered;
+}
+
+static void smoother_init(struct smoother *smoother, int type, double seconds, int rate, float value) {
+    
+    /* start at value with nothing left to smooth */
+    
+    smoother->type = type;
+    smoother->current = value;
+    smoother->block_frames = 0;
+    smoother_set_time(smoother, seconds, rate);
+}
+
+static void smoother_set_time(struct smoother *smoother, double seconds, int rate) {
+    
+    /*
+        Linear smoothers cover the full range 0-1 in seconds, one pole smoothers get within 1/e
+        of the target in seconds. Both are stored per frame at rate so the time stays the same
+        whatever the rate is.
+    */
+    
+    double frames = seconds * rate;
+    if(frames < 1) {
+        frames = 1;
+    }
+    smoother->step = (float)(1.0 / frames);
+    smoother->coefficient = exp(-1.0 / frames);
+    smoother->block_frames = 0;
+}
+
+static void smooth_block(struct smoother *smoother, float target, float *out, int frames) {
+    
+    /*
+        Move towards target for one block and write the values to out. The value at the end of
+        the block is worked out once, the block is a straight line from the current value to it,
+        so the loop is a multiply and add per frame without branches.
+    */
+    
+    int i;
+    float start = smoother->current;
+    float end;
+    float increment;
+    if(frames <= 0) {
+        return;
+    }
+    if(smoother->type == SMOOTH_ONE_POLE) {
+        /* coefficient^frames only changes with the block size */
+        if(smoother->block_frames != frames) {
+            smoother->block_coefficient = (float)pow(smoother->coefficient, frames);
+            smoother->block_frames = frames;
+        }
+        end = target + (start - target) * smoother->block_coefficient;
+    } else {
+        float max_change = smoother->step * frames;
+        end = target;
+        if(end > start + max_change) {
+            end = start + max_change;
+        } else if(end < start - max_change) {
+            end = start - max_change;
+        }
+    }
+    increment = (end - start) / frames;
+    for(i = 0; i < frames; i++) {
+        out[i] = start + increment * (i + 1);
+    }
+    smoother->current = end;
+}
+
+static void update_smoothing_rates(struct engine *engine) {
+    
+    /* recalculate the per frame steps of every voice smoother for the sample rate of the engine */
+    
+    int v;
+    for(v = 0; v < engine->voice_count; v++) {
+        smoother_set_time(&engine->voice_amp[v], smoothing_time, engine->sample_rate);
+    }
+    engine->smoothing_sample_rate = engine->sample_rate;
+}
+
+static void select_simd_kernels(void) {
+    
+    /* pick the widest oscillator and conversion kernels that the CPU supports, the scalar ones work everywhere */
+    
+    render_oscillator = render_oscillator_scalar;
+    render_oscillator_linear = render_oscillator_linear_scalar;
+    render_oscillator_cubic = render_oscillator_cubic_scalar;
+    render_filter = render_filter_scalar;
+    filter_lanes = 4;
+    convert_mix_bus = convert_mix_bus_scalar;
+    interleave_bus = interleave_bus_scalar;
+#if defined(SYNTH_SSE2)
+    if(SDL_HasSSE2()) {
+        render_oscillator = render_oscillator_sse2;
+        render_oscillator_linear = render_oscillator_linear_sse2;
+        render_filter = render_filter_sse2;
+        filter_lanes = 4;
+        convert_mix_bus = convert_mix_bus_sse2;
+        interleave_bus = interleave_bus_sse2;
+        t_log("oscillator kernel: SSE2");
+    }
+#endif
+#if defined(SYNTH_AVX2)
+    if(SDL_HasAVX2()) {
+        render_oscillator = render_oscillator_avx2;
+        render_oscillator_linear = render_oscillator_linear_avx2;
+        render_oscillator_cubic = render_oscillator_cubic_avx2;
+        render_filter = render_filter_avx2;
+        filter_lanes = 8;
+        t_log("oscillator kernel: AVX2");
+    }
+#endif
+#if defined(SYNTH_NEON)
+    if(SDL_HasNEON()) {
+        render_oscillator = render_oscillator_neon;
+        render_oscillator_linear = render_oscillator_linear_neon;
+        render_filter = render_filter_neon;
+        filter_lanes = 4;
+        convert_mix_bus = convert_mix_bus_neon;
+        interleave_bus = interleave_bus_neon;
+        t_log("oscillator kernel: NEON");
+    }
+#endif
+}
+
+void render_oscillator_scalar(const float *table, int length, double *phase, double phase_increment, float *out, int frames) {
+    
+    /*
+        Step through the table at phase_increment and write one table value per frame.
+        The table length is a power of two so the index wraps with a mask, the phase itself is
+        only wrapped once at the end of the chunk.
+    */
+    
+    int i;
+    int mask = length - 1;
+    double d_length = length;
+    double start = *phase;
+    for(i = 0; i < frames; i++) {
+        int phase_int = (int)(start + (i + 1) * phase_increment);
+        out[i] = table[phase_int & mask];
+    }
+    start += frames * phase_increment;
+    *phase = start - floor(start / d_length) * d_length;
+}
+
+#if defined(SYNTH_SSE2)
+void render_oscillator_sse2(const float *table, int length, double *phase, double phase_increment, float *out, int frames) {
+    
+    /*
+        4 frames at a time. The phase of each group is kept wrapped in double precision, the 4
+        lanes are offset from it in float. SSE2 has no gather so the table is read per lane.
+    */
+    
+    int i = 0;
+    int lane_index[4];
+    double d_length = length;
+    double group_increment = phase_increment * 4;
+    double current = *phase;
+    __m128i mask = _mm_set1_epi32(length - 1);
+    __m128 lane_offsets = _mm_mul_ps(_mm_set_ps(4.0f, 3.0f, 2.0f, 1.0f), _mm_set1_ps((float)phase_increment));
+    for(; i + 4 <= frames; i += 4) {
+        __m128 lanes = _mm_add_ps(_mm_set1_ps((float)current), lane_offsets);
+        __m128i index = _mm_and_si128(_mm_cvttps_epi32(lanes), mask);
+        _mm_storeu_si128((__m128i*)lane_index, index);
+        _mm_storeu_ps(out + i, _mm_set_ps(table[lane_index[3]], table[lane_index[2]], table[lane_index[1]], table[lane_index[0]]));
+        current += group_increment;
+        if(current >= d_length) {
+            current -= floor(current / d_length) * d_length;
+        }
+    }
+    *phase = current;
+    if(i < frames) {
+        render_oscillator_scalar(table, length, phase, phase_increment, out + i, frames - i);
+    }
+}
+#endif
+
+#if defined(SYNTH_AVX2)
+SYNTH_TARGET_AVX2
+void render_oscillator_avx2(const float *table, int length, double *phase, double phase_increment, float *out, int frames) {
+    
+    /* same as the SSE2 kernel but 8 frames at a time, with a hardware gather for the table lookup */
+    
+    int i = 0;
+    double d_length = length;
+    double group_increment = phase_increment * 8;
+    double current = *phase;
+    __m256i mask = _mm256_set1_epi32(length - 1);
+    __m256 lane_offsets = _mm256_mul_ps(_mm256_set_ps(8.0f, 7.0f, 6.0f, 5.0f, 4.0f, 3.0f, 2.0f, 1.0f), _mm256_set1_ps((float)phase_increment));
+    for(; i + 8 <= frames; i += 8) {
+        __m256 lanes = _mm256_add_ps(_mm256_set1_ps((float)current), lane_offsets);
+        __m256i index = _mm256_and_si256(_mm256_cvttps_epi32(lanes), mask);
+        _mm256_storeu_ps(out + i, _mm256_i32gather_ps(table, index, 4));
+        current += group_increment;
+        if(current >= d_length) {
+            current -= floor(current / d_length) * d_length;
+        }
+    }
+    *phase = current;
+    if(i < frames) {
+        render_oscillator_scalar(table, length, phase, phase_increment, out + i, frames - i);
+    }
+}
+#endif
+
+#if defined(SYNTH_NEON)
+void render_oscillator_neon(const float *table, int length, double *phase, double phase_increment, float *out, int frames) {
+    
+    /* 4 frames at a time, NEON has no gather either so the table is read per lane */
+    
+    int i = 0;
+    int lane_index[4];
+    double d_length = length;
+    double group_increment = phase_increment * 4;
+    double current = *phase;
+    float offsets[4] = {1.0f, 2.0f, 3.0f, 4.0f};
+    int32x4_t mask = vdupq_n_s32(length - 1);
+    float32x4_t lane_offsets = vmulq_n_f32(vld1q_f32(offsets), (float)phase_increment);
+    for(; i + 4 <= frames; i += 4) {
+        float32x4_t lanes = vaddq_f32(vdupq_n_f32((float)current), lane_offsets);
+        int32x4_t index = vandq_s32(vcvtq_s32_f32(lanes), mask);
+        float values[4];
+        vst1q_s32(lane_index, index);
+        values[0] = table[lane_index[0]];
+        values[1] = table[lane_index[1]];
+        values[2] = table[lane_index[2]];
+        values[3] = table[lane_index[3]];
+        vst1q_f32(out + i, vld1q_f32(values));
+        current += group_increment;
+        if(current >= d_length) {
+            current -= floor(current / d_length) * d_length;
+        }
+    }
+    *phase = current;
+    if(i < frames) {
+        render_oscillator_scalar(table, length, phase, phase_increment, out + i, frames - i);
+    }
+}
+#endif
+
+Uint32 get_phase_step(double phase_increment) {
+    
+    /* table entries per frame to the 32 bit phase step, where 2^32 is one cycle of the table */
+    
+    return (Uint32)(phase_increment * (4294967296.0 / table_length));
+}
+
+void render_oscillator_linear_scalar(const float *table, int bits, Uint32 *phase, Uint32 step, float *out, int frames) {
+    
+    /*
+        Read the table with a 32 bit fixed point phase where the whole range is one cycle, so the
+        phase wraps by itself when it overflows. The top bits are the table index and the bits
+        below it are the fraction between two table entries.
+    */
+    
+    int i;
+    int shift = 32 - bits;
+    Uint32 mask = (1u << bits) - 1;
+    Uint32 current = *phase;
+    for(i = 0; i < frames; i++) {
+        Uint32 index;
+        float fraction;
+        current += step;
+        index = current >> shift;
+        fraction = (float)((current << bits) >> 8) * FRACTION_SCALE;
+        out[i] = table[index] + (table[(index + 1) & mask] - table[index]) * fraction;
+    }
+    *phase = current;
+}
+
+void render_oscillator_cubic_scalar(const float *table, int bits, Uint32 *phase, Uint32 step, float *out, int frames) {
+    
+    /* same as the linear kernel but with a 4 point cubic hermite curve through the neighbouring entries */
+    
+    int i;
+    int shift = 32 - bits;
+    Uint32 mask = (1u << bits) - 1;
+    Uint32 current = *phase;
+    for(i = 0; i < frames; i++) {
+        Uint32 index;
+        float fraction;
+        current += step;
+        index = current >> shift;
+        fraction = (float)((current << bits) >> 8) * FRACTION_SCALE;
+        out[i] = cubic_hermite(table[(index - 1) & mask], table[index], table[(index + 1) & mask], table[(index + 2) & mask], fraction);
+    }
+    *phase = current;
+}
+
+static float cubic_hermite(float y0, float y1, float y2, float y3, float fraction) {
+    float c1 = 0.5f * (y2 - y0);
+    float c2 = y0 - 2.5f * y1 + 2.0f * y2 - 0.5f * y3;
+    float c3 = 0.5f * (y3 - y0) + 1.5f * (y1 - y2);
+    return ((c3 * fraction + c2) * fraction + c1) * fraction + y1;
+}
+
+#if defined(SYNTH_SSE2)
+void render_oscillator_linear_sse2(const float *table, int bits, Uint32 *phase, Uint32 step, float *out, int frames) {
+    
+    /*
+        4 frames at a time. The lane phases, indexes and fractions are all computed with integer
+        adds and shifts, only the table reads are per lane.
+    */
+    
+    int i = 0;
+    int lane_index[4];
+    Uint32 current = *phase;
+    __m128i shift = _mm_cvtsi32_si128(32 - bits);
+    __m128i fraction_shift = _mm_cvtsi32_si128(bits);
+    __m128i mask = _mm_set1_epi32((1 << bits) - 1);
+    __m128i one = _mm_set1_epi32(1);
+    __m128i lane_steps = _mm_set_epi32((int)(step * 4), (int)(step * 3), (int)(step * 2), (int)step);
+    __m128 scale = _mm_set1_ps(FRACTION_SCALE);
+    for(; i + 4 <= frames; i += 4) {
+        __m128i lanes = _mm_add_epi32(_mm_set1_epi32((int)current), lane_steps);
+        __m128i index = _mm_srl_epi32(lanes, shift);
+        __m128 fraction = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(_mm_sll_epi32(lanes, fraction_shift), 8)), scale);
+        __m128 a;
+        __m128 b;
+        _mm_storeu_si128((__m128i*)lane_index, index);
+        a = _mm_set_ps(table[lane_index[3]], table[lane_index[2]], table[lane_index[1]], table[lane_index[0]]);
+        _mm_storeu_si128((__m128i*)lane_index, _mm_and_si128(_mm_add_epi32(index, one), mask));
+        b = _mm_set_ps(table[lane_index[3]], table[lane_index[2]], table[lane_index[1]], table[lane_index[0]]);
+        _mm_storeu_ps(out + i, _mm_add_ps(a, _mm_mul_ps(_mm_sub_ps(b, a), fraction)));
+        current += step * 4;
+    }
+    *phase = current;
+    if(i < frames) {
+        render_oscillator_linear_scalar(table, bits, phase, step, out + i, frames - i);
+    }
+}
+#endif
+
+#if defined(SYNTH_AVX2)
+SYNTH_TARGET_AVX2
+void render_oscillator_linear_avx2(const float *table, int bits, Uint32 *phase, Uint32 step, float *out, int frames) {
+    
+    /* 8 frames at a time with the neighbouring entries read by two gathers */
+    
+    int i = 0;
+    Uint32 current = *phase;
+    __m128i shift = _mm_cvtsi32_si128(32 - bits);
+    __m128i fraction_shift = _mm_cvtsi32_si128(bits);
+    __m256i mask = _mm256_set1_epi32((1 << bits) - 1);
+    __m256i one = _mm256_set1_epi32(1);
+    __m256i lane_steps = _mm256_set_epi32((int)(step * 8), (int)(step * 7), (int)(step * 6), (int)(step * 5), (int)(step * 4), (int)(step * 3), (int)(step * 2), (int)step);
+    __m256 scale = _mm256_set1_ps(FRACTION_SCALE);
+    for(; i + 8 <= frames; i += 8) {
+        __m256i lanes = _mm256_add_epi32(_mm256_set1_epi32((int)current), lane_steps);
+        __m256i index = _mm256_srl_epi32(lanes, shift);
+        __m256 fraction = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(_mm256_sll_epi32(lanes, fraction_shift), 8)), scale);
+        __m256 a = _mm256_i32gather_ps(table, index, 4);
+        __m256 b = _mm256_i32gather_ps(table, _mm256_and_si256(_mm256_add_epi32(index, one), mask), 4);
+        _mm256_storeu_ps(out + i, _mm256_add_ps(a, _mm256_mul_ps(_mm256_sub_ps(b, a), fraction)));
+        current += step * 8;
+    }
+    *phase = current;
+    if(i < frames) {
+        render_oscillator_linear_scalar(table, bits, phase, step, out + i, frames - i);
+    }
+}
+
+SYNTH_TARGET_AVX2
+void render_oscillator_cubic_avx2(const float *table, int bits, Uint32 *phase, Uint32 step, float *out, int frames) {
+    
+    /* 8 frames at a time, four gathers for the four points of the curve */
+    
+    int i = 0;
+    Uint32 current = *phase;
+    __m128i shift = _mm_cvtsi32_si128(32 - bits);
+    __m128i fraction_shift = _mm_cvtsi32_si128(bits);
+    __m256i mask = _mm256_set1_epi32((1 << bits) - 1);
+    __m256i one = _mm256_set1_epi32(1);
+    __m256i lane_steps = _mm256_set_epi32((int)(step * 8), (int)(step * 7), (int)(step * 6), (int)(step * 5), (int)(step * 4), (int)(step * 3), (int)(step * 2), (int)step);
+    __m256 scale = _mm256_set1_ps(FRACTION_SCALE);
+    __m256 half = _mm256_set1_ps(0.5f);
+    __m256 one_half = _mm256_set1_ps(1.5f);
+    __m256 two = _mm256_set1_ps(2.0f);
+    __m256 two_half = _mm256_set1_ps(2.5f);
+    for(; i + 8 <= frames; i += 8) {
+        __m256i lanes = _mm256_add_epi32(_mm256_set1_epi32((int)current), lane_steps);
+        __m256i index = _mm256_srl_epi32(lanes, shift);
+        __m256 fraction = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(_mm256_sll_epi32(lanes, fraction_shift), 8)), scale);
+        __m256 y0 = _mm256_i32gather_ps(table, _mm256_and_si256(_mm256_sub_epi32(index, one), mask), 4);
+        __m256 y1 = _mm256_i32gather_ps(table, index, 4);
+        __m256 y2 = _mm256_i32gather_ps(table, _mm256_and_si256(_mm256_add_epi32(index, one), mask), 4);
+        __m256 y3 = _mm256_i32gather_ps(table, _mm256_and_si256(_mm256_add_epi32(index, _mm256_add_epi32(one, one)), mask), 4);
+        __m256 c1 = _mm256_mul_ps(half, _mm256_sub_ps(y2, y0));
+        __m256 c2 = _mm256_sub_ps(_mm256_add_ps(_mm256_sub_ps(y0, _mm256_mul_ps(two_half, y1)), _mm256_mul_ps(two, y2)), _mm256_mul_ps(half, y3));
+        __m256 c3 = _mm256_add_ps(_mm256_mul_ps(half, _mm256_sub_ps(y3, y0)), _mm256_mul_ps(one_half, _mm256_sub_ps(y1, y2)));
+        __m256 value = _mm256_add_ps(_mm256_mul_ps(c3, fraction), c2);
+        value = _mm256_add_ps(_mm256_mul_ps(value, fraction), c1);
+        value = _mm256_add_ps(_mm256_mul_ps(value, fraction), y1);
+        _mm256_storeu_ps(out + i, value);
+        current += step * 8;
+    }
+    *phase = current;
+    if(i < frames) {
+        render_oscillator_cubic_scalar(table, bits, phase, step, out + i, frames - i);
+    }
+}
+#endif
+
+#if defined(SYNTH_NEON)
+void render_oscillator_linear_neon(const float *table, int bits, Uint32 *phase, Uint32 step, float *out, int frames) {
+    
+    /* 4 frames at a time like the SSE2 kernel, the shifts take a negative count to shift right */
+    
+    int i = 0;
+    Uint32 lane_index[4];
+    Uint32 current = *phase;
+    Uint32 steps[4];
+    int32x4_t shift = vdupq_n_s32(bits - 32);
+    int32x4_t fraction_shift = vdupq_n_s32(bits);
+    Uint32 mask = (1u << bits) - 1;
+    uint32x4_t lane_steps;
+    steps[0] = step;
+    steps[1] = step * 2;
+    steps[2] = step * 3;
+    steps[3] = step * 4;
+    lane_steps = vld1q_u32(steps);
+    for(; i + 4 <= frames; i += 4) {
+        uint32x4_t lanes = vaddq_u32(vdupq_n_u32(current), lane_steps);
+        uint32x4_t index = vshlq_u32(lanes, shift);
+        float32x4_t fraction = vmulq_n_f32(vcvtq_f32_u32(vshrq_n_u32(vshlq_u32(lanes, fraction_shift), 8)), FRACTION_SCALE);
+        float a[4];
+        float b[4];
+        int k;
+        vst1q_u32(lane_index, index);
+        for(k = 0; k < 4; k++) {
+            a[k] = table[lane_index[k]];
+            b[k] = table[(lane_index[k] + 1) & mask];
+        }
+        vst1q_f32(out + i, vmlaq_f32(vld1q_f32(a), vsubq_f32(vld1q_f32(b), vld1q_f32(a)), fraction));
+        current += step * 4;
+    }
+    *phase = current;
+    if(i < frames) {
+        render_oscillator_linear_scalar(table, bits, phase, step, out + i, frames - i);
+    }
+}
+#endif
+
+static double update_control_envelope(struct engine *engine, const struct control_envelope *envelope, int *stage, double *level, int pressed, int frames) {
+    
+    /*
+        Control envelopes run at control rate, one step per chunk, and return the level for the
+        chunk. They go up in the attack time, down to sustain in the decay time and from full
+        level to zero in the release time.
+    */
+    
+    double value = *level;
+    int current = *stage;
+    if(!pressed) {
+        current = CONTROL_ENVELOPE_RELEASE;
+    }
+    switch(current) {
+        case CONTROL_ENVELOPE_ATTACK:
+            value += frames / (envelope->times[0] * engine->sample_rate);
+            if(value >= 1) {
+                value = 1;
+                current = CONTROL_ENVELOPE_DECAY;
+            }
+            break;
+        case CONTROL_ENVELOPE_DECAY:
+            value -= frames * (1 - envelope->sustain) / (envelope->times[1] * engine->sample_rate);
+            if(value <= envelope->sustain) {
+                value = envelope->sustain;
+                current = CONTROL_ENVELOPE_SUSTAIN;
+            }
+            break;
+        case CONTROL_ENVELOPE_RELEASE:
+            value -= frames / (envelope->times[2] * engine->sample_rate);
+            if(value < 0) {
+                value = 0;
+            }
+            break;
+    }
+    *stage = current;
+    *level = value;
+    return value;
+}
+
+static void update_lfos(struct engine *engine, struct synth_part *part, int frames) {
+    
+    /* advance the LFOs of a part to the end of the chunk, they are shared by all its voices */
+    
+    int i;
+    for(i = 0; i < MAX_LFOS; i++) {
+        struct lfo *lfo = &part->lfos[i];
+        double phase = lfo->phase + lfo->rate * frames / engine->sample_rate;
+        phase -= floor(phase);
+        lfo->phase = phase;
+        switch(lfo->shape) {
+            case LFO_TRIANGLE:
+                lfo->value = phase < 0.5 ? phase * 4 - 1 : 3 - phase * 4;
+                break;
+            case LFO_SQUARE:
+                lfo->value = phase < 0.5 ? 1 : -1;
+                break;
+            case LFO_SAW:
+                lfo->value = phase * 2 - 1;
+                break;
+            default:
+                lfo->value = sin(2.0 * pi * phase);
+                break;
+        }
+    }
+}
+
+static double update_modulation(struct engine *engine, int voice, int frames) {
+    
+    /*
+        Run the modulation matrix for one voice and one chunk. Every route adds its source times
+        its amount to a destination. The amp gain is ramped over the chunk from where it was,
+        the filter takes the new cutoff offset when its coefficients are updated, and the pitch
+        offset in cents is returned for the phase increment. The oscillators keep one step for
+        the whole chunk, so that is the middle of the ramp from the last chunk to this one.
+    */
+    
+    struct synth_part *part = &engine->parts[engine->voice_part[voice]];
+    double sources[MOD_SOURCE_COUNT];
+    double values[MOD_DESTINATION_COUNT];
+    double pitch;
+    double amp;
+    int i;
+    for(i = 0; i < MOD_DESTINATION_COUNT; i++) {
+        values[i] = 0;
+    }
+    if(part->mod_route_count > 0) {
+        sources[MOD_SOURCE_LFO1] = part->lfos[0].value;
+        sources[MOD_SOURCE_LFO2] = part->lfos[1].value;
+        sources[MOD_SOURCE_ENVELOPE] = update_control_envelope(engine, &part->mod_envelope, &engine->voice_mod_stage[voice], &engine->voice_mod_level[voice], engine->voice_key_pressed[voice], frames);
+        sources[MOD_SOURCE_VELOCITY] = engine->voice_velocity[voice];
+        for(i = 0; i < part->mod_route_count; i++) {
+            values[part->mod_routes[i].destination] += sources[part->mod_routes[i].source] * part->mod_routes[i].amount;
+        }
+    }
+    pitch = (engine->voice_mod_pitch[voice] + values[MOD_PITCH]) * 0.5;
+    engine->voice_mod_pitch[voice] = values[MOD_PITCH];
+    amp = 1 + values[MOD_AMP];
+    if(amp < 0) {
+        amp = 0;
+    }
+    engine->voice_mod_amp_start[voice] = engine->voice_mod_amp[voice];
+    engine->voice_mod_amp[voice] = (float)amp;
+    engine->voice_mod_cutoff[voice] = values[MOD_CUTOFF];
+    return pitch;
+}
+
+void update_filter_coefficients(struct engine *engine, int voice, double octaves) {
+    
+    /*
+        Work out the coefficients of the state variable filter (trapezoidal integration, so it
+        stays stable at any cutoff) for a cutoff octaves above filter_cutoff. pow and tan are
+        only called when the envelope has moved it by more than FILTER_RECALC_OCTAVES or the
+        settings have changed, so most chunks keep the coefficients they have.
+    */
+    
+    struct synth_part *part = &engine->parts[engine->voice_part[voice]];
+    double g;
+    double k;
+    double a1;
+    double cutoff;
+    if(engine->voice_filter_base[voice] == part->filter_cutoff && engine->voice_filter_resonance[voice] == part->filter_resonance &&
+       fabs(octaves - engine->voice_filter_octaves[voice]) < FILTER_RECALC_OCTAVES) {
+        return;
+    }
+    cutoff = part->filter_cutoff * pow(2.0, octaves);
+    if(cutoff > engine->sample_rate * 0.45) {
+        cutoff = engine->sample_rate * 0.45;
+    }
+    if(cutoff < 20) {
+        cutoff = 20;
+    }
+    g = tan(pi * cutoff / engine->sample_rate);
+    k = 2 - 1.96 * part->filter_resonance; /* damping, kept above zero so full resonance rings but does not blow up */
+    a1 = 1 / (1 + g * (g + k));
+    engine->voice_filter_a1[voice] = (float)a1;
+    engine->voice_filter_a2[voice] = (float)(g * a1);
+    engine->voice_filter_a3[voice] = (float)(g * g * a1);
+    engine->voice_filter_base[voice] = part->filter_cutoff;
+    engine->voice_filter_octaves[voice] = octaves;
+    engine->voice_filter_resonance[voice] = part->filter_resonance;
+}
+
+void flush_denormals(void) {
+    
+    /*
+        Filter state that dies away ends up as denormal numbers, which are many times slower
+        to work with on x86. The render threads treat them as zero, the flags are per thread.
+    */
+    
+#if defined(SYNTH_SSE2)
+    _mm_setcsr(_mm_getcsr() | 0x8040); /* flush to zero and denormals are zero */
+#endif
+}
+
+void render_filter_scalar(struct filter_lanes *filter, float *lanes, int frames) {
+    
+    /* lowpass, one lane at a time with a stride of the lanes in the group */
+    
+    int lane;
+    int i;
+    int stride = filter->lanes;
+    for(lane = 0; lane < stride; lane++) {
+        float a1 = filter->a1[lane];
+        float a2 = filter->a2[lane];
+        float a3 = filter->a3[lane];
+        float ic1 = filter->ic1[lane];
+        float ic2 = filter->ic2[lane];
+        for(i = 0; i < frames; i++) {
+            float v0 = lanes[i * stride + lane];
+            float v3 = v0 - ic2;
+            float v1 = a1 * ic1 + a2 * v3;
+            float v2 = ic2 + (a2 * ic1 + a3 * v3);
+            ic1 = 2.0f * v1 - ic1;
+            ic2 = 2.0f * v2 - ic2;
+            lanes[i * stride + lane] = v2;
+        }
+        filter->ic1[lane] = ic1;
+        filter->ic2[lane] = ic2;
+    }
+}
+
+#if defined(SYNTH_SSE2)
+void render_filter_sse2(struct filter_lanes *filter, float *lanes, int frames) {
+    
+    /* four voices at once, the same steps as the scalar version with one voice per lane */
+    
+    __m128 a1 = _mm_loadu_ps(filter->a1);
+    __m128 a2 = _mm_loadu_ps(filter->a2);
+    __m128 a3 = _mm_loadu_ps(filter->a3);
+    __m128 ic1 = _mm_loadu_ps(filter->ic1);
+    __m128 ic2 = _mm_loadu_ps(filter->ic2);
+    __m128 two = _mm_set1_ps(2.0f);
+    int i;
+    for(i = 0; i < frames; i++) {
+        __m128 v3 = _mm_sub_ps(_mm_loadu_ps(lanes + i * 4), ic2);
+        __m128 v1 = _mm_add_ps(_mm_mul_ps(a1, ic1), _mm_mul_ps(a2, v3));
+        __m128 v2 = _mm_add_ps(ic2, _mm_add_ps(_mm_mul_ps(a2, ic1), _mm_mul_ps(a3, v3)));
+        ic1 = _mm_sub_ps(_mm_mul_ps(two, v1), ic1);
+        ic2 = _mm_sub_ps(_mm_mul_ps(two, v2), ic2);
+        _mm_storeu_ps(lanes + i * 4, v2);
+    }
+    _mm_storeu_ps(filter->ic1, ic1);
+    _mm_storeu_ps(filter->ic2, ic2);
+}
+#endif
+
+#if defined(SYNTH_AVX2)
+SYNTH_TARGET_AVX2
+void render_filter_avx2(struct filter_lanes *filter, float *lanes, int frames) {
+    
+    /* eight voices at once */
+    
+    __m256 a1 = _mm256_loadu_ps(filter->a1);
+    __m256 a2 = _mm256_loadu_ps(filter->a2);
+    __m256 a3 = _mm256_loadu_ps(filter->a3);
+    __m256 ic1 = _mm256_loadu_ps(filter->ic1);
+    __m256 ic2 = _mm256_loadu_ps(filter->ic2);
+    __m256 two = _mm256_set1_ps(2.0f);
+    int i;
+    for(i = 0; i < frames; i++) {
+        __m256 v3 = _mm256_sub_ps(_mm256_loadu_ps(lanes + i * 8), ic2);
+        __m256 v1 = _mm256_add_ps(_mm256_mul_ps(a1, ic1), _mm256_mul_ps(a2, v3));
+        __m256 v2 = _mm256_add_ps(ic2, _mm256_add_ps(_mm256_mul_ps(a2, ic1), _mm256_mul_ps(a3, v3)));
+        ic1 = _mm256_sub_ps(_mm256_mul_ps(two, v1), ic1);
+        ic2 = _mm256_sub_ps(_mm256_mul_ps(two, v2), ic2);
+        _mm256_storeu_ps(lanes + i * 8, v2);
+    }
+    _mm256_storeu_ps(filter->ic1, ic1);
+    _mm256_storeu_ps(filter->ic2, ic2);
+}
+#endif
+
+#if defined(SYNTH_NEON)
+void render_filter_neon(struct filter_lanes *filter, float *lanes, int frames) {
+    
+    /* four voices at once */
+    
+    float32x4_t a1 = vld1q_f32(filter->a1);
+    float32x4_t a2 = vld1q_f32(filter->a2);
+    float32x4_t a3 = vld1q_f32(filter->a3);
+    float32x4_t ic1 = vld1q_f32(filter->ic1);
+    float32x4_t ic2 = vld1q_f32(filter->ic2);
+    float32x4_t two = vdupq_n_f32(2.0f);
+    int i;
+    for(i = 0; i < frames; i++) {
+        float32x4_t v3 = vsubq_f32(vld1q_f32(lanes + i * 4), ic2);
+        float32x4_t v1 = vaddq_f32(vmulq_f32(a1, ic1), vmulq_f32(a2, v3));
+        float32x4_t v2 = vaddq_f32(ic2, vaddq_f32(vmulq_f32(a2, ic1), vmulq_f32(a3, v3)));
+        ic1 = vsubq_f32(vmulq_f32(two, v1), ic1);
+        ic2 = vsubq_f32(vmulq_f32(two, v2), ic2);
+        vst1q_f32(lanes + i * 4, v2);
+    }
+    vst1q_f32(filter->ic1, ic1);
+    vst1q_f32(filter->ic2, ic2);
+}
+#endif
+
+static void convert_mix_bus_scalar(const float *in, Sint16 *out, int frames) {
+    
+    /*
+        Convert frames of interleaved stereo to 16 bit. Two uniform random values of half
+        an LSB each are added (triangular dither) so the rounding error turns into low level noise
+        instead of distortion. The random values come from a xorshift generator, the top 23 bits
+        are placed in the mantissa of a float in the range 1.0-2.0.
+    */
+    
+    int i;
+    Uint32 state = dither_state[0];
+    for(i = 0; i < frames * 2; i++) {
+        union { Uint32 i; float f; } r1, r2;
+        double value;
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        r1.i = (state >> 9) | 0x3f800000;
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        r2.i = (state >> 9) | 0x3f800000;
+        value = floor(in[i] * (double)INT16_MAX + (r1.f - 1.5f) + (r2.f - 1.5f) + 0.5);
+        if(value > INT16_MAX) {
+            value = INT16_MAX;
+        } else if(value < INT16_MIN) {
+            value = INT16_MIN;
+        }
+        out[i] = (Sint16)value;
+    }
+    dither_state[0] = state;
+}
+
+#if defined(SYNTH_SSE2)
+static void convert_mix_bus_sse2(const float *in, Sint16 *out, int frames) {
+    
+    /*
+        4 frames (8 samples) at a time with one dither generator per lane. The conversion
+        rounds to nearest and the pack saturates, so there is no clipping branch.
+    */
+    
+    int i = 0;
+    __m128i state = _mm_loadu_si128((const __m128i*)dither_state);
+    __m128i exponent = _mm_set1_epi32(0x3f800000);
+    __m128 scale = _mm_set1_ps((float)INT16_MAX);
+    __m128 offset = _mm_set1_ps(3.0f); /* removes the 1.0-2.0 float range of both random values */
+    for(; i + 4 <= frames; i += 4) {
+        __m128 samples[2];
+        __m128i converted[2];
+        int k;
+        samples[0] = _mm_loadu_ps(in + i*2);
+        samples[1] = _mm_loadu_ps(in + i*2 + 4);
+        for(k = 0; k < 2; k++) {
+            __m128 r1, r2;
+            state = _mm_xor_si128(state, _mm_slli_epi32(state, 13));
+            state = _mm_xor_si128(state, _mm_srli_epi32(state, 17));
+            state = _mm_xor_si128(state, _mm_slli_epi32(state, 5));
+            r1 = _mm_castsi128_ps(_mm_or_si128(_mm_srli_epi32(state, 9), exponent));
+            state = _mm_xor_si128(state, _mm_slli_epi32(state, 13));
+            state = _mm_xor_si128(state, _mm_srli_epi32(state, 17));
+            state = _mm_xor_si128(state, _mm_slli_epi32(state, 5));
+            r2 = _mm_castsi128_ps(_mm_or_si128(_mm_srli_epi32(state, 9), exponent));
+            converted[k] = _mm_cvtps_epi32(_mm_add_ps(_mm_mul_ps(samples[k], scale), _mm_sub_ps(_mm_add_ps(r1, r2), offset)));
+        }
+        _mm_storeu_si128((__m128i*)(out + i*2), _mm_packs_epi32(converted[0], converted[1]));
+    }
+    _mm_storeu_si128((__m128i*)dither_state, state);
+    if(i < frames) {
+        convert_mix_bus_scalar(in + i*2, out + i*2, frames - i);
+    }
+}
+#endif
+
+#if defined(SYNTH_NEON)
+static void convert_mix_bus_neon(const float *in, Sint16 *out, int frames) {
+    
+    /* 4 frames at a time, same as the SSE2 version */
+    
+    int i = 0;
+    uint32x4_t state = vld1q_u32(dither_state);
+    uint32x4_t exponent = vdupq_n_u32(0x3f800000);
+    float32x4_t offset = vdupq_n_f32(3.0f);
+    for(; i + 4 <= frames; i += 4) {
+        float32x4_t samples[2];
+        int32x4_t converted[2];
+        int k;
+        samples[0] = vld1q_f32(in + i*2);
+        samples[1] = vld1q_f32(in + i*2 + 4);
+        for(k = 0; k < 2; k++) {
+            float32x4_t r1, r2, value;
+            state = veorq_u32(state, vshlq_n_u32(state, 13));
+            state = veorq_u32(state, vshrq_n_u32(state, 17));
+            state = veorq_u32(state, vshlq_n_u32(state, 5));
+            r1 = vreinterpretq_f32_u32(vorrq_u32(vshrq_n_u32(state, 9), exponent));
+            state = veorq_u32(state, vshlq_n_u32(state, 13));
+            state = veorq_u32(state, vshrq_n_u32(state, 17));
+            state = veorq_u32(state, vshlq_n_u32(state, 5));
+            r2 = vreinterpretq_f32_u32(vorrq_u32(vshrq_n_u32(state, 9), exponent));
+            value = vmlaq_n_f32(vsubq_f32(vaddq_f32(r1, r2), offset), samples[k], (float)INT16_MAX);
+            /* add 0.5 away from zero and truncate, vcvtnq is not available on 32 bit ARM */
+            value = vaddq_f32(value, vbslq_f32(vcltq_f32(value, vdupq_n_f32(0)), vdupq_n_f32(-0.5f), vdupq_n_f32(0.5f)));
+            converted[k] = vcvtq_s32_f32(value);
+        }
+        vst1q_s16(out + i*2, vcombine_s16(vqmovn_s32(converted[0]), vqmovn_s32(converted[1])));
+    }
+    vst1q_u32(dither_state, state);
+    if(i < frames) {
+        convert_mix_bus_scalar(in + i*2, out + i*2, frames - i);
+    }
+}
+#endif
+
+static void interleave_bus_scalar(const float *left, const float *right, float *out, int frames) {
+    
+    /* write the planar buses to an interleaved float device buffer */
+    
+    int i;
+    for(i = 0; i < frames; i++) {
+        out[i*2] = left[i];
+        out[i*2+1] = right[i];
+    }
+}
+
+#if defined(SYNTH_SSE2)
+static void interleave_bus_sse2(const float *left, const float *right, float *out, int frames) {
+    int i = 0;
+    for(; i + 4 <= frames; i += 4) {
+        __m128 l = _mm_loadu_ps(left + i);
+        __m128 r = _mm_loadu_ps(right + i);
+        _mm_storeu_ps(out + i*2, _mm_unpacklo_ps(l, r));
+        _mm_storeu_ps(out + i*2 + 4, _mm_unpackhi_ps(l, r));
+    }
+    if(i < frames) {
+        interleave_bus_scalar(left + i, right + i, out + i*2, frames - i);
+    }
+}
+#endif
+
+#if defined(SYNTH_NEON)
+static void interleave_bus_neon(const float *left, const float *right, float *out, int frames) {
+    int i = 0;
+    for(; i + 4 <= frames; i += 4) {
+        float32x4x2_t lr;
+        lr.val[0] = vld1q_f32(left + i);
+        lr.val[1] = vld1q_f32(right + i);
+        vst2q_f32(out + i*2, lr);
+    }
+    if(i < frames) {
+        interleave_bus_scalar(left + i, right + i, out + i*2, frames - i);
+    }
+}
+#endif
+
+void t_log(char *message) {
+    
+    if(debuglog) {
+        printf("log: %s \n", message);
+    }
+}
+
+static void update_envelope_rates(struct engine *engine, struct synth_part *part) {
+    
+    /*
+        Calculate how long each envelope stage of a part is and how much the amp changes per frame.
+        Each stage moves from one node in envelope_data to the next, and is shorter the higher
+        envelope_speed_scale is. This is the only place the envelope needs pow.
+    */
+    
+    int i;
+    double speed_multiplier = pow(2, part->envelope_speed_scale);
+    double increment_base = 2.0 / engine->sample_rate; /* one stage per half second at speed 0 */
+    double cursor_inc = increment_base * speed_multiplier;
+    part->envelope_stage_frames = 1 / cursor_inc;
+    for(i = 0; i < 3; i++) {
+        part->envelope_stage_increment[i] = (part->envelope_data[i+1] - part->envelope_data[i]) * cursor_inc;
+    }
+    
+    part->envelope_rates_sample_rate = engine->sample_rate;
+    part->envelope_rates_speed_scale = part->envelope_speed_scale;
+    for(i = 0; i < 4; i++) {
+        part->envelope_rates_data[i] = part->envelope_data[i];
+    }
+}
+
+static int envelope_rates_changed(struct engine *engine, struct synth_part *part) {
+    
+    int i;
+    if(part->envelope_rates_sample_rate != engine->sample_rate || part->envelope_rates_speed_scale != part->envelope_speed_scale) {
+        return true;
+    }
+    for(i = 0; i < 4; i++) {
+        if(part->envelope_rates_data[i] != part->envelope_data[i]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void next_envelope_stage(struct engine *engine, int voice) {
+    
+    /* move on to the next stage and snap the level to the node so rounding errors don't add up */
+    
+    struct synth_part *part = &engine->parts[engine->voice_part[voice]];
+    switch(engine->voice_envelope_stage[voice]) {
+        case ENVELOPE_ATTACK:
+            engine->voice_envelope_stage[voice] = ENVELOPE_DECAY;
+            engine->voice_envelope_level[voice] = part->envelope_data[1];
+            engine->voice_envelope_remaining[voice] += part->envelope_stage_frames;
+            break;
+        case ENVELOPE_DECAY:
+            engine->voice_envelope_stage[voice] = ENVELOPE_SUSTAIN;
+            engine->voice_envelope_level[voice] = part->envelope_data[2];
+            engine->voice_envelope_remaining[voice] += part->envelope_stage_frames;
+            break;
+        case ENVELOPE_SUSTAIN:
+            engine->voice_envelope_stage[voice] = ENVELOPE_RELEASE;
+            break;
+        default:
+            engine->voice_envelope_stage[voice] = ENVELOPE_IDLE;
+            engine->voice_envelope_level[voice] = part->envelope_data[3];
+            engine->voice_envelope_remaining[voice] = 0;
+            break;
+    }
+}
+
+void render_envelope_block(struct engine *engine, int voice, float *gains, int frames) {
+    
+    /*
+        Advance the envelope of the voice by frames and write its amplitude for every frame to
+        gains. Each stage is rendered as a run of additions up to the point where the stage ends.
+    */
+    
+    struct synth_part *part = &engine->parts[engine->voice_part[voice]];
+    int i = 0;
+    while(i < frames) {
+        int stage = engine->voice_envelope_stage[voice];
+        double level = engine->voice_envelope_level[voice];
+        if(stage == ENVELOPE_SUSTAIN && !engine->voice_key_pressed[voice]) {
+            next_envelope_stage(engine, voice);
+            continue;
+        }
+        if(stage == ENVELOPE_SUSTAIN || stage == ENVELOPE_IDLE) {
+            for(; i < frames; i++) {
+                gains[i] = (float)level;
+            }
+        } else {
+            double increment = part->envelope_stage_increment[stage];
+            double remaining = engine->voice_envelope_remaining[voice];
+            int run = frames - i;
+            int end;
+            if(remaining < run) {
+                run = (int)ceil(remaining);
+                if(run < 1) {
+                    run = 1;
+                }
+            }
+            end = i + run;
+            for(; i < end; i++) {
+                level += increment;
+                gains[i] = (float)level;
+            }
+            engine->voice_envelope_level[voice] = level;
+            engine->voice_envelope_remaining[voice] = remaining - run;
+            if(engine->voice_envelope_remaining[voice] <= 0) {
+                next_envelope_stage(engine, voice);
+                gains[i-1] = (float)engine->voice_envelope_level[voice];
+            }
+        }
+    }
+}
+
+static int find_free_voice(struct engine *engine) {
+    
+    /*
+        Pick a voice for a new note. A free voice is used if there is one, otherwise the oldest
+        released voice is stolen, and if all voices are held the oldest one is stolen.
+    */
+    
+    int v;
+    int oldest_released = -1;
+    int oldest = 0;
+    for(v = 0; v < engine->voice_count; v++) {
+        if(engine->voice_note[v] < 0) {
+            return v;
+        }
+        if(!engine->voice_key_pressed[v]) {
+            if(oldest_released < 0 || engine->voice_age[v] < engine->voice_age[oldest_released]) {
+                oldest_released = v;
+            }
+        }
+        if(engine->voice_age[v] < engine->voice_age[oldest]) {
+            oldest = v;
+        }
+    }
+    if(oldest_released > -1) {
+        return oldest_released;
+    }
+    return oldest;
+}
+
+void voice_note_on(struct engine *engine, int part_index, Sint32 key, int note, double velocity) {
+    
+    /* start a note on a part, with a voice from the pool that all parts share */
+    
+    struct synth_part *part = &engine->parts[part_index];
+    int v;
+    
+    /* a key that is held down repeats key down events, keep the note that is already playing */
+    for(v = 0; v < engine->voice_count; v++) {
+        if(engine->voice_note[v] > -1 && engine->voice_key_pressed[v] && engine->voice_key[v] == key) {
+            return;
+        }
+    }
+    
+    v = find_free_voice(engine);
+    if(engine->voice_note[v] < 0) {
+        engine->active_voices++;
+    }
+    engine->voice_part[v] = part_index;
+    engine->voice_note[v] = note;
+    engine->voice_key[v] = key;
+    engine->voice_key_pressed[v] = true;
+    engine->voice_age[v] = ++engine->voice_counter;
+    
+    /* get correct phase increment for note depending on sample rate and table length */
+    engine->voice_phase_increment[v] = get_phase_increment(engine, note, part->pitch_bend_cents + part->fine_tune_cents);
+    
+    /* the waveform stays the one of the note on, its mip level follows the pitch */
+    engine->voice_waveform[v] = part->waveform;
+    update_wave_level(engine, v);
+    
+    /* notes in a zone of the instrument play its sample from the start instead */
+    engine->voice_sample[v] = find_sample_zone(note);
+    engine->voice_sample_position[v] = 0;
+    if(engine->voice_sample[v] >= 0 && samples[engine->voice_sample[v]].resident_frames < samples[engine->voice_sample[v]].frames) {
+        start_sample_stream(engine, v);
+    }
+    
+    /* constant power pan, scaled so the center keeps the level of an unpanned voice */
+    engine->voice_pan_left[v] = (float)(sqrt(2.0) * cos((part->note_pan + 1) * pi / 4));
+    engine->voice_pan_right[v] = (float)(sqrt(2.0) * sin((part->note_pan + 1) * pi / 4));
+    
+    /* retrigger the filter and modulation envelopes from where they are, and work out the coefficients at the next chunk */
+    engine->voice_filter_stage[v] = CONTROL_ENVELOPE_ATTACK;
+    engine->voice_mod_stage[v] = CONTROL_ENVELOPE_ATTACK;
+    engine->voice_filter_base[v] = -1;
+    
+    /* squared, so that the level follows how hard the key is hit more evenly than a straight line */
+    engine->voice_velocity[v] = (float)(velocity * velocity);
+    
+    /* restart the envelope, phase and amp are kept so a stolen voice does not pop */
+    engine->voice_envelope_stage[v] = ENVELOPE_ATTACK;
+    engine->voice_envelope_level[v] = part->envelope_data[0];
+    engine->voice_envelope_remaining[v] = part->envelope_stage_frames;
+}
+
+static void voice_note_off(struct engine *engine, Sint32 key) {
+    
+    int v;
+    for(v = 0; v < engine->voice_count; v++) {
+        if(engine->voice_note[v] > -1 && engine->voice_key[v] == key) {
+            engine->voice_key_pressed[v] = false;
+        }
+    }
+}
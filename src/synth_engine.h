@@ -0,0 +1,495 @@
+/*
+ 
+ This is free and unencumbered software released into the public domain.
+ 
+ Anyone is free to copy, modify, publish, use, compile, sell, or
+ distribute this software, either in source code form or as a compiled
+ binary, for any purpose, commercial or non-commercial, and by any
+ means.
+ 
+ In jurisdictions that recognize copyright laws, the author or authors
+ of this software dedicate any and all copyright interest in the
+ software to the public domain. We make this dedication for the benefit
+ of the public at large and to the detriment of our heirs and
+ successors. We intend this dedication to be an overt act of
+ relinquishment in perpetuity of all present and future rights to this
+ software under copyright law.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ OTHER DEALINGS IN THE SOFTWARE.
+ 
+ For more information, please refer to <http://unlicense.org>
+ 
+ ----------------------------------------------------------------
+ 
+ Synth Samples SDL2 C - the engine of sample 3.
+ 
+ Everything that renders lives here: the voices, oscillators, filter, envelopes, modulation,
+ effects, event queues, patches, sampler and worker pool, with the state of a render in a
+ struct engine. It is built as the synth_engine library, which sample 3 links to play it on an
+ SDL audio device or to render it headless to a wav file, and which bench/synth_bench.c links
+ to time its kernels.
+ 
+ The settings declared extern (table_length, filter_enabled, pool_threads and so on) are set by
+ the program, most of them from the command line, before init_engine_data. The tables, samples
+ and kernels init_engine_data sets up are shared by every engine and never written after it.
+ Kernels the benchmark times on their own are declared here next to the engine functions.
+ 
+ dialect: C89
+ dependencies: SDL2
+ 
+*/
+
+#ifndef SYNTH_ENGINE_H
+#define SYNTH_ENGINE_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <assert.h>
+#include <math.h>
+#include <SDL2/SDL.h>
+
+/* the SIMD kernels that can be built for the target, which one runs is picked at startup */
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SYNTH_SSE2
+#if defined(__GNUC__) || defined(__clang__)
+#define SYNTH_AVX2
+#define SYNTH_TARGET_AVX2 __attribute__((target("avx2")))
+#elif defined(_MSC_VER)
+#define SYNTH_AVX2
+#define SYNTH_TARGET_AVX2
+#endif
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define SYNTH_NEON
+#endif
+
+/* engine, defined after the patches so that it can hold all of the render state */
+#define MAX_PARTS 16 /* one for each MIDI channel */
+struct engine;
+struct engine_settings;
+struct synth_part;
+
+/* render scratch, one per rendering thread */
+#define MAX_CHUNK_FRAMES 64 /* largest chunk handed to write_samples, in frames */
+#define MAX_FILTER_LANES 8 /* voices that are filtered together, one in each SIMD lane */
+struct filter_lanes {
+    int lanes; /* voices in the group, the stride of the frames in lanes */
+    float a1[MAX_FILTER_LANES]; /* state variable filter coefficients */
+    float a2[MAX_FILTER_LANES];
+    float a3[MAX_FILTER_LANES];
+    float ic1[MAX_FILTER_LANES]; /* state of the two integrators */
+    float ic2[MAX_FILTER_LANES];
+};
+struct voice_scratch {
+    float oscillator[MAX_CHUNK_FRAMES];
+    float envelope[MAX_CHUNK_FRAMES];
+    float mono[MAX_CHUNK_FRAMES]; /* one voice in mono before it is panned onto the buses */
+    float lanes[MAX_CHUNK_FRAMES * MAX_FILTER_LANES]; /* the voices of a group side by side, frame by frame */
+    struct filter_lanes filter;
+};
+
+/* general */
+void t_log(char *message);
+extern int debuglog;
+extern double performance_frequency; /* SDL_GetPerformanceFrequency, set in init_engine_data */
+
+/* shared data, set up once for all engines */
+void init_engine_data(const struct engine_settings *settings, int engines, size_t extra_size);
+void cleanup_engine_data(void);
+
+/* arena */
+void *alloc_memory(size_t size, char *name); /* arena allocation */
+void *free_memory(void *ptr); /* arena allocation */
+extern SDL_atomic_t in_audio_callback; /* set by the program while it renders audio, for the asserts */
+extern SDL_threadID audio_thread_id;
+
+/* voice */
+void build_sine_table(int16_t *data, int wave_length);
+double get_pitch(double note);
+extern int table_length; /* must be a power of two, the oscillator wraps with a mask */
+extern int table_bits; /* log2 of table_length */
+extern int16_t *sine_wave_table;
+extern float *wave_table; /* sine_wave_table as float in the range -1.0 to 1.0, read by the oscillator kernels */
+
+/* wavetable bank */
+#define WAVE_SINE 0
+#define WAVE_SAW 1
+#define WAVE_SQUARE 2
+#define WAVE_TRIANGLE 3
+#define WAVE_USER 4
+#define WAVE_COUNT 5
+void prepare_waveform(int waveform);
+extern const char *user_wave_path;
+extern const char *wave_names[WAVE_COUNT];
+
+/* table cache */
+extern const char *table_cache_option; /* --cache, a directory or off */
+
+/* pitch table */
+double get_phase_increment(struct engine *engine, int note, double cents);
+extern int max_note;
+extern int min_note;
+
+/* oscillator kernels */
+void render_oscillator_scalar(const float *table, int length, double *phase, double phase_increment, float *out, int frames);
+#if defined(SYNTH_SSE2)
+void render_oscillator_sse2(const float *table, int length, double *phase, double phase_increment, float *out, int frames);
+#endif
+#if defined(SYNTH_AVX2)
+void render_oscillator_avx2(const float *table, int length, double *phase, double phase_increment, float *out, int frames);
+#endif
+#if defined(SYNTH_NEON)
+void render_oscillator_neon(const float *table, int length, double *phase, double phase_increment, float *out, int frames);
+#endif
+
+/* fixed point oscillator */
+#define OSCILLATOR_TRUNCATE 0 /* double phase, nearest lower table entry */
+#define OSCILLATOR_LINEAR 1 /* 32 bit phase, linear interpolation */
+#define OSCILLATOR_CUBIC 2 /* 32 bit phase, cubic interpolation */
+Uint32 get_phase_step(double phase_increment);
+void render_oscillator_linear_scalar(const float *table, int bits, Uint32 *phase, Uint32 step, float *out, int frames);
+void render_oscillator_cubic_scalar(const float *table, int bits, Uint32 *phase, Uint32 step, float *out, int frames);
+#if defined(SYNTH_SSE2)
+void render_oscillator_linear_sse2(const float *table, int bits, Uint32 *phase, Uint32 step, float *out, int frames);
+#endif
+#if defined(SYNTH_AVX2)
+void render_oscillator_linear_avx2(const float *table, int bits, Uint32 *phase, Uint32 step, float *out, int frames);
+void render_oscillator_cubic_avx2(const float *table, int bits, Uint32 *phase, Uint32 step, float *out, int frames);
+#endif
+#if defined(SYNTH_NEON)
+void render_oscillator_linear_neon(const float *table, int bits, Uint32 *phase, Uint32 step, float *out, int frames);
+#endif
+
+/* mix bus and output conversion */
+extern void (*convert_mix_bus)(const float *in, Sint16 *out, int frames);
+
+/* master effects */
+#define REVERB_LINES 8
+void process_master_bus(struct engine *engine, float *left, float *right, int frames);
+
+/* parameter smoothing, works on blocks so any parameter (gain, pan, cutoff) can use it */
+#define SMOOTH_LINEAR 0 /* constant rate, reaches the target */
+#define SMOOTH_ONE_POLE 1 /* exponential approach, fast at first and slower near the target */
+struct smoother {
+    int type;
+    float current;
+    float step; /* linear: largest change per frame */
+    double coefficient; /* one pole: what is left of the distance after one frame */
+    float block_coefficient; /* coefficient to the power of block_frames */
+    int block_frames;
+};
+
+/* voice pool */
+#define MAX_VOICES 256 /* shared by all parts */
+#define DEFAULT_VOICES 64
+void voice_note_on(struct engine *engine, int part_index, Sint32 key, int note, double velocity);
+void write_samples(struct engine *engine, float *left, float *right, int begin, int frames);
+
+/* control envelopes, for the filter and the modulation matrix */
+#define CONTROL_ENVELOPE_ATTACK 0
+#define CONTROL_ENVELOPE_DECAY 1
+#define CONTROL_ENVELOPE_SUSTAIN 2
+#define CONTROL_ENVELOPE_RELEASE 3
+struct control_envelope {
+    double times[3]; /* attack, decay and release in seconds */
+    double sustain;
+};
+
+/* filter */
+#define FILTER_DEFAULT_CUTOFF 1200.0 /* Hz, before the envelope opens it */
+void update_filter_coefficients(struct engine *engine, int voice, double octaves);
+void render_filter_scalar(struct filter_lanes *filter, float *lanes, int frames);
+#if defined(SYNTH_SSE2)
+void render_filter_sse2(struct filter_lanes *filter, float *lanes, int frames);
+#endif
+#if defined(SYNTH_AVX2)
+void render_filter_avx2(struct filter_lanes *filter, float *lanes, int frames);
+#endif
+#if defined(SYNTH_NEON)
+void render_filter_neon(struct filter_lanes *filter, float *lanes, int frames);
+#endif
+void flush_denormals(void);
+extern int filter_enabled; /* --filter off leaves it out */
+
+/* modulation */
+#define MAX_LFOS 2
+#define MAX_MOD_ROUTES 8
+#define LFO_SINE 0
+#define LFO_TRIANGLE 1
+#define LFO_SQUARE 2
+#define LFO_SAW 3
+#define LFO_SHAPE_COUNT 4
+#define MOD_SOURCE_LFO1 0
+#define MOD_SOURCE_LFO2 1
+#define MOD_SOURCE_ENVELOPE 2
+#define MOD_SOURCE_VELOCITY 3
+#define MOD_SOURCE_COUNT 4
+#define MOD_PITCH 0 /* cents */
+#define MOD_AMP 1 /* added to a gain of 1.0 */
+#define MOD_CUTOFF 2 /* octaves */
+#define MOD_DESTINATION_COUNT 3
+struct lfo {
+    int shape;
+    double rate; /* Hz */
+    double phase; /* 0.0-1.0 */
+    double value; /* -1.0 to 1.0 at the end of the last chunk */
+};
+struct mod_route {
+    int source;
+    int destination;
+    double amount;
+};
+int parse_mod_route(const char *text, struct mod_route *routes, int *count);
+int parse_lfo(const char *text, struct lfo *lfo_settings);
+
+/* worker pool */
+#define MAX_WORKERS 16
+int get_pool_threads(int requested);
+void start_worker_pool(void);
+void stop_worker_pool(void);
+extern int pool_threads; /* set with --threads and always 1-MAX_WORKERS, 1 renders on the audio thread only */
+
+/* sampler */
+#define MAX_SAMPLES 128 /* zones of an instrument */
+extern const char *sampler_path;
+extern int stream_wait; /* headless renders wait for streamed data instead of playing silence */
+extern SDL_atomic_t stream_misses;
+
+/* event queue */
+#define EVENT_QUEUE_SIZE 256 /* must be a power of two */
+#define EVENT_NOTE_ON 0
+#define EVENT_NOTE_OFF 1
+#define EVENT_PARAMETER 2
+#define EVENT_FRAME_FROM_TIMESTAMP ((Uint64)-1) /* place the event by its timestamp */
+#define PARAMETER_PITCH_BEND 0 /* value in cents */
+#define PARAMETER_FINE_TUNE 1 /* value in cents */
+#define PARAMETER_ENVELOPE_SPEED 2 /* value 1-8 */
+#define PARAMETER_WAVEFORM 3 /* WAVE_SINE to WAVE_USER */
+#define PARAMETER_PAN 4 /* -1.0 to 1.0 */
+#define PARAMETER_FILTER_CUTOFF 5 /* Hz */
+#define PARAMETER_FILTER_RESONANCE 6 /* 0.0 to 1.0 */
+#define PARAMETER_VIBRATO 7 /* amount of route 0 in cents */
+#define PARAMETER_DELAY_MIX 8 /* 0.0-1.0 */
+#define PARAMETER_REVERB_MIX 9 /* 0.0-1.0 */
+struct synth_event {
+    int type;
+    Uint64 timestamp; /* SDL_GetPerformanceCounter when the event was created */
+    Uint64 frame; /* frame on the render timeline, or EVENT_FRAME_FROM_TIMESTAMP */
+    int part; /* the part it plays, the MIDI channel */
+    Sint32 key; /* key that started or stopped a note */
+    int note; /* note for note events, parameter id for parameter events */
+    double value; /* new parameter value, or velocity 0.0-1.0 for note on */
+};
+struct event_queue {
+    struct synth_event events[EVENT_QUEUE_SIZE];
+    SDL_atomic_t write_index; /* only changed by the producer */
+    SDL_atomic_t read_index; /* only changed by the consumer */
+};
+int push_event(struct event_queue *queue, const struct synth_event *event);
+void send_note_event(struct engine *engine, int type, Sint32 key, int note);
+void send_parameter_event(struct engine *engine, int parameter, double value);
+
+/* amplitude envelope */
+#define ENVELOPE_ATTACK 0 /* node 0 to node 1 */
+#define ENVELOPE_DECAY 1 /* node 1 to node 2 */
+#define ENVELOPE_RELEASE 2 /* node 2 to node 3 */
+#define ENVELOPE_SUSTAIN 3 /* hold on node 2 while the key is pressed */
+#define ENVELOPE_IDLE 4 /* stay on node 3 */
+void render_envelope_block(struct engine *engine, int voice, float *gains, int frames);
+
+/* amplitude smoothing */
+extern double smoothing_time; /* seconds for a full 0-1 change, about 100 frames at 44.1kHz */
+extern double smoothing_enabled;
+
+/* patches */
+struct patch {
+    int waveform;
+    double envelope_data[4];
+    double envelope_speed_scale;
+    double fine_tune_cents;
+    double pan;
+    double filter_cutoff;
+    double filter_resonance;
+    double filter_envelope_octaves;
+    struct control_envelope filter_envelope;
+    struct control_envelope mod_envelope;
+    struct lfo lfos[MAX_LFOS]; /* only shape and rate are used, the LFOs keep running */
+    struct mod_route mod_routes[MAX_MOD_ROUTES];
+    int mod_route_count;
+    double delay_times[2];
+    double delay_feedback;
+    double delay_mix;
+    double reverb_time;
+    double reverb_damping;
+    double reverb_mix;
+};
+int load_patch(const char *path, struct patch *patch);
+void publish_patch(struct synth_part *part, const struct patch *patch);
+int parse_effect(const char *text, int delay, struct patch *patch);
+extern struct patch default_patch; /* the settings from the command line, what a patch file leaves out */
+
+/* engine */
+#define DEFAULT_CHUNK_FRAMES 32
+struct synth_part {
+    int waveform; /* used for new notes */
+    double note_pan; /* -1.0 left to 1.0 right, used for new notes */
+    double pitch_bend_cents; /* applied to all voices of the part */
+    double fine_tune_cents;
+    double envelope_speed_scale; /* set envelope speed 1-8 */
+    double envelope_data[4]; /* ADSR amp range 0.0-1.0 */
+    double envelope_stage_frames; /* length of one stage in frames */
+    double envelope_stage_increment[3]; /* amp change per frame for attack, decay and release */
+    int envelope_rates_sample_rate; /* settings the envelope rates were calculated for */
+    double envelope_rates_speed_scale;
+    double envelope_rates_data[4];
+    double filter_cutoff;
+    double filter_resonance;
+    double filter_envelope_octaves;
+    struct control_envelope filter_envelope;
+    struct lfo lfos[MAX_LFOS];
+    struct control_envelope mod_envelope;
+    struct mod_route mod_routes[MAX_MOD_ROUTES];
+    int mod_route_count;
+    struct patch patch_slots[3];
+    SDL_atomic_t patch_middle; /* slot between the threads, with PATCH_FRESH when it is new */
+    int patch_back; /* slot the main thread writes */
+    int patch_front; /* slot the audio thread reads */
+};
+struct engine_settings {
+    int sample_rate;
+    int chunk_frames; /* largest chunk handed to write_samples, up to MAX_CHUNK_FRAMES */
+    int bus_frames; /* longest pass of the buses, engine_render splits longer blocks */
+    int voice_count; /* voices all parts share, up to MAX_VOICES */
+    int oscillator_mode;
+    int use_pool; /* render large blocks on the worker pool, there is one pool so only one engine can */
+};
+struct engine {
+    struct synth_part parts[MAX_PARTS];
+
+    /* settings, fixed when the engine is made */
+    int sample_rate;
+    int chunk_frames;
+    int voice_count;
+    int oscillator_mode;
+    int filter_lanes; /* voices in a group, the width of render_filter */
+    void (*render_filter)(struct filter_lanes *filter, float *lanes, int frames);
+    int use_pool;
+    int pool_enabled; /* true when the current block is large enough for the pool */
+    double *pitch_increments; /* phase increment for each note from min_note to max_note at sample_rate */
+
+    /* voices, taken by any part */
+    int voice_part[MAX_VOICES]; /* part the note was played on */
+    int voice_note[MAX_VOICES]; /* integer representing halfnotes, -1 when the voice is free */
+    Sint32 voice_key[MAX_VOICES]; /* key that triggered the note */
+    int voice_key_pressed[MAX_VOICES];
+    unsigned long voice_age[MAX_VOICES]; /* note on order, used for voice stealing */
+    double voice_phase[MAX_VOICES];
+    Uint32 voice_phase_fixed[MAX_VOICES]; /* phase for the interpolating oscillators, 2^32 is one cycle */
+    double voice_phase_increment[MAX_VOICES];
+    int voice_waveform[MAX_VOICES]; /* waveform of the part at note on */
+    const float *voice_table[MAX_VOICES]; /* mip level of the waveform for the current increment */
+    float voice_pan_left[MAX_VOICES]; /* pan gains, both 1.0 in the center */
+    float voice_pan_right[MAX_VOICES];
+    float voice_velocity[MAX_VOICES]; /* gain from the note on velocity */
+    int voice_envelope_stage[MAX_VOICES];
+    double voice_envelope_level[MAX_VOICES];
+    double voice_envelope_remaining[MAX_VOICES]; /* frames left of the current stage */
+    struct smoother voice_amp[MAX_VOICES]; /* smoothed envelope level */
+    int voice_filter_stage[MAX_VOICES];
+    double voice_filter_level[MAX_VOICES];
+    double voice_filter_base[MAX_VOICES]; /* filter_cutoff the coefficients were worked out for, -1 to force it */
+    double voice_filter_octaves[MAX_VOICES]; /* and how far the envelope had opened it */
+    double voice_filter_resonance[MAX_VOICES];
+    float voice_filter_a1[MAX_VOICES];
+    float voice_filter_a2[MAX_VOICES];
+    float voice_filter_a3[MAX_VOICES];
+    float voice_filter_ic1[MAX_VOICES];
+    float voice_filter_ic2[MAX_VOICES];
+    int voice_mod_stage[MAX_VOICES];
+    double voice_mod_level[MAX_VOICES];
+    double voice_mod_pitch[MAX_VOICES]; /* cents at the end of the last chunk */
+    float voice_mod_amp[MAX_VOICES]; /* gain at the end of the chunk */
+    float voice_mod_amp_start[MAX_VOICES]; /* and at its start */
+    double voice_mod_cutoff[MAX_VOICES]; /* octaves */
+    int voice_sample[MAX_VOICES]; /* zone the voice plays, -1 for the oscillator */
+    double voice_sample_position[MAX_VOICES]; /* in frames of the sample */
+    int voice_stream_generation[MAX_VOICES]; /* counts the note ons of streamed samples, render thread only */
+    SDL_atomic_t voice_stream_request[MAX_VOICES]; /* generation * MAX_SAMPLES + zone, set at note on */
+    SDL_atomic_t voice_stream_ready[MAX_VOICES]; /* the request the ring is being filled for */
+    SDL_atomic_t voice_stream_end[MAX_VOICES]; /* the ring holds the sample up to this frame */
+    SDL_atomic_t voice_stream_used[MAX_VOICES]; /* frames before this one are no longer needed */
+    unsigned long voice_counter;
+    int active_voices; /* voices with a note, only used on the render thread */
+    int chunk_voices[MAX_VOICES]; /* the voices that play in the current chunk */
+    int chunk_voice_costs[MAX_VOICES];
+    int chunk_voice_count;
+    int smoothing_sample_rate;
+
+    /* mix bus */
+    float *bus_left; /* planar stereo, interleaved at the end of engine_render */
+    float *bus_right;
+    int bus_frames;
+    struct voice_scratch scratch; /* for the thread that renders the engine */
+
+    /* master effects, set by the patch of part 0 */
+    double delay_times[2]; /* seconds, left and right */
+    double delay_feedback;
+    double delay_damping;
+    double delay_mix;
+    double reverb_time;
+    double reverb_damping;
+    double reverb_mix;
+    float *delay_data[2];
+    int delay_length; /* frames in each delay ring, a power of two */
+    int delay_position;
+    float delay_state[2]; /* lowpass in the feedback */
+    int delay_running;
+    float *reverb_data; /* REVERB_LINES rings of reverb_length frames one after the other */
+    int reverb_length;
+    int reverb_position;
+    int reverb_lengths[REVERB_LINES];
+    float reverb_gains[REVERB_LINES];
+    float reverb_state[REVERB_LINES];
+    int reverb_running;
+    int reverb_rates_sample_rate; /* settings the reverb gains were worked out for */
+    double reverb_rates_time;
+    int effects_tail; /* frames the effects still ring for, only used on the render thread */
+
+    /* events */
+    struct synth_event pending_events[EVENT_QUEUE_SIZE]; /* taken from the queues, sorted by frame */
+    int pending_first;
+    int pending_last;
+    Uint64 rendered_frames; /* the render timeline, frames rendered since the start */
+    Uint64 block_start_frame; /* rendered_frames at the start of the block */
+    Uint64 block_ticks; /* SDL_GetPerformanceCounter at the start of the block */
+    Uint64 previous_block_ticks;
+    struct event_queue input_queue; /* main thread to render thread */
+    struct event_queue midi_queue; /* midi thread to render thread, a queue has one producer */
+
+    /* sample streaming */
+    Uint8 *stream_rings; /* STREAM_RING_FRAMES frames for each voice */
+    SDL_RWops *stream_files[MAX_SAMPLES]; /* files of the streamed samples, only read by the prefetch thread */
+    SDL_Thread *prefetch_thread;
+    SDL_sem *stream_wake; /* posted at note on of a streamed sample */
+    SDL_sem *stream_filled; /* posted after a pass of the prefetch thread while stream_waiting is set */
+    SDL_atomic_t stream_waiting; /* set while a headless render waits for streamed data */
+    SDL_atomic_t prefetch_quit;
+};
+struct engine *engine_create(const struct engine_settings *settings);
+void engine_destroy(struct engine *engine);
+int engine_begin_block(struct engine *engine, int frames);
+int engine_render(struct engine *engine, float *out, int frames);
+int engine_sounding(struct engine *engine);
+int get_chunk_frames(int buffer_frames, int largest);
+#define KEYBOARD_PART 0 /* part the computer keyboard plays and the function keys change */
+
+#endif
@@ -37,12 +37,16 @@
     Everytime a buffer needs to be filled, the audio_callback function which we have declared will be called.
     The buffer will then be filled with random samples to produce noise.
 
+ 2. The main loop sleeps in SDL_WaitEventTimeout until there is input, so it wakes up as soon as
+    a key is pressed and uses no CPU in between. The window is only drawn when it needs to be.
+
 
  dialect: C89
  dependencies: SDL2
  created by Harry Lundstrom on 14/09/15.
  these samples will be updated continuously, check the repo for latest versions.
- Uncomment the main function of one of the synth_samples_sdl2 files to run.
+ Define SYNTH_SAMPLE as the number of the sample to run, sample 1 runs when it is not defined.
+ CMakeLists.txt builds every sample as a program of its own, see the README.
 
  */
 
@@ -60,6 +64,9 @@ static int alloc_count = 0;
 
 /* SDL */
 
+/* longest time the main loop sleeps without input, it wakes up at once on an event */
+#define UI_WAIT_MILLISECONDS 1000
+
 /* must be a power of two, decrease to allow for a lower latency, increase to reduce risk of underrun. */
 static Uint16 buffer_size = 4096;
 
@@ -68,7 +75,7 @@ static SDL_AudioSpec audio_spec;
 static SDL_Event event;
 static SDL_Window *window = NULL;
 static SDL_Renderer *renderer = NULL;
-static SDL_GLContext context;
+static int redraw = true; /* set when the window has to be drawn again */
 static int sample_rate = 44100;
 
 /* functions */
@@ -84,11 +91,13 @@ static int setup_sdl_audio(void);
 static void destroy_sdl(void);
 static void t_log(char *message);
 
+#if !defined(SYNTH_SAMPLE) || SYNTH_SAMPLE == 1
 int main(int argc, char* argv[]) {
 
     run();
     return 0;
 }
+#endif
 
 static void run(void) {
 
@@ -114,24 +123,35 @@ static void run(void) {
 
 static void check_sdl_events(SDL_Event event) {
 
-    while (SDL_PollEvent(&event)) {
+    /* sleep until the first event arrives, then take the rest that are waiting */
+    if(!SDL_WaitEventTimeout(&event, UI_WAIT_MILLISECONDS)) {
+        return;
+    }
+    do {
         switch(event.type) {
             case SDL_QUIT:
                 quit = 1;
                 break;
+            case SDL_WINDOWEVENT:
+                if(event.window.event == SDL_WINDOWEVENT_EXPOSED || event.window.event == SDL_WINDOWEVENT_SIZE_CHANGED) {
+                    redraw = true;
+                }
+                break;
         }
-    }
+    } while (SDL_PollEvent(&event));
 }
 
 static void main_loop(void) {
 
-    /* check for keyboard events etc. */
+    /* wait for keyboard events etc. */
     check_sdl_events(event);
 
-    /* update screen. */
-    SDL_RenderClear(renderer);
-    SDL_RenderPresent(renderer);
-    SDL_Delay(16);
+    /* update screen, only when something on it changed. */
+    if(redraw) {
+        SDL_RenderClear(renderer);
+        SDL_RenderPresent(renderer);
+        redraw = false;
+    }
 }
 
 static void *alloc_memory(size_t size, char *name) {
@@ -213,17 +233,12 @@ static void setup_sdl(void) {
         }
     }
 
-    window = SDL_CreateWindow("", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, 640, 480, SDL_WINDOW_OPENGL);
+    window = SDL_CreateWindow("", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, 640, 480, SDL_WINDOW_SHOWN);
 
     if(window != NULL) {
-        context = SDL_GL_CreateContext(window);
-        if(context == NULL) {
-            printf("\nFailed to create context: %s\n", SDL_GetError());
-        }
-
-        renderer = SDL_CreateRenderer(window, -1, 0);
+        /* the renderer makes its own context, vsync keeps a redraw from presenting faster than the display */
+        renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_PRESENTVSYNC);
         if (renderer != NULL) {
-            SDL_GL_SetSwapInterval(1);
             SDL_SetWindowTitle(window, "SDL2 synth sample 1");
         } else {
             if(debuglog) {
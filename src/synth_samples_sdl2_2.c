@@ -41,11 +41,15 @@
     sample rate and table size to get correct phase for the oscillator.
     Use the keyboard to play different notes, plus and minus to change octave
  
+ 3. The main loop sleeps in SDL_WaitEventTimeout until there is input, so a key press is handled
+    right away instead of after up to 16 ms of SDL_Delay. The window is only drawn when it needs to be.
+ 
  dialect: C89
  dependencies: SDL2
  created by Harry Lundstrom on 5/10/15.
  these samples will be updated continuously, check the repo for latest versions.
- Uncomment the main function of one of the synth_samples_sdl2 files to run.
+ Define SYNTH_SAMPLE as the number of the sample to run, sample 1 runs when it is not defined.
+ CMakeLists.txt builds every sample as a program of its own, see the README.
 
 */
 
@@ -62,6 +66,7 @@ static int debuglog = 0;
 static int alloc_count = 0;
 
 /* SDL */
+#define UI_WAIT_MILLISECONDS 1000 /* longest time the main loop sleeps without input */
 
 /* must be a power of two, decrease to allow for a lower latency, increase to reduce risk of underrun */
 static Uint16 buffer_size = 4096;
@@ -70,7 +75,7 @@ static SDL_AudioSpec audio_spec;
 static SDL_Event event;
 static SDL_Window *window = NULL;
 static SDL_Renderer *renderer = NULL;
-static SDL_GLContext context;
+static int redraw = true; /* set when the window has to be drawn again */
 static int sample_rate = 44100;
 static int table_length = 1024;
 
@@ -106,13 +111,13 @@ static void main_loop(void);
 static void handle_note_keys(SDL_Keysym* keysym);
 static void print_note(int note);
 
-/*
+#if defined(SYNTH_SAMPLE) && SYNTH_SAMPLE == 2
 int main(int argc, char* argv[]) {
     
     run();
     return 0;
 }
-*/
+#endif
 
 static void run(void) {
     
@@ -308,17 +313,12 @@ static void setup_sdl(void) {
         }
     }
     
-    window = SDL_CreateWindow("", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, 640, 480, SDL_WINDOW_OPENGL);
+    window = SDL_CreateWindow("", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, 640, 480, SDL_WINDOW_SHOWN);
     
     if(window != NULL) {
-        context = SDL_GL_CreateContext(window);
-        if(context == NULL) {
-            printf("\nFailed to create context: %s\n", SDL_GetError());
-        }
-        
-        renderer = SDL_CreateRenderer(window, -1, 0);
+        /* the renderer makes its own context, vsync keeps a redraw from presenting faster than the display */
+        renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_PRESENTVSYNC);
         if (renderer != NULL) {
-            SDL_GL_SetSwapInterval(1);
             SDL_SetWindowTitle(window, "SDL2 synth sample 2");
         } else {
             if(debuglog) {
@@ -389,11 +389,20 @@ static int setup_sdl_audio(void) {
 
 static void check_sdl_events(SDL_Event event) {
     
-    while (SDL_PollEvent(&event)) {
+    /* sleep until the first event arrives, then take the rest that are waiting */
+    if(!SDL_WaitEventTimeout(&event, UI_WAIT_MILLISECONDS)) {
+        return;
+    }
+    do {
         switch(event.type) {
             case SDL_QUIT:
                 quit = 1;
                 break;
+            case SDL_WINDOWEVENT:
+                if(event.window.event == SDL_WINDOWEVENT_EXPOSED || event.window.event == SDL_WINDOWEVENT_SIZE_CHANGED) {
+                    redraw = true;
+                }
+                break;
             case SDL_KEYDOWN:
                 handle_key_down(&event.key.keysym);
                 break;
@@ -401,7 +410,7 @@ static void check_sdl_events(SDL_Event event) {
                 handle_key_up(&event.key.keysym);
                 break;
         }
-    }
+    } while (SDL_PollEvent(&event));
 }
 
 static void destroy_sdl(void) {
@@ -435,13 +444,15 @@ static void handle_key_down(SDL_Keysym* keysym) {
 
 static void main_loop(void) {
     
-    /* check for keyboard events etc */
+    /* wait for keyboard events etc */
     check_sdl_events(event);
     
-    /* update screen */
-    SDL_RenderClear(renderer);
-    SDL_RenderPresent(renderer);
-    SDL_Delay(16);
+    /* update screen, only when something on it changed */
+    if(redraw) {
+        SDL_RenderClear(renderer);
+        SDL_RenderPresent(renderer);
+        redraw = false;
+    }
 }
 
 static void handle_note_keys(SDL_Keysym* keysym) {
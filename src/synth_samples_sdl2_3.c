@@ -44,66 +44,239 @@
  3. Use an amplitude envelope with attack, decay, sustain and release (ADSR). Also smooth
     out the amp differences to avoid pops.
  
+ 4. Play several notes at once with a pool of voices. The voice state is stored as one array per
+    property (struct-of-arrays) so that the render loop walks contiguous memory. When every voice
+    is busy the oldest released voice, or else the oldest voice, is stolen for the new note.
+ 
+ 5. The oscillator (phase accumulation, wrap and table lookup) runs as a separate kernel that
+    renders a whole chunk for one voice. There are SSE2, AVX2 and NEON versions that handle
+    4 or 8 frames at a time, the best one supported by the CPU is picked at startup.
+ 
+ 6. The envelope runs as a small state machine (attack, decay, sustain, release, idle). The
+    per-frame amp increment of each stage is calculated up front whenever the envelope settings
+    or the sample rate change, so rendering a block of envelope gains is only additions.
+ 
+ 7. Phase increments are looked up in a table that holds one entry per note, and a second table
+    with the ratio for each cent in between. The tables are rebuilt if the sample rate or table
+    length changes, so pitch bend and fine tune cost two lookups and a multiply per chunk.
+ 
+ 8. Key presses are not written straight into the voices, since the audio callback runs on
+    another thread. The main thread pushes timestamped events into a single-producer/single-consumer
+    ring buffer, and audio_callback takes them out at chunk boundaries. Neither side waits or locks.
+    Use the up and down arrow keys to change the envelope speed.
+ 
+ 9. Voices are mixed on a 32 bit float bus so that summing them neither truncates nor wraps.
+    SDL is asked for float samples (AUDIO_F32SYS), in which case the bus is only interleaved into
+    the device buffer.
+    If the device wants 16 bit samples what the engine rendered is converted once at the end of
+    audio_callback, with triangular dither.
+ 
+ 10. The buffer size can be chosen at startup. Run with --latency low to ask for 64 frames,
+    then 128 and 256 if the device gives back something else, or with --buffer followed by a
+    size in frames. The chunk size is adjusted to divide the buffer the device ends up with.
+ 
+ 11. Every callback is timed with SDL_GetPerformanceCounter and added to a histogram made of
+    atomic counters. Once a second the main thread takes the numbers and shows min, average, 99th
+    percentile and max render time, DSP load and the number of callbacks that missed their
+    deadline in the window title (and prints them with debuglog on).
+ 
+ 12. The same render path can run without window or audio device, as fast as the CPU allows.
+    Run with --render out.wav --score notes.txt to render a score to a wav file, this prints how
+    many frames per second were rendered. Add --float for a 32 bit float file.
+ 
+ 13. Besides sine there are saw, square, triangle and a user waveform, selected with F1-F5.
+    Rich waveforms alias at high notes, so each one is stored as a bank of tables (mip levels)
+    built by adding harmonics, where every level has half the harmonics of the level below.
+    Each chunk the voice gets the level whose harmonics all stay below half the sample rate,
+    so notes that are bent or modulated up switch to fewer harmonics as they rise.
+    A user cycle can be loaded with --wave followed by a text file with one sample per line.
+ 
+ 14. The oscillator phase is a 32 bit fixed point number where the full range is one cycle, so
+    it wraps for free when it overflows and the table index and fraction are just shifts.
+    The fraction interpolates between table entries, linear by default or cubic with
+    --oscillator cubic, which keeps the quality up with smaller tables (--table 256).
+    --oscillator truncate uses the original double phase without interpolation.
+ 
+ 15. Smoothing works on whole chunks. A smoother works out where the value will be at the end
+    of the chunk once and writes a straight ramp to it, so the render loop is a plain multiply.
+    Its time is in seconds and converted with sample_rate, so it sounds the same at any rate.
+    The same smoother can be used for gain, pan or cutoff, with a linear or one pole curve.
+ 
+ 16. Voices are rendered in mono and added to planar left and right buses with their own pan
+    gains (constant power), so the oscillator, envelope and gain work is done once per frame.
+    The buses are interleaved in one SIMD pass at the output, and converted to 16 bit in another
+    when the device wants that. Use the left and right arrow keys to pan new notes.
+ 
+ 17. The number of sounding voices is tracked. When nothing sounds and no events are waiting the
+    callback only clears the device buffer and returns. Otherwise the first voice of each chunk
+    writes to the buses instead of adding, so they are never cleared and then written again,
+    and the device buffer is written once by the interleave.
+ 
+ 18. With many voices one thread is not enough. Run with --threads followed by a count (0 for
+    one per core) to render the voices of each chunk on a pool of threads. The voices are spread
+    by their estimated cost, idle workers steal from the others, and the partial buses are added
+    together at the end of the chunk. The workers spin between the chunks of a callback and sleep
+    between callbacks. Small buffers and few voices are rendered on the audio thread alone,
+    since handing out the work would cost more than it saves. The audio thread never waits for
+    a worker that has not started, and --voices makes the pool as large as 256 voices.
+ 
+ 19. Memory comes from one arena that is sized and allocated in init_data, every allocation in
+    it is aligned to 64 bytes for SIMD. Blocks are given back in reverse order. In debug builds
+    (without NDEBUG) an assert fires if anything is allocated or freed while rendering audio.
+ 
+ 20. Events happen at an exact frame. Each event is placed on a timeline of rendered frames,
+    from its timestamp for key presses or from its time for score events, and the render loop
+    splits a chunk exactly where the next event falls. Key presses are placed one buffer late
+    so that they keep their timing instead of jittering by a whole buffer.
+ 
+ 21. MIDI keyboards can play the synth. Build with SYNTH_MIDI defined and link CoreMIDI and
+    CoreFoundation on macOS or libasound on Linux, then run with --midi. On Linux the synth is an
+    ALSA sequencer client, connect a keyboard with aconnect or give its port, like --midi 20:0.
+    MIDI messages are read on their own thread and go straight into a second event queue with
+    the time they arrived, so they don't wait for the main loop. Velocity scales the envelope
+    and pitch bend moves the voices of its channel up to two halfnotes.
+ 
+ 22. The main loop sleeps in SDL_WaitEventTimeout until there is input or the audio stats are
+    due, so a key press is sent right away instead of after up to 16 ms of SDL_Delay, and an idle
+    window costs no CPU or GPU. The window is only drawn when it needs to be.
+ 
+ 23. Between the oscillator and the amp each voice has a resonant lowpass filter, a state
+    variable filter with its own envelope that opens the cutoff by up to three octaves.
+    The envelope is updated once per chunk, and the coefficients (a pow and a tan) only when
+    the cutoff moved enough to hear. The voices of a chunk are filtered in groups, with the
+    oscillators of a group written side by side so that one SIMD kernel filters four (SSE2,
+    NEON) or eight (AVX2) voices at once. F6 and F7 move the cutoff, F8 and F9 the resonance,
+    and --filter off leaves the filter out.
+ 
+ 24. Slow changes come from a modulation matrix that runs at control rate, once per chunk.
+    Two LFOs, a second envelope and the note velocity are routed to pitch, amp and cutoff with
+    --mod source:destination:amount, and --lfo sets the rate and shape of an LFO. The amp is
+    ramped over the chunk and pitch takes the middle of its ramp, so nothing steps audibly, and
+    --control sets how many frames a chunk (and so a control step) has at most. F10 turns on
+    the vibrato of the first route, LFO 1 to pitch.
+ 
+ 25. A patch (waveform, envelopes, filter, LFOs and routes) can be loaded from a text file with
+    --patch, and F11 loads it again so it can be edited while playing. The file is read and
+    checked on the main thread and then handed to the audio thread through a triple buffer:
+    three patch slots, where the main thread writes one, the audio thread reads one and the
+    third is swapped between them with an atomic exchange. The audio thread takes a new patch
+    at the start of a callback, all of it at once, with no lock and no waiting on either side.
+ 
+ 26. The mixed buses go through a master delay and reverb before they are written to the
+    device. The delay has a line per channel with damped feedback, and the reverb is a feedback
+    delay network of eight lines mixed by a Hadamard matrix. All lines are power of two rings
+    allocated in init_data and indexed with a mask. --delay and --reverb set them up, F12 steps
+    through off, delay, reverb and both, and the callback keeps rendering until the tail is over.
+ 
+ 27. The device is opened first and the engine takes the sample rate and channel count it
+    has, so SDL does not put a resampler of its own in between. Everything that depends on
+    the rate (envelope rates, pitch table, smoothing, filter and effects) is worked out from
+    it when init_data makes the engine, after the device is open. --rate asks for a rate,
+    headless renders use it as is. Mono devices get both sides mixed, devices with more
+    channels get the buses on the first two.
+ 
+ 28. Audio can be rendered ahead of the device on a thread of its own. With --delivery thread a
+    render thread fills a lock free ring of blocks, and the callback only copies the oldest one
+    out. With --delivery queue there is no callback at all and the thread hands its blocks to
+    SDL_QueueAudio. --lookahead sets how many blocks are kept ready, each one adds a buffer of
+    latency but lets a block that takes longer than a buffer pass without a dropout.
+    The device starts once that many are ready, and blocks it found missing later are shown
+    as underruns with the other stats.
+ 
+ 29. Notes can play a multi-sample instrument instead of the oscillator. --sampler reads a list
+    of zones, each a root note, a note range and a wav file. Files up to 16MB are mapped into
+    memory. Of larger ones only the attack is read into the arena, and the rest is streamed
+    from disk by a prefetch thread into a ring per voice, which keeps each ring filled ahead of
+    where the voice plays. A note on posts the thread a request, so neither side waits on the
+    other, and a voice whose data is late plays silence for the chunk and counts a stream miss.
+ 
+ 30. Startup only makes the tables the first notes need. A waveform gets its mip levels the
+    first time it is picked, with F1-F5 or by a patch, on the main thread before the audio
+    thread is told about it. Built levels are written to a cache file per waveform and table
+    length, and later runs map that file instead of building them again, so instances started
+    at the same time share the pages. --cache names the directory, or turns it off.
+ 
+ 31. Everything a render changes lives in a struct engine: the voices, buses, effects, event
+    queues and stream rings, with 16 parts holding what used to be the one patch. MIDI channel
+    n plays part n, the keyboard plays part 1, a score line can name its part in a fourth column
+    and --patch 2:file loads a patch for part 2. The parts share the voice pool, so a part that
+    plays many notes gets many voices, and each voice renders with the patch of its part.
+    engine_create takes the rate, chunk size and voice count in a struct engine_settings, and
+    engine_render renders a block of float stereo, which the device gets converted or upmixed.
+    The tables, samples and kernels an engine reads are shared and never written after
+    init_data, and each engine has its own stream files and prefetch thread, so several engines
+    render on threads of their own. The benchmark renders a second one next to its first.
+ 
+ 32. The engine is a library of its own. synth_engine.c holds everything that renders, and
+    synth_engine.h declares what a program uses of it. This file is the program around it: the
+    window, keys, MIDI, device, render thread, stats and headless renders. init_engine_data sets
+    up what all engines share, with room in the arena for what the program allocates itself.
+    CMakeLists.txt builds it as the synth_engine library, which this sample and the benchmark
+    link, so the benchmark times the same code the program plays.
+ 
  dialect: C89
- dependencies: SDL2
+ dependencies: SDL2 (and CoreMIDI or ALSA with SYNTH_MIDI)
  created by Harry Lundstrom on 2/11/16.
  these samples will be updated continuously, check the repo for latest versions.
- Uncomment the main function of one of the synth_samples_sdl2 files to run.
+ Define SYNTH_SAMPLE as the number of the sample to run, sample 1 runs when it is not defined.
+ This sample is built together with synth_engine.c.
+ CMakeLists.txt builds every sample as a program of its own, see the README.
  
 */
 
-#include <stdio.h>
-#include <stdbool.h>
-#include <stdlib.h>
-#include <limits.h>
-#include <math.h>
-#include <SDL2/SDL.h>
+#include "synth_engine.h"
+
+/* MIDI input needs CoreMIDI on macOS or ALSA on Linux, so it is only built with SYNTH_MIDI defined */
+#if defined(SYNTH_MIDI)
+#if defined(__APPLE__)
+#define SYNTH_MIDI_COREMIDI
+#include <CoreMIDI/CoreMIDI.h>
+#elif defined(__linux__)
+#define SYNTH_MIDI_ALSA
+#include <poll.h>
+#include <alsa/asoundlib.h>
+#endif
+#endif
 
 /* general */
 static int quit = 0;
-static int debuglog = 0;
-static int alloc_count = 0;
 
 /* SDL */
 
 /* must be a power of two, decrease to allow for a lower latency, increase to reduce risk of underrun */
 static Uint16 buffer_size = 4096;
+#define LATENCY_NORMAL 0 /* use buffer_size as it is */
+#define LATENCY_LOW 1 /* try the sizes in low_latency_buffer_sizes */
+static int latency_mode = LATENCY_NORMAL;
+static Uint16 low_latency_buffer_sizes[3] = {64, 128, 256};
+static int chunk_frames = DEFAULT_CHUNK_FRAMES; /* set to fit the device buffer in setup_sdl_audio, engines take it when they are made */
+static int control_frames = DEFAULT_CHUNK_FRAMES; /* largest chunk, and control step, set with --control */
 static SDL_AudioDeviceID audio_device;
 static SDL_AudioSpec audio_spec;
 static SDL_Event event;
+#define UI_WAIT_MILLISECONDS 1000 /* longest time the main loop sleeps without input */
 static SDL_Window *window = NULL;
 static SDL_Renderer *renderer = NULL;
-static SDL_GLContext context;
-static int sample_rate = 44100;
-static int table_length = 1024;
-static int key_pressed = 0;
-static int last_note = 0;
-
-/* voice */
-static const double pi = 3.14159265358979323846;
-static const double chromatic_ratio = 1.059463094359295264562;
-static double phase_double = 0;
-static int phase_int = 0;
-static int16_t *sine_wave_table;
-static int note = -1; /* integer representing halfnotes */
+static int redraw = true; /* set when the window has to be drawn again */
+static int sample_rate = 44100; /* replaced by the rate the device has in setup_sdl_audio, engines take it when they are made */
+static int requested_rate = 0; /* --rate, 0 takes what the device has */
+
 static int octave = 2;
-static int max_note = 131;
-static int min_note = 12;
 
 /* functions */
-static void run(void);
-static void *alloc_memory(size_t size, char *name); /* malloc wrapper */
-static void *free_memory(void *ptr); /* malloc wrapper */
-static void build_sine_table(int16_t *data, int wave_length);
-static double get_pitch(double note);
-static void write_samples(int16_t *s_byteStream, long begin, long end, long length);
+static void run(int argc, char *argv[]);
+static int parse_arguments(int argc, char *argv[]);
+static SDL_AudioDeviceID open_audio_device(SDL_AudioSpec *want);
+static void set_chunk_size(int frames);
+static void audio_callback(void *unused, Uint8 *byte_stream, int byte_stream_length);
+static void render_audio(Uint8 *byte_stream, int byte_stream_length);
+static void fill_audio_buffer(Uint8 *byte_stream, int byte_stream_length);
 static void cleanup_data(void);
 static void setup_sdl(void);
 static int setup_sdl_audio(void);
 static void check_sdl_events(SDL_Event event);
 static void destroy_sdl(void);
 static void init_data(void);
-static void t_log(char *message);
 static void handle_key_up(SDL_Keysym* keysym);
 static void handle_key_down(SDL_Keysym* keysym);
 static int get_deltatime(void);
@@ -111,45 +284,199 @@ static void main_loop(void);
 static void handle_note_keys(SDL_Keysym* keysym);
 static void print_note(int note);
 
+/* fixed point oscillator */
+static int oscillator_mode = OSCILLATOR_LINEAR;
+
+/* mix bus and output conversion */
+static float *device_scratch; /* a buffer of what engine_render wrote, for devices that are not float stereo */
+static Sint16 *device_samples; /* and converted to 16 bit, for devices with other than two channels */
+static void write_device_frames(float *in, Uint8 *byte_stream, int offset, int frames, int float_output);
+
+/* master effects */
+#define DELAY_KEY_MIX 0.3 /* send levels when F12 turns the effects on */
+#define REVERB_KEY_MIX 0.25
+static int effects_steps = 0; /* main thread copy, bit 0 delay and bit 1 reverb */
+static const char *effects_names[4] = {"off", "delay", "reverb", "delay and reverb"};
+
+/* headless rendering */
+struct score_event {
+    double time; /* seconds from start */
+    int type; /* EVENT_NOTE_ON, EVENT_NOTE_OFF or EVENT_PARAMETER for pitch bend */
+    double value; /* note, or pitch bend in cents */
+    int part; /* 0 to MAX_PARTS - 1 */
+};
+static int run_headless(void);
+static struct score_event *load_score(const char *path, int *length);
+static void send_score_event(struct engine *engine, const struct score_event *score_event);
+static void write_wav_header(FILE *file, long data_bytes);
+static void write_wav_samples(FILE *file, const Uint8 *buffer, int samples);
+static void write_le16(FILE *file, Uint16 value);
+static void write_le32(FILE *file, Uint32 value);
+static const char *render_path = NULL;
+static const char *score_path = NULL;
+static int render_float = false;
+
+/* audio thread instrumentation */
+#define TIMING_BINS 1000 /* histogram of render times */
+#define TIMING_BIN_MICROSECONDS 10 /* the last bin also counts everything slower */
+struct audio_stats {
+    int callbacks;
+    int overruns; /* callbacks that took longer than the buffer lasts */
+    int underruns; /* device buffers the render thread had nothing ready for */
+    int stream_misses; /* chunks a sampler voice played without its streamed data */
+    double min_us;
+    double avg_us;
+    double p99_us;
+    double max_us;
+    double dsp_load; /* render time in percent of real time */
+};
+static void record_callback_time(Uint64 start, int frames);
+static void take_audio_stats(struct audio_stats *stats);
+static void show_audio_stats(void);
+static SDL_atomic_t timing_bins[TIMING_BINS];
+static SDL_atomic_t timing_overruns;
+static SDL_atomic_t timing_underruns;
+static SDL_atomic_t timing_total_us; /* render time since last taken */
+static SDL_atomic_t timing_total_frames; /* frames rendered since last taken */
+static SDL_atomic_t timing_min_us;
+static SDL_atomic_t timing_max_us;
+static Uint32 stats_shown_ticks = 0;
+
+/* voice pool */
+static int pan_steps = 0; /* main thread copy of note_pan in steps of 0.25 */
+static int voice_count = DEFAULT_VOICES; /* set with --voices, how many of the MAX_VOICES are played */
+
+/* filter */
+static int filter_cutoff_steps = 0; /* main thread copy of filter_cutoff, half octaves from the default */
+static int filter_resonance_steps = 2; /* main thread copy of filter_resonance in steps of 0.1 */
+
+/* modulation */
+#define VIBRATO_CENTS 15.0 /* depth of route 0 when F10 turns it on */
+static int vibrato_on = false; /* main thread copy of the amount of route 0 */
+
+/* render thread */
+#define DELIVERY_CALLBACK 0 /* render in the callback */
+#define DELIVERY_THREAD 1 /* render on a thread ahead of the callback */
+#define DELIVERY_QUEUE 2 /* render on a thread into SDL_QueueAudio */
+#define MAX_LOOKAHEAD_BLOCKS 16
+#define RENDER_PRIME_MILLISECONDS 1000 /* longest wait for the first blocks before the device starts */
+static void start_render_thread(void);
+static void stop_render_thread(void);
+static int render_thread_main(void *data);
+static void read_render_ring(Uint8 *byte_stream, int byte_stream_length);
+static int delivery_mode = DELIVERY_CALLBACK;
+static int lookahead_blocks = 2; /* blocks rendered ahead of the device */
+static SDL_Thread *render_thread = NULL;
+static SDL_sem *render_wake = NULL; /* posted when the callback has taken a block */
+static SDL_sem *render_primed = NULL; /* posted once the first lookahead_blocks are rendered */
+static SDL_atomic_t render_quit;
+static Uint8 *render_ring = NULL; /* render_ring_slots blocks, one slot is kept empty to tell full from empty */
+static int render_ring_slots = 0;
+static int render_block_bytes = 0;
+static SDL_atomic_t render_read_index; /* written by the callback */
+static SDL_atomic_t render_write_index; /* written by the render thread */
+static int render_read_offset = 0; /* bytes of the oldest block the callback has taken */
+
+/* midi input */
+#define MIDI_BEND_RANGE 200 /* cents at full pitch bend */
+#define MIDI_KEY(channel, note) (-1 - ((channel) * 128 + (note))) /* negative, so never an SDL keycode */
+static int start_midi_input(struct engine *engine);
+static void stop_midi_input(void);
+static int midi_enabled = false; /* set with --midi */
+static const char *midi_source = NULL; /* ALSA sequencer port to connect, like 20:0 */
+#if defined(SYNTH_MIDI_COREMIDI) || defined(SYNTH_MIDI_ALSA)
+static void send_midi_note_event(struct engine *engine, int type, int channel, int note, int velocity, Uint64 timestamp);
+static void send_midi_bend_event(struct engine *engine, int channel, int value, Uint64 timestamp);
+#endif
+#if defined(SYNTH_MIDI_COREMIDI)
+struct midi_parser {
+    int status; /* running status, 0 when data bytes are ignored */
+    Uint8 data[2];
+    int count;
+};
+static void midi_read_proc(const MIDIPacketList *list, void *read_data, void *source_data);
+static void read_midi_bytes(struct engine *engine, struct midi_parser *parser, const Uint8 *bytes, int length, Uint64 timestamp);
+static MIDIClientRef midi_client = 0;
+static MIDIPortRef midi_port = 0;
+static struct midi_parser midi_parser;
+#endif
+#if defined(SYNTH_MIDI_ALSA)
+static int midi_thread_main(void *data);
+static snd_seq_t *midi_seq = NULL;
+static SDL_Thread *midi_thread = NULL;
+static SDL_atomic_t midi_quit;
+#endif
+
 /* amplitude envelope */
-static double update_envelope(void);
-static double get_envelope_amp_by_node(int base_node, double cursor);
-static double envelope_cursor = 0;
-static double envelope_speed_scale = 1; /* set envelope speed 1-8 */
-static double envelope_data[4] = {1.0, 0.5, 0.5, 0.0}; /* ADSR amp range 0.0-1.0 */
-static double envelope_increment_base = 0; /* this will be set in init_data based on current samplingrate */
+static int envelope_speed = 1; /* main thread copy of envelope_speed_scale */
 
-/* amplitude smoothing */
-static double current_amp = 0;
-static double target_amp = 0;
-static double smoothing_amp_speed = 0.01;
-static double smoothing_enabled = true;
+/* patches */
+static void load_patch_file(struct engine *engine);
+static const char *patch_paths[MAX_PARTS]; /* --patch for each part, NULL keeps default_patch */
 
-static Sint32 last_key = 0;
+/* engine */
+static void get_engine_settings(struct engine_settings *settings);
+static struct engine *main_engine = NULL; /* the engine the device, keys, MIDI and headless renders play */
 
-/*
+#if defined(SYNTH_SAMPLE) && SYNTH_SAMPLE == 3
 int main(int argc, char* argv[]) {
     
-    run();
+    run(argc, argv);
     return 0;
 }
-*/
+#endif
 
-static void run(void) {
+static void run(int argc, char *argv[]) {
     
-    init_data();
-    t_log("init data successful.");
+    if(parse_arguments(argc, argv) != 0) {
+        return;
+    }
+    
+    if(render_path != NULL) {
+        delivery_mode = DELIVERY_CALLBACK; /* headless calls audio_callback itself */
+        stream_wait = true; /* and renders faster than the prefetch thread reads */
+        
+        /* headless has no device, so the device spec is filled in by hand before init_data makes the engine */
+        SDL_zero(audio_spec);
+        audio_spec.freq = sample_rate;
+        audio_spec.format = render_float ? AUDIO_F32SYS : AUDIO_S16SYS;
+        audio_spec.channels = 2;
+        audio_spec.samples = buffer_size;
+        set_chunk_size(buffer_size);
+        init_data();
+        load_patch_file(main_engine);
+        run_headless();
+        cleanup_data();
+        return;
+    }
     
     setup_sdl();
     t_log("setup SDL successful.");
     
+    /* the device is opened paused, so that init_data can work out everything for its rate and buffer size */
     setup_sdl_audio();
     t_log("setup SDL audio successful.");
     
+    init_data();
+    t_log("init data successful.");
+    
+    /* the audio thread takes the patches at its first callback */
+    load_patch_file(main_engine);
+    if(delivery_mode != DELIVERY_CALLBACK && audio_device != 0) {
+        start_render_thread();
+    }
+    SDL_PauseAudioDevice(audio_device, 0); /* unpause audio */
+    
+    if(midi_enabled && start_midi_input(main_engine) == 0) {
+        t_log("setup MIDI input successful.");
+    }
+    
     while (!quit) {
         main_loop();
     }
     
+    stop_midi_input();
+    stop_render_thread();
     cleanup_data();
     t_log("cleanup data successful.");
     
@@ -163,163 +490,1086 @@ static void run(void) {
     t_log("SDL quit successful.");
 }
 
-static void *alloc_memory(size_t size, char *name) {
- 
-    void *ptr = NULL;
-    ptr = malloc(size);
-    if(ptr == NULL) {
-        if(debuglog) {
-            printf("alloc_memory error: malloc with size %zu returned NULL.\n name:%s", size, name);
+static int parse_arguments(int argc, char *argv[]) {
+    
+    /*
+        --latency low|normal   low tries buffers of 64, 128 and 256 frames
+        --buffer <frames>      ask for a specific buffer size
+        --render <file.wav>    render the score to a wav file instead of playing
+        --score <file>         score to render, see load_score
+        --float                render 32 bit float instead of 16 bit
+        --wave <file>          user waveform, one sample per line
+        --oscillator <mode>    truncate, linear or cubic interpolation
+        --table <length>       table length, a power of two from 64 to 4096
+        --threads <count>      render threads, 0 for one per core
+        --voices <count>       voices all parts share, 1-256
+        --rate <hz>            ask the device for a sample rate, or render at it with --render
+        --delivery <mode>      callback renders in the callback, thread or queue on a render thread
+        --lookahead <blocks>   buffers the render thread keeps ready, 1-16
+        --midi [port]          play from MIDI input, optionally connect an ALSA port like 20:0
+        --filter on|off        the voice filter, on by default
+        --mod <route>          add a modulation route source:destination:amount, like lfo2:cutoff:1
+                               sources lfo1, lfo2, envelope, velocity, destinations pitch, amp, cutoff
+        --lfo <setting>        set an LFO number:rate:shape, like 1:6:triangle
+        --control <frames>     largest chunk and control step, 8-64 frames
+        --patch [part:]<file>  load a patch for part 1-16 (MIDI channel), 1 by default, see load_patch,
+                               F11 loads them again
+        --delay <setting>      stereo delay left:right:feedback:mix, like 0.375:0.5:0.35:0.3
+        --reverb <setting>     reverb seconds:damping:mix, like 2:0.4:0.25
+        --sampler <file>       play notes from a multi-sample instrument, see read_instrument
+        --cache <dir>|off      where built wave tables are kept, the SDL pref path by default
+        --debug                print debug log
+    */
+    
+    int i;
+    for(i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "--latency") == 0 && i + 1 < argc) {
+            i++;
+            if(strcmp(argv[i], "low") == 0) {
+                latency_mode = LATENCY_LOW;
+            } else if(strcmp(argv[i], "normal") == 0) {
+                latency_mode = LATENCY_NORMAL;
+            } else {
+                printf("unknown latency mode:%s, use low or normal\n", argv[i]);
+                return 1;
+            }
+        } else if(strcmp(argv[i], "--buffer") == 0 && i + 1 < argc) {
+            int frames = atoi(argv[++i]);
+            if(frames < 16 || frames > 32768) {
+                printf("buffer size must be 16-32768 frames\n");
+                return 1;
+            }
+            buffer_size = (Uint16)frames;
+            latency_mode = LATENCY_NORMAL;
+        } else if(strcmp(argv[i], "--render") == 0 && i + 1 < argc) {
+            render_path = argv[++i];
+        } else if(strcmp(argv[i], "--score") == 0 && i + 1 < argc) {
+            score_path = argv[++i];
+        } else if(strcmp(argv[i], "--wave") == 0 && i + 1 < argc) {
+            user_wave_path = argv[++i];
+        } else if(strcmp(argv[i], "--oscillator") == 0 && i + 1 < argc) {
+            i++;
+            if(strcmp(argv[i], "truncate") == 0) {
+                oscillator_mode = OSCILLATOR_TRUNCATE;
+            } else if(strcmp(argv[i], "linear") == 0) {
+                oscillator_mode = OSCILLATOR_LINEAR;
+            } else if(strcmp(argv[i], "cubic") == 0) {
+                oscillator_mode = OSCILLATOR_CUBIC;
+            } else {
+                printf("unknown oscillator mode:%s, use truncate, linear or cubic\n", argv[i]);
+                return 1;
+            }
+        } else if(strcmp(argv[i], "--table") == 0 && i + 1 < argc) {
+            int length = atoi(argv[++i]);
+            if(length < 64 || length > 4096 || (length & (length - 1)) != 0) {
+                printf("table length must be a power of two from 64 to 4096\n");
+                return 1;
+            }
+            table_length = length;
+        } else if(strcmp(argv[i], "--rate") == 0 && i + 1 < argc) {
+            requested_rate = atoi(argv[++i]);
+            if(requested_rate < 8000 || requested_rate > 192000) {
+                printf("sample rate must be 8000-192000 Hz\n");
+                return 1;
+            }
+            sample_rate = requested_rate;
+        } else if(strcmp(argv[i], "--delivery") == 0 && i + 1 < argc) {
+            i++;
+            if(strcmp(argv[i], "callback") == 0) {
+                delivery_mode = DELIVERY_CALLBACK;
+            } else if(strcmp(argv[i], "thread") == 0) {
+                delivery_mode = DELIVERY_THREAD;
+            } else if(strcmp(argv[i], "queue") == 0) {
+                delivery_mode = DELIVERY_QUEUE;
+            } else {
+                printf("unknown delivery mode:%s, use callback, thread or queue\n", argv[i]);
+                return 1;
+            }
+        } else if(strcmp(argv[i], "--lookahead") == 0 && i + 1 < argc) {
+            lookahead_blocks = atoi(argv[++i]);
+            if(lookahead_blocks < 1 || lookahead_blocks > MAX_LOOKAHEAD_BLOCKS) {
+                printf("lookahead must be 1-%d blocks\n", MAX_LOOKAHEAD_BLOCKS);
+                return 1;
+            }
+        } else if(strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            int threads = atoi(argv[++i]);
+            if(threads < 0 || threads > MAX_WORKERS) {
+                printf("threads must be 0-%d\n", MAX_WORKERS);
+                return 1;
+            }
+            pool_threads = get_pool_threads(threads);
+        } else if(strcmp(argv[i], "--voices") == 0 && i + 1 < argc) {
+            voice_count = atoi(argv[++i]);
+            if(voice_count < 1 || voice_count > MAX_VOICES) {
+                printf("voices must be 1-%d\n", MAX_VOICES);
+                return 1;
+            }
+        } else if(strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            i++;
+            if(strcmp(argv[i], "on") == 0) {
+                filter_enabled = true;
+            } else if(strcmp(argv[i], "off") == 0) {
+                filter_enabled = false;
+            } else {
+                printf("unknown filter setting:%s, use on or off\n", argv[i]);
+                return 1;
+            }
+        } else if(strcmp(argv[i], "--mod") == 0 && i + 1 < argc) {
+            if(parse_mod_route(argv[++i], default_patch.mod_routes, &default_patch.mod_route_count) != 0) {
+                printf("bad modulation route:%s, use source:destination:amount, at most %d routes\n", argv[i], MAX_MOD_ROUTES - 1);
+                return 1;
+            }
+        } else if(strcmp(argv[i], "--lfo") == 0 && i + 1 < argc) {
+            if(parse_lfo(argv[++i], default_patch.lfos) != 0) {
+                printf("bad lfo setting:%s, use number:rate:shape\n", argv[i]);
+                return 1;
+            }
+        } else if(strcmp(argv[i], "--control") == 0 && i + 1 < argc) {
+            control_frames = atoi(argv[++i]);
+            if(control_frames < 8 || control_frames > MAX_CHUNK_FRAMES) {
+                printf("control step must be 8-%d frames\n", MAX_CHUNK_FRAMES);
+                return 1;
+            }
+        } else if((strcmp(argv[i], "--delay") == 0 || strcmp(argv[i], "--reverb") == 0) && i + 1 < argc) {
+            int delay = strcmp(argv[i], "--delay") == 0;
+            if(parse_effect(argv[++i], delay, &default_patch) != 0) {
+                printf("bad %s setting:%s\n", delay ? "delay" : "reverb", argv[i]);
+                return 1;
+            }
+            effects_steps = (default_patch.delay_mix > 0 ? 1 : 0) | (default_patch.reverb_mix > 0 ? 2 : 0);
+        } else if(strcmp(argv[i], "--patch") == 0 && i + 1 < argc) {
+            const char *path = argv[++i];
+            int part = 0;
+            if(path[0] >= '0' && path[0] <= '9' && strchr(path, ':') != NULL) {
+                part = atoi(path) - 1;
+                path = strchr(path, ':') + 1;
+            }
+            if(part < 0 || part >= MAX_PARTS) {
+                printf("bad patch part:%s, use 1-%d\n", argv[i], MAX_PARTS);
+                return 1;
+            }
+            patch_paths[part] = path;
+        } else if(strcmp(argv[i], "--sampler") == 0 && i + 1 < argc) {
+            sampler_path = argv[++i];
+        } else if(strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+            table_cache_option = argv[++i];
+        } else if(strcmp(argv[i], "--midi") == 0) {
+            midi_enabled = true;
+            if(i + 1 < argc && argv[i + 1][0] != '-') {
+                midi_source = argv[++i];
+            }
+        } else if(strcmp(argv[i], "--float") == 0) {
+            render_float = true;
+        } else if(strcmp(argv[i], "--debug") == 0) {
+            debuglog = 1;
+        } else {
+            printf("usage: %s [--latency low|normal] [--buffer frames] [--render file.wav --score file [--float]] [--wave file] [--oscillator truncate|linear|cubic] [--table length] [--threads count] [--voices count] [--rate hz] [--delivery callback|thread|queue] [--lookahead blocks] [--midi [port]] [--filter on|off] [--mod route] [--lfo setting] [--control frames] [--patch [part:]file] [--delay setting] [--reverb setting] [--sampler file] [--cache dir|off] [--debug]\n", argv[0]);
+            return 1;
+        }
+    }
+    if(render_path != NULL && score_path == NULL) {
+        printf("--render needs a --score to render\n");
+        return 1;
+    }
+    return 0;
+}
+
+static void load_patch_file(struct engine *engine) {
+    
+    /*
+        Read the patch file of each part on the main thread, hand it to the thread that renders
+        engine and line up the key controls with the patch of the keyboard part.
+    */
+    
+    struct patch patch;
+    int i;
+    for(i = 0; i < MAX_PARTS; i++) {
+        if(patch_paths[i] == NULL) {
+            continue;
+        }
+        if(load_patch(patch_paths[i], &patch) != 0) {
+            printf("kept the current patch of part %d\n", i + 1);
+            continue;
+        }
+        prepare_waveform(patch.waveform);
+        publish_patch(&engine->parts[i], &patch);
+        printf("loaded patch %s for part %d\n", patch_paths[i], i + 1);
+        if(i != KEYBOARD_PART) {
+            continue;
+        }
+        envelope_speed = (int)patch.envelope_speed_scale;
+        pan_steps = (int)floor(patch.pan * 4 + 0.5);
+        filter_cutoff_steps = (int)floor(2 * log(patch.filter_cutoff / FILTER_DEFAULT_CUTOFF) / log(2.0) + 0.5);
+        filter_resonance_steps = (int)floor(patch.filter_resonance * 10 + 0.5);
+        vibrato_on = patch.mod_routes[0].amount != 0;
+        effects_steps = (patch.delay_mix > 0 ? 1 : 0) | (patch.reverb_mix > 0 ? 2 : 0);
+    }
+}
+
+static int run_headless(void) {
+    
+    /*
+        Render the score to a wav file without window or audio device. The same audio_callback
+        that SDL would call is called in a loop, one buffer at a time, and every buffer is written
+        to the file as soon as it is done. Score events are sent through the event queue before
+        the buffer they fall in, just like key presses.
+    */
+    
+    struct score_event *score = NULL;
+    int score_length = 0;
+    int next_event = 0;
+    int sample_size = render_float ? sizeof(float) : sizeof(Sint16);
+    int buffer_bytes = buffer_size * 2 * sample_size;
+    long frames_rendered = 0;
+    long data_bytes = 0;
+    double last_event_time = 0;
+    double seconds;
+    Uint64 start;
+    Uint8 *buffer;
+    FILE *file;
+    struct audio_stats stats;
+    
+    score = load_score(score_path, &score_length);
+    if(score == NULL) {
+        return 1;
+    }
+    if(score_length > 0) {
+        last_event_time = score[score_length-1].time;
+    }
+    
+    file = fopen(render_path, "wb");
+    if(file == NULL) {
+        printf("could not open %s for writing.\n", render_path);
+        free_memory(score);
+        return 1;
+    }
+    
+    buffer = alloc_memory(buffer_bytes, "render buffer");
+    if(buffer == NULL) {
+        printf("could not allocate a render buffer of %d bytes\n", buffer_bytes);
+        fclose(file);
+        free_memory(score);
+        return 1;
+    }
+    write_wav_header(file, 0);
+    
+    start = SDL_GetPerformanceCounter();
+    while(true) {
+        double buffer_end = (frames_rendered + buffer_size) / (double)sample_rate;
+        
+        /* send the events that start before the end of this buffer */
+        while(next_event < score_length && score[next_event].time < buffer_end) {
+            send_score_event(main_engine, &score[next_event]);
+            next_event++;
+        }
+        
+        /* stop when the score is done and every voice and effect has faded out, or 60 seconds after the last event */
+        if(next_event == score_length && frames_rendered > 0 && (!engine_sounding(main_engine) || buffer_end > last_event_time + 60)) {
+            break;
+        }
+        
+        audio_callback(NULL, buffer, buffer_bytes);
+        write_wav_samples(file, buffer, buffer_size * 2);
+        frames_rendered += buffer_size;
+        data_bytes += buffer_bytes;
+    }
+    seconds = (SDL_GetPerformanceCounter() - start) / performance_frequency;
+    
+    /* now that the length is known, go back and fill in the sizes in the header */
+    fseek(file, 0, SEEK_SET);
+    write_wav_header(file, data_bytes);
+    fclose(file);
+    
+    take_audio_stats(&stats);
+    printf("rendered %ld frames (%.2f s) to %s in %.3f s\n", frames_rendered, frames_rendered / (double)sample_rate, render_path, seconds);
+    if(seconds > 0) {
+        printf("%.0f frames per second, %.1fx realtime\n", frames_rendered / seconds, frames_rendered / (double)sample_rate / seconds);
+    }
+    printf("per buffer: min %.0fus avg %.0fus p99 %.0fus max %.0fus\n", stats.min_us, stats.avg_us, stats.p99_us, stats.max_us);
+    
+    free_memory(buffer);
+    free_memory(score);
+    return 0;
+}
+
+static struct score_event *load_score(const char *path, int *length) {
+    
+    /*
+        A score is a text file with one event per line, sorted by time:
+            <seconds> on <note>
+            <seconds> off <note>
+            <seconds> bend <cents>
+        followed by the part 1-16 the event is for, part 1 when it is left out.
+        Lines starting with # are ignored.
+    */
+    
+    struct score_event *score;
+    char line[256];
+    int count = 0;
+    int line_number = 0;
+    FILE *file = fopen(path, "r");
+    if(file == NULL) {
+        printf("could not open score %s\n", path);
+        return NULL;
+    }
+    
+    /* count the lines first so the score can be allocated once */
+    while(fgets(line, sizeof(line), file) != NULL) {
+        count++;
+    }
+    score = alloc_memory(sizeof(struct score_event) * (count + 1), "score");
+    if(score == NULL) {
+        printf("could not allocate %d score events\n", count + 1);
+        fclose(file);
+        return NULL;
+    }
+    rewind(file);
+    
+    count = 0;
+    while(fgets(line, sizeof(line), file) != NULL) {
+        char type[16];
+        double time;
+        double value;
+        int part = 1;
+        line_number++;
+        if(line[0] == '#' || sscanf(line, "%lf %15s %lf %d", &time, type, &value, &part) < 3) {
+            continue;
+        }
+        if(part < 1 || part > MAX_PARTS) {
+            printf("score line %d: part must be 1-%d\n", line_number, MAX_PARTS);
+            continue;
+        }
+        score[count].time = time;
+        score[count].value = value;
+        score[count].part = part - 1;
+        if(strcmp(type, "on") == 0) {
+            score[count].type = EVENT_NOTE_ON;
+        } else if(strcmp(type, "off") == 0) {
+            score[count].type = EVENT_NOTE_OFF;
+        } else if(strcmp(type, "bend") == 0) {
+            score[count].type = EVENT_PARAMETER;
+        } else {
+            printf("score line %d: unknown event %s\n", line_number, type);
+            continue;
+        }
+        if(count > 0 && time < score[count-1].time) {
+            printf("score line %d: events must be sorted by time\n", line_number);
+            fclose(file);
+            free_memory(score);
+            return NULL;
+        }
+        count++;
+    }
+    fclose(file);
+    *length = count;
+    return score;
+}
+
+static void send_score_event(struct engine *engine, const struct score_event *score_event) {
+    
+    /* the part and note are used as key so an off event finds the voice of its on event, the frame comes from the time */
+    
+    struct synth_event event;
+    int note = (int)score_event->value;
+    if(note > max_note) {
+        note = max_note;
+    }
+    if(note < min_note) {
+        note = min_note;
+    }
+    event.type = score_event->type;
+    event.timestamp = 0;
+    event.frame = (Uint64)(score_event->time * engine->sample_rate + 0.5); /* exactly where the score says */
+    event.part = score_event->part;
+    event.key = score_event->part * 128 + note;
+    event.note = note;
+    event.value = 1;
+    if(score_event->type == EVENT_PARAMETER) {
+        event.key = 0;
+        event.note = PARAMETER_PITCH_BEND;
+        event.value = score_event->value;
+    }
+    if(!push_event(&engine->input_queue, &event)) {
+        t_log("event queue full, score event dropped.");
+    }
+}
+
+static void write_wav_header(FILE *file, long data_bytes) {
+    
+    /* canonical 44 byte header, 16 bit PCM or 32 bit float stereo */
+    
+    int sample_size = render_float ? sizeof(float) : sizeof(Sint16);
+    fwrite("RIFF", 1, 4, file);
+    write_le32(file, (Uint32)(36 + data_bytes));
+    fwrite("WAVE", 1, 4, file);
+    fwrite("fmt ", 1, 4, file);
+    write_le32(file, 16);
+    write_le16(file, render_float ? 3 : 1); /* 3 is IEEE float, 1 is PCM */
+    write_le16(file, 2);
+    write_le32(file, sample_rate);
+    write_le32(file, sample_rate * 2 * sample_size);
+    write_le16(file, 2 * sample_size);
+    write_le16(file, 8 * sample_size);
+    fwrite("data", 1, 4, file);
+    write_le32(file, (Uint32)data_bytes);
+}
+
+static void write_wav_samples(FILE *file, const Uint8 *buffer, int samples) {
+    
+    /* wav files are little endian, the buffer is in native byte order */
+    
+#if SDL_BYTEORDER == SDL_LIL_ENDIAN
+    fwrite(buffer, render_float ? sizeof(float) : sizeof(Sint16), samples, file);
+#else
+    int i;
+    if(render_float) {
+        const Uint32 *data = (const Uint32*)buffer;
+        for(i = 0; i < samples; i++) {
+            write_le32(file, data[i]);
         }
     } else {
-        alloc_count++;
+        const Uint16 *data = (const Uint16*)buffer;
+        for(i = 0; i < samples; i++) {
+            write_le16(file, data[i]);
+        }
+    }
+#endif
+}
+
+static void write_le16(FILE *file, Uint16 value) {
+    
+    Uint8 bytes[2];
+    bytes[0] = (Uint8)(value & 0xff);
+    bytes[1] = (Uint8)(value >> 8);
+    fwrite(bytes, 1, 2, file);
+}
+
+static void write_le32(FILE *file, Uint32 value) {
+    
+    Uint8 bytes[4];
+    bytes[0] = (Uint8)(value & 0xff);
+    bytes[1] = (Uint8)((value >> 8) & 0xff);
+    bytes[2] = (Uint8)((value >> 16) & 0xff);
+    bytes[3] = (Uint8)(value >> 24);
+    fwrite(bytes, 1, 4, file);
+}
+
+static int start_midi_input(struct engine *engine) {
+    
+    /*
+        Open MIDI input. Messages are read on a thread of their own and pushed straight into
+        the midi_queue of engine with the time they arrived, so they never wait for the main loop.
+        Returns 0 on success, MIDI is optional so the synth keeps running without it.
+    */
+    
+#if defined(SYNTH_MIDI_COREMIDI)
+    ItemCount i;
+    OSStatus status = MIDIClientCreate(CFSTR("synth-samples-sdl2"), NULL, NULL, &midi_client);
+    if(status != noErr) {
+        printf("could not create MIDI client: %d\n", (int)status);
+        return 1;
+    }
+    /* the read proc is called on a high priority thread that CoreMIDI owns */
+    status = MIDIInputPortCreate(midi_client, CFSTR("input"), midi_read_proc, engine, &midi_port);
+    if(status != noErr) {
+        printf("could not create MIDI input port: %d\n", (int)status);
+        MIDIClientDispose(midi_client);
+        midi_client = 0;
+        return 1;
+    }
+    for(i = 0; i < MIDIGetNumberOfSources(); i++) {
+        MIDIPortConnectSource(midi_port, MIDIGetSource(i), NULL);
+    }
+    if(debuglog) { printf("MIDI input connected to %d sources.\n", (int)MIDIGetNumberOfSources()); }
+    return 0;
+#elif defined(SYNTH_MIDI_ALSA)
+    int port;
+    if(snd_seq_open(&midi_seq, "default", SND_SEQ_OPEN_INPUT, SND_SEQ_NONBLOCK) < 0) {
+        printf("could not open the ALSA sequencer.\n");
+        midi_seq = NULL;
+        return 1;
+    }
+    snd_seq_set_client_name(midi_seq, "synth-samples-sdl2");
+    port = snd_seq_create_simple_port(midi_seq, "input", SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE, SND_SEQ_PORT_TYPE_MIDI_GENERIC | SND_SEQ_PORT_TYPE_APPLICATION);
+    if(port < 0) {
+        printf("could not create ALSA sequencer port.\n");
+        stop_midi_input();
+        return 1;
+    }
+    if(midi_source != NULL) {
+        snd_seq_addr_t source;
+        if(snd_seq_parse_address(midi_seq, &source, midi_source) < 0 || snd_seq_connect_from(midi_seq, port, source.client, source.port) < 0) {
+            printf("could not connect MIDI source %s, connect it with aconnect instead.\n", midi_source);
+        }
+    }
+    SDL_AtomicSet(&midi_quit, 0);
+    midi_thread = SDL_CreateThread(midi_thread_main, "midi", engine);
+    if(midi_thread == NULL) {
+        printf("could not start MIDI thread: %s\n", SDL_GetError());
+        stop_midi_input();
+        return 1;
     }
-    return ptr;
+    if(debuglog) { printf("MIDI input on ALSA sequencer client %d port %d.\n", snd_seq_client_id(midi_seq), port); }
+    return 0;
+#else
+    (void)engine;
+    printf("built without MIDI input, define SYNTH_MIDI to enable it.\n");
+    return 1;
+#endif
+}
+
+static void stop_midi_input(void) {
+    
+#if defined(SYNTH_MIDI_COREMIDI)
+    if(midi_port != 0) {
+        MIDIPortDispose(midi_port);
+        midi_port = 0;
+    }
+    if(midi_client != 0) {
+        MIDIClientDispose(midi_client);
+        midi_client = 0;
+    }
+#elif defined(SYNTH_MIDI_ALSA)
+    if(midi_thread != NULL) {
+        SDL_AtomicSet(&midi_quit, 1);
+        SDL_WaitThread(midi_thread, NULL);
+        midi_thread = NULL;
+    }
+    if(midi_seq != NULL) {
+        snd_seq_close(midi_seq);
+        midi_seq = NULL;
+    }
+#endif
 }
 
-static void *free_memory(void *ptr) {
-   
-    if(ptr != NULL) {
-        free(ptr);
-        alloc_count--;
+#if defined(SYNTH_MIDI_COREMIDI) || defined(SYNTH_MIDI_ALSA)
+static void send_midi_note_event(struct engine *engine, int type, int channel, int note, int velocity, Uint64 timestamp) {
+    
+    /*
+        Called on the MIDI thread. MIDI note 69 is A 440, which is note 57 here. Each channel
+        plays its own part, and the channel is part of the key so that the same note on two
+        channels are two voices.
+    */
+    
+    struct synth_event event;
+    event.type = type;
+    event.timestamp = timestamp;
+    event.frame = EVENT_FRAME_FROM_TIMESTAMP;
+    event.part = channel;
+    event.key = MIDI_KEY(channel, note);
+    event.note = note - 12;
+    event.value = velocity / 127.0;
+    if(event.note > max_note) {
+        event.note = max_note;
+    }
+    if(event.note < min_note) {
+        event.note = min_note;
+    }
+    if(!push_event(&engine->midi_queue, &event)) {
+        t_log("midi queue full, note event dropped.");
     }
-    return NULL;
 }
 
-static void build_sine_table(int16_t *data, int wave_length) {
+static void send_midi_bend_event(struct engine *engine, int channel, int value, Uint64 timestamp) {
     
-    /* 
-        Build sine table to use as oscillator:
-        Generate a 16bit signed integer sinewave table with 1024 samples.
-        This table will be used to produce the notes.
-        Different notes will be created by stepping through
-        the table at different intervals (phase).
+    /* called on the MIDI thread, value is -8192 to 8191 with 0 in the center, it bends the part of the channel */
+    
+    struct synth_event event;
+    event.type = EVENT_PARAMETER;
+    event.timestamp = timestamp;
+    event.frame = EVENT_FRAME_FROM_TIMESTAMP;
+    event.part = channel;
+    event.key = 0;
+    event.note = PARAMETER_PITCH_BEND;
+    event.value = value * MIDI_BEND_RANGE / 8192.0;
+    if(!push_event(&engine->midi_queue, &event)) {
+        t_log("midi queue full, pitch bend dropped.");
+    }
+}
+#endif
+
+#if defined(SYNTH_MIDI_COREMIDI)
+static void midi_read_proc(const MIDIPacketList *list, void *read_data, void *source_data) {
+    
+    /*
+        Called by CoreMIDI on its own thread. On macOS SDL_GetPerformanceCounter is
+        mach_absolute_time, the clock of the packet timestamps, so the time the driver saw
+        the message can be used as it is.
+    */
+    
+    const MIDIPacket *packet = &list->packet[0];
+    Uint64 now = SDL_GetPerformanceCounter();
+    UInt32 i;
+    for(i = 0; i < list->numPackets; i++) {
+        read_midi_bytes(read_data, &midi_parser, packet->data, packet->length, packet->timeStamp != 0 ? packet->timeStamp : now);
+        packet = MIDIPacketNext(packet);
+    }
+}
+
+static void read_midi_bytes(struct engine *engine, struct midi_parser *parser, const Uint8 *bytes, int length, Uint64 timestamp) {
+    
+    /*
+        A small parser for a MIDI byte stream. It takes running status (a message without
+        status byte repeats the last status) and skips system messages, of which only
+        note on, note off and pitch bend are sent on.
     */
+    
     int i;
-    double phase_increment = (2.0f * pi) / (double)wave_length;
-    double current_phase = 0;
-    for(i = 0; i < wave_length; i++) {
-        int sample = (int)(sin(current_phase) * INT16_MAX);
-        data[i] = (int16_t)sample;
-        current_phase += phase_increment;
+    for(i = 0; i < length; i++) {
+        Uint8 byte = bytes[i];
+        if(byte >= 0xF8) {
+            /* realtime messages can be mixed into other messages and are ignored */
+            continue;
+        }
+        if(byte & 0x80) {
+            /* system common and sysex clear the running status */
+            parser->status = byte < 0xF0 ? byte : 0;
+            parser->count = 0;
+            continue;
+        }
+        if(parser->status == 0) {
+            continue;
+        }
+        parser->data[parser->count++] = byte;
+        if((parser->status & 0xF0) == 0xC0 || (parser->status & 0xF0) == 0xD0) {
+            /* program change and channel pressure have one data byte */
+            parser->count = 0;
+            continue;
+        }
+        if(parser->count < 2) {
+            continue;
+        }
+        parser->count = 0;
+        switch(parser->status & 0xF0) {
+            case 0x90:
+                send_midi_note_event(engine, parser->data[1] > 0 ? EVENT_NOTE_ON : EVENT_NOTE_OFF, parser->status & 0x0F, parser->data[0], parser->data[1], timestamp);
+                break;
+            case 0x80:
+                send_midi_note_event(engine, EVENT_NOTE_OFF, parser->status & 0x0F, parser->data[0], 0, timestamp);
+                break;
+            case 0xE0:
+                send_midi_bend_event(engine, parser->status & 0x0F, ((parser->data[1] << 7) | parser->data[0]) - 8192, timestamp);
+                break;
+        }
     }
 }
+#endif
 
-static double get_pitch(double note) {
+#if defined(SYNTH_MIDI_ALSA)
+static int midi_thread_main(void *data) {
     
     /*
-        Calculate pitch from note value.
-        offset note by 57 halfnotes to get correct pitch from the range we have chosen for the notes.
+        Waits for sequencer events and sends them on as soon as they arrive. poll wakes up
+        every 100 ms to see if it is time to quit, which costs nothing while notes come in.
     */
-    double p = pow(chromatic_ratio, note - 57);
-    p *= 440;
-    return p;
+    
+    struct engine *engine = data;
+    struct pollfd fds[8];
+    int fd_count;
+    SDL_SetThreadPriority(SDL_THREAD_PRIORITY_HIGH);
+    fd_count = snd_seq_poll_descriptors(midi_seq, fds, 8, POLLIN);
+    while(!SDL_AtomicGet(&midi_quit)) {
+        snd_seq_event_t *ev = NULL;
+        if(poll(fds, fd_count, 100) <= 0) {
+            continue;
+        }
+        while(snd_seq_event_input(midi_seq, &ev) >= 0 && ev != NULL) {
+            Uint64 now = SDL_GetPerformanceCounter();
+            switch(ev->type) {
+                case SND_SEQ_EVENT_NOTEON:
+                    send_midi_note_event(engine, ev->data.note.velocity > 0 ? EVENT_NOTE_ON : EVENT_NOTE_OFF, ev->data.note.channel, ev->data.note.note, ev->data.note.velocity, now);
+                    break;
+                case SND_SEQ_EVENT_NOTEOFF:
+                    send_midi_note_event(engine, EVENT_NOTE_OFF, ev->data.note.channel, ev->data.note.note, 0, now);
+                    break;
+                case SND_SEQ_EVENT_PITCHBEND:
+                    send_midi_bend_event(engine, ev->data.control.channel, ev->data.control.value, now);
+                    break;
+            }
+            ev = NULL;
+        }
+    }
+    return 0;
 }
+#endif
 
 static void audio_callback(void *unused, Uint8 *byte_stream, int byte_stream_length) {
 
     /*
         This function is called whenever the audio buffer needs to be filled to allow
         for a continuous stream of audio.
+        The time it takes to fill the buffer is recorded for the stats. With the render thread
+        the buffer is copied from what it has rendered ahead instead.
+    */
+    
+    if(delivery_mode == DELIVERY_THREAD) {
+        if(quit) {
+            memset(byte_stream, 0, byte_stream_length);
+            return;
+        }
+        read_render_ring(byte_stream, byte_stream_length);
+        return;
+    }
+    render_audio(byte_stream, byte_stream_length);
+}
+
+static void render_audio(Uint8 *byte_stream, int byte_stream_length) {
+    
+    /* render one buffer on the audio thread, or on the render thread, and time it */
+    
+    Uint64 start = SDL_GetPerformanceCounter();
+    int sample_size = (audio_spec.format == AUDIO_F32SYS) ? sizeof(float) : sizeof(Sint16);
+    audio_thread_id = SDL_ThreadID();
+    flush_denormals();
+    SDL_AtomicSet(&in_audio_callback, 1);
+    fill_audio_buffer(byte_stream, byte_stream_length);
+    SDL_AtomicSet(&in_audio_callback, 0);
+    record_callback_time(start, byte_stream_length / (sample_size * audio_spec.channels));
+}
+
+static void get_engine_settings(struct engine_settings *settings) {
+    
+    /* the settings for the device and the command line, the one main_engine is made with */
+    
+    settings->sample_rate = sample_rate;
+    settings->chunk_frames = chunk_frames;
+    settings->bus_frames = buffer_size;
+    settings->voice_count = voice_count;
+    settings->oscillator_mode = oscillator_mode;
+    settings->use_pool = (pool_threads > 1);
+}
+
+static void fill_audio_buffer(Uint8 *byte_stream, int byte_stream_length) {
+    
+    /*
         Write samples to byteStream according to byteStreamLength.
         The audio buffer is interleaved, meaning that both left and right channels exist in the same
-        buffer.
+        buffer. A float stereo device gets what engine_render writes, the other formats get it
+        rendered into device_scratch and converted or upmixed from there by write_device_frames.
     */
 
-    Sint16 *s_byte_stream;
+    int float_output = (audio_spec.format == AUDIO_F32SYS);
+    int channels = audio_spec.channels;
     int remain;
-    int chunk_size = 64;
-    int counter = 0;
-    int begin = 0;
-    int end = chunk_size;
-
-    /* zero the buffer */
-    memset(byte_stream, 0, byte_stream_length);
+    int offset = 0;
 
+    /* number of frames in the buffer */
+    if(float_output) {
+        remain = byte_stream_length / (sizeof(float) * channels);
+    } else {
+        remain = byte_stream_length / (sizeof(Sint16) * channels);
+    }
+    
     if(quit) {
+        memset(byte_stream, 0, byte_stream_length);
+        return;
+    }
+    if(float_output && channels == 2) {
+        engine_render(main_engine, (float*)byte_stream, remain);
         return;
     }
 
-    /* cast buffer as 16bit signed int */
-    s_byte_stream = (Sint16*)byte_stream;
-
-    /* buffer is interleaved, so get the length of 1 channel */
-    remain = byte_stream_length / 2;
-
-    /* split the rendering up in chunks to make it buffersize agnostic */
-    end = chunk_size;
-    while (counter < remain) {
-        if (counter > 0) {
-            begin += chunk_size;
-            end += chunk_size;
-            if (end >= remain) {
-                /* If stream length is not divisible by chunk length, write the remaining part here
-                 so we don't miss it */
-                end = remain;
-                chunk_size = (end-begin);
-                write_samples(s_byte_stream, begin, end, chunk_size);
-                break;
+    /* device_scratch holds a device buffer, so this is one pass unless the buffer is larger */
+    while(offset < remain) {
+        int frames = remain - offset;
+        int sample_size = float_output ? sizeof(float) : sizeof(Sint16);
+        if(frames > buffer_size) {
+            frames = buffer_size;
+        }
+        if(engine_render(main_engine, device_scratch, frames)) {
+            write_device_frames(device_scratch, byte_stream, offset, frames, float_output);
+        } else {
+            /* with nothing to play, silence is all there is to write */
+            memset(byte_stream + (size_t)offset * channels * sample_size, 0, (size_t)frames * channels * sample_size);
+        }
+        offset += frames;
+    }
+}
+
+static void start_render_thread(void) {
+    
+    /*
+        Set up the ring of blocks and start the render thread, then wait on render_primed until
+        it has rendered the lookahead, so the device is unpaused with the ring or the queue full.
+        A block is one device buffer in the device format. If the thread can't be started the
+        callback renders as usual.
+    */
+    
+    int sample_size = (audio_spec.format == AUDIO_F32SYS) ? sizeof(float) : sizeof(Sint16);
+    render_block_bytes = buffer_size * audio_spec.channels * sample_size;
+    render_ring_slots = lookahead_blocks + 1;
+    render_ring = alloc_memory((size_t)render_block_bytes * render_ring_slots, "render ring");
+    render_read_offset = 0;
+    SDL_AtomicSet(&render_read_index, 0);
+    SDL_AtomicSet(&render_write_index, 0);
+    SDL_AtomicSet(&render_quit, 0);
+    render_wake = SDL_CreateSemaphore(0);
+    render_primed = SDL_CreateSemaphore(0);
+    render_thread = (render_wake != NULL && render_primed != NULL) ? SDL_CreateThread(render_thread_main, "synth render", NULL) : NULL;
+    if(render_thread == NULL) {
+        printf("could not start the render thread: %s\n", SDL_GetError());
+        if(render_wake != NULL) {
+            SDL_DestroySemaphore(render_wake);
+            render_wake = NULL;
+        }
+        if(render_primed != NULL) {
+            SDL_DestroySemaphore(render_primed);
+            render_primed = NULL;
+        }
+        render_ring = free_memory(render_ring);
+        delivery_mode = DELIVERY_CALLBACK;
+        return;
+    }
+    if(SDL_SemWaitTimeout(render_primed, RENDER_PRIME_MILLISECONDS) != 0) {
+        printf("the render thread did not fill its lookahead in time\n");
+    }
+    if(debuglog) { printf("render thread with %d blocks of lookahead\n", lookahead_blocks); }
+}
+
+static void stop_render_thread(void) {
+    
+    if(render_thread == NULL) {
+        return;
+    }
+    SDL_AtomicSet(&render_quit, 1);
+    SDL_SemPost(render_wake);
+    SDL_WaitThread(render_thread, NULL);
+    render_thread = NULL;
+    SDL_DestroySemaphore(render_wake);
+    render_wake = NULL;
+    SDL_DestroySemaphore(render_primed);
+    render_primed = NULL;
+    render_ring = free_memory(render_ring);
+}
+
+static int render_thread_main(void *data) {
+    
+    /*
+        Render blocks ahead of the device. With DELIVERY_THREAD each block goes into the ring and
+        the thread sleeps on render_wake while the ring is full, the callback wakes it when it
+        has taken a block. With DELIVERY_QUEUE each block is queued with SDL_QueueAudio and the
+        thread sleeps while lookahead_blocks are still waiting in SDL's queue. render_primed is
+        posted when the first lookahead_blocks are in.
+    */
+    
+    Uint32 block_milliseconds = (Uint32)(buffer_size * 1000 / sample_rate);
+    int queued_any = false;
+    int rendered = 0;
+    (void)data;
+    SDL_SetThreadPriority(SDL_THREAD_PRIORITY_TIME_CRITICAL);
+    if(block_milliseconds < 1) {
+        block_milliseconds = 1;
+    }
+    while(!SDL_AtomicGet(&render_quit)) {
+        if(delivery_mode == DELIVERY_QUEUE) {
+            Uint32 queued = SDL_GetQueuedAudioSize(audio_device);
+            if(queued >= (Uint32)(render_block_bytes * lookahead_blocks)) {
+                SDL_Delay(block_milliseconds / 2 + 1);
+                continue;
+            }
+            if(queued == 0 && queued_any) {
+                SDL_AtomicAdd(&timing_underruns, 1);
             }
+            render_audio(render_ring, render_block_bytes);
+            SDL_QueueAudio(audio_device, render_ring, render_block_bytes);
+            queued_any = true;
+        } else {
+            int write_index = SDL_AtomicGet(&render_write_index);
+            int next_index = (write_index + 1) % render_ring_slots;
+            if(next_index == SDL_AtomicGet(&render_read_index)) {
+                SDL_SemWaitTimeout(render_wake, block_milliseconds);
+                continue;
+            }
+            render_audio(render_ring + (size_t)write_index * render_block_bytes, render_block_bytes);
+            SDL_MemoryBarrierRelease();
+            SDL_AtomicSet(&render_write_index, next_index);
+        }
+        if(rendered < lookahead_blocks && ++rendered == lookahead_blocks) {
+            SDL_SemPost(render_primed);
         }
-        write_samples(s_byte_stream, begin, end, chunk_size);
-        counter += chunk_size;
     }
+    return 0;
 }
 
-static void write_samples(int16_t *s_byteStream, long begin, long end, long length) {
-    int i;
+static void read_render_ring(Uint8 *byte_stream, int byte_stream_length) {
+    
+    /*
+        Copy rendered blocks into the device buffer, the callback side of the ring. A device
+        buffer of another size than a block is taken in parts, render_read_offset remembers how
+        far into the oldest block it got. If the ring runs dry the rest is silence and counted.
+    */
+    
+    while(byte_stream_length > 0) {
+        int read_index = SDL_AtomicGet(&render_read_index);
+        int bytes = render_block_bytes - render_read_offset;
+        if(read_index == SDL_AtomicGet(&render_write_index)) {
+            memset(byte_stream, 0, byte_stream_length);
+            SDL_AtomicAdd(&timing_underruns, 1);
+            return;
+        }
+        SDL_MemoryBarrierAcquire();
+        if(bytes > byte_stream_length) {
+            bytes = byte_stream_length;
+        }
+        memcpy(byte_stream, render_ring + (size_t)read_index * render_block_bytes + render_read_offset, bytes);
+        byte_stream += bytes;
+        byte_stream_length -= bytes;
+        render_read_offset += bytes;
+        if(render_read_offset == render_block_bytes) {
+            render_read_offset = 0;
+            SDL_AtomicSet(&render_read_index, (read_index + 1) % render_ring_slots);
+            SDL_SemPost(render_wake);
+        }
+    }
+}
 
-    if(note > 0) {
-        double d_sample_rate = sample_rate;
-        double d_table_length = table_length;
-        double d_note = note;
-        
-        /* get correct phase increment for note depending on sample rate and table length */
-        double phase_increment = (get_pitch(d_note) / d_sample_rate) * d_table_length;
-        
-        /* loop through the buffer and write samples */
-        for (i = 0; i < length; i+=2) {
-            phase_double += phase_increment;
-            phase_int = (int)phase_double;
-            if(phase_double >= table_length) {
-                double diff = phase_double - table_length;
-                phase_double = diff;
-                phase_int = (int)diff;
+static void write_device_frames(float *in, Uint8 *byte_stream, int offset, int frames, int float_output) {
+    
+    /*
+        Copy a pass that engine_render wrote to in into the device buffer, 16 bit devices get it
+        converted and dithered by the same kernels at any channel count. A mono device gets the
+        mix of both sides. With more channels the stereo goes to the first two, which are front
+        left and right in every SDL channel layout, and the rest are silent.
+    */
+    
+    int channels = audio_spec.channels;
+    int i;
+    int c;
+    if(channels == 1) {
+        for(i = 0; i < frames; i++) {
+            in[i * 2] = (in[i * 2] + in[i * 2 + 1]) * 0.5f;
+            in[i * 2 + 1] = in[i * 2];
+        }
+    }
+    if(float_output) {
+        float *out = (float*)byte_stream + offset * channels;
+        for(i = 0; i < frames; i++) {
+            out[i * channels] = in[i * 2];
+            for(c = 1; c < channels; c++) {
+                out[i * channels + c] = (c == 1) ? in[i * 2 + 1] : 0;
             }
-            
-            if(phase_int < table_length && phase_int > -1) {
-                if(s_byteStream != NULL) {
-                    int16_t sample = sine_wave_table[phase_int];
-                    target_amp = update_envelope();
-                    if(smoothing_enabled) {
-                        /* move current amp towards target amp for a smoother transition */
-                        if(current_amp < target_amp) {
-                            current_amp += smoothing_amp_speed;
-                            if(current_amp > target_amp) {
-                                current_amp = target_amp;
-                            }
-                        } else if(current_amp > target_amp) {
-                            current_amp -= smoothing_amp_speed;
-                            if(current_amp < target_amp) {
-                                current_amp = target_amp;
-                            }
-                        }
-                    } else {
-                        current_amp = target_amp;
-                    }
-                    sample *= current_amp; /* scale volume */
-                    s_byteStream[i+begin] = sample; /* left channel */
-                    s_byteStream[i+begin+1] = sample; /* right channel */
-                }
+        }
+    } else if(channels == 2) {
+        convert_mix_bus(in, (Sint16*)byte_stream + offset * 2, frames);
+    } else {
+        Sint16 *out = (Sint16*)byte_stream + offset * channels;
+        convert_mix_bus(in, device_samples, frames);
+        for(i = 0; i < frames; i++) {
+            out[i * channels] = device_samples[i * 2];
+            for(c = 1; c < channels; c++) {
+                out[i * channels + c] = (c == 1) ? device_samples[i * 2 + 1] : 0;
             }
         }
     }
 }
 
+static void record_callback_time(Uint64 start, int frames) {
+    
+    /*
+        Add one callback to the stats. Only the audio thread writes here and the main thread
+        takes the values with atomic exchanges, so nothing waits on anything.
+    */
+    
+    Uint64 elapsed = SDL_GetPerformanceCounter() - start;
+    int us = (int)(elapsed * 1000000.0 / performance_frequency);
+    int deadline_us = (int)(frames * 1000000.0 / sample_rate);
+    int bin = us / TIMING_BIN_MICROSECONDS;
+    int old;
+    if(bin >= TIMING_BINS) {
+        bin = TIMING_BINS - 1;
+    }
+    SDL_AtomicAdd(&timing_bins[bin], 1);
+    SDL_AtomicAdd(&timing_total_us, us);
+    SDL_AtomicAdd(&timing_total_frames, frames);
+    if(us > deadline_us) {
+        SDL_AtomicAdd(&timing_overruns, 1);
+    }
+    do {
+        old = SDL_AtomicGet(&timing_min_us);
+    } while(us < old && !SDL_AtomicCAS(&timing_min_us, old, us));
+    do {
+        old = SDL_AtomicGet(&timing_max_us);
+    } while(us > old && !SDL_AtomicCAS(&timing_max_us, old, us));
+}
+
+static void take_audio_stats(struct audio_stats *stats) {
+    
+    /* read and reset the counters, called from the main thread */
+    
+    int i;
+    int bins[TIMING_BINS];
+    int callbacks = 0;
+    int counted = 0;
+    int total_us;
+    int total_frames;
+    for(i = 0; i < TIMING_BINS; i++) {
+        bins[i] = SDL_AtomicSet(&timing_bins[i], 0);
+        callbacks += bins[i];
+    }
+    total_us = SDL_AtomicSet(&timing_total_us, 0);
+    total_frames = SDL_AtomicSet(&timing_total_frames, 0);
+    stats->callbacks = callbacks;
+    stats->overruns = SDL_AtomicSet(&timing_overruns, 0);
+    stats->underruns = SDL_AtomicSet(&timing_underruns, 0);
+    stats->stream_misses = SDL_AtomicSet(&stream_misses, 0);
+    stats->min_us = SDL_AtomicSet(&timing_min_us, INT_MAX);
+    stats->max_us = SDL_AtomicSet(&timing_max_us, 0);
+    stats->avg_us = 0;
+    stats->p99_us = 0;
+    stats->dsp_load = 0;
+    if(callbacks == 0) {
+        stats->min_us = 0;
+        return;
+    }
+    stats->avg_us = total_us / (double)callbacks;
+    if(total_frames > 0) {
+        stats->dsp_load = 100.0 * (total_us / 1000000.0) / (total_frames / (double)sample_rate);
+    }
+    /* upper edge of the bin where 99% of the callbacks have been counted */
+    for(i = 0; i < TIMING_BINS; i++) {
+        counted += bins[i];
+        if(counted * 100 >= callbacks * 99) {
+            stats->p99_us = (i + 1) * TIMING_BIN_MICROSECONDS;
+            break;
+        }
+    }
+    if(stats->p99_us > stats->max_us) {
+        stats->p99_us = stats->max_us;
+    }
+}
+
+static void show_audio_stats(void) {
+    
+    /* take the stats once a second and show them in the window title */
+    
+    struct audio_stats stats;
+    char title[256];
+    Uint32 ticks = SDL_GetTicks();
+    if(ticks - stats_shown_ticks < 1000) {
+        return;
+    }
+    stats_shown_ticks = ticks;
+    take_audio_stats(&stats);
+    sprintf(title, "SDL2 synth sample 3 - dsp %.1f%% min %.0fus avg %.0fus p99 %.0fus max %.0fus overruns %d underruns %d misses %d",
+            stats.dsp_load, stats.min_us, stats.avg_us, stats.p99_us, stats.max_us, stats.overruns, stats.underruns, stats.stream_misses);
+    if(window != NULL) {
+        SDL_SetWindowTitle(window, title);
+    }
+    if(debuglog) {
+        printf("%s (%d callbacks)\n", title, stats.callbacks);
+    }
+}
+
 static void cleanup_data(void) {
 
-    free_memory(sine_wave_table);
-    printf("alloc count:%d\n", alloc_count);
+    if(pool_threads > 1) {
+        stop_worker_pool();
+    }
+    engine_destroy(main_engine);
+    main_engine = NULL;
+    free_memory(device_samples);
+    free_memory(device_scratch);
+    cleanup_engine_data();
 }
 
 static void setup_sdl(void) {
@@ -340,17 +1590,12 @@ static void setup_sdl(void) {
         }
     }
 
-    window = SDL_CreateWindow("", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, 640, 480, SDL_WINDOW_OPENGL);
+    window = SDL_CreateWindow("", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, 640, 480, SDL_WINDOW_SHOWN);
 
     if(window != NULL) {
-        context = SDL_GL_CreateContext(window);
-        if(context == NULL) {
-            printf("\nFailed to create context: %s\n", SDL_GetError());
-        }
-
-        renderer = SDL_CreateRenderer(window, -1, 0);
+        /* the renderer makes its own context, vsync keeps a redraw from presenting faster than the display */
+        renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_PRESENTVSYNC);
         if (renderer != NULL) {
-            SDL_GL_SetSwapInterval(1);
             SDL_SetWindowTitle(window, "SDL2 synth sample 3");
         } else {
             if(debuglog) {
@@ -372,34 +1617,64 @@ static int setup_sdl_audio(void) {
     SDL_zero(want);
     SDL_zero(audio_spec);
     
+    /* ask for the rate and channels the default device has, so SDL has nothing to convert */
     want.freq = sample_rate;
-    /* request 16bit signed little-endian sample format */
-    want.format = AUDIO_S16LSB;
-    /* request 2 channels (stereo) */
     want.channels = 2;
+#if SDL_VERSION_ATLEAST(2, 24, 0)
+    {
+        SDL_AudioSpec device_spec;
+        if(SDL_GetDefaultAudioInfo(NULL, &device_spec, 0) == 0) {
+            if(device_spec.freq > 0) {
+                want.freq = device_spec.freq;
+            }
+            if(device_spec.channels > 0) {
+                want.channels = device_spec.channels;
+            }
+        }
+    }
+#endif
+    if(requested_rate > 0) {
+        want.freq = requested_rate;
+    }
+    /* request 32bit float samples in native byte order, the format the engine mixes in */
+    want.format = AUDIO_F32SYS;
     want.samples = buffer_size;
     
     /*
         Tell SDL to call this function (audio_callback) that we have defined whenever there is an audiobuffer ready to be filled.
+        In queue mode there is no callback, the render thread queues the audio.
     */
-    want.callback = audio_callback;
+    want.callback = (delivery_mode == DELIVERY_QUEUE) ? NULL : audio_callback;
     
-    if(debuglog) {
-        printf("\naudioSpec want\n");
-        printf("----------------\n");
-        printf("sample rate:%d\n", want.freq);
-        printf("channels:%d\n", want.channels);
-        printf("samples:%d\n", want.samples);
-        printf("----------------\n\n");
+    if(latency_mode == LATENCY_LOW) {
+        /*
+            Step through the small buffer sizes until the device gives us the size we asked for.
+            If none of them fit, keep the size the device picked for the last one.
+        */
+        int i;
+        int count = sizeof(low_latency_buffer_sizes) / sizeof(low_latency_buffer_sizes[0]);
+        for(i = 0; i < count; i++) {
+            want.samples = low_latency_buffer_sizes[i];
+            audio_device = open_audio_device(&want);
+            if(audio_device != 0 && audio_spec.samples == want.samples) {
+                break;
+            }
+            if(audio_device != 0 && i < count - 1) {
+                if(debuglog) { printf("asked for %d frames, got %d, trying a larger buffer.\n", want.samples, audio_spec.samples); }
+                SDL_CloseAudioDevice(audio_device);
+                audio_device = 0;
+            }
+        }
+    } else {
+        audio_device = open_audio_device(&want);
     }
     
-    audio_device = SDL_OpenAudioDevice(NULL, 0, &want, &audio_spec, 0);
-    
     if(debuglog) {
         printf("\naudioSpec get\n");
         printf("----------------\n");
         printf("sample rate:%d\n", audio_spec.freq);
         printf("channels:%d\n", audio_spec.channels);
+        printf("format:%s\n", audio_spec.format == AUDIO_F32SYS ? "float" : "16 bit");
         printf("samples:%d\n", audio_spec.samples);
         printf("size:%d\n", audio_spec.size);
         printf("----------------\n");
@@ -410,31 +1685,92 @@ static int setup_sdl_audio(void) {
         return 1;
     }
     
-    if (audio_spec.format != want.format) {
+    if (audio_spec.format != AUDIO_F32SYS && audio_spec.format != AUDIO_S16SYS) {
         if(debuglog) { printf("\nCouldn't get requested audio format.\n"); }
         return 2;
     }
     
+    /* everything in init_data is worked out for what the device has */
+    sample_rate = audio_spec.freq;
     buffer_size = audio_spec.samples;
-    SDL_PauseAudioDevice(audio_device, 0); /* unpause audio */
+    set_chunk_size(buffer_size);
     return 0;
 }
 
+static SDL_AudioDeviceID open_audio_device(SDL_AudioSpec *want) {
+    
+    /*
+        Open the default device. The device may change the rate and channel count, then SDL does
+        not resample or remix for it. In low latency mode the device may change the buffer size,
+        otherwise SDL would hide the real device buffer behind an extra buffer of its own.
+    */
+    
+    SDL_AudioDeviceID device;
+    int allowed_changes = SDL_AUDIO_ALLOW_FORMAT_CHANGE | SDL_AUDIO_ALLOW_FREQUENCY_CHANGE | SDL_AUDIO_ALLOW_CHANNELS_CHANGE;
+    if(latency_mode == LATENCY_LOW) {
+        allowed_changes |= SDL_AUDIO_ALLOW_SAMPLES_CHANGE;
+    }
+    
+    if(debuglog) {
+        printf("\naudioSpec want\n");
+        printf("----------------\n");
+        printf("sample rate:%d\n", want->freq);
+        printf("channels:%d\n", want->channels);
+        printf("samples:%d\n", want->samples);
+        printf("----------------\n\n");
+    }
+    
+    /* allow SDL to pick another format if the device does not take float, so it doesn't have to convert */
+    device = SDL_OpenAudioDevice(NULL, 0, want, &audio_spec, allowed_changes);
+    if (device != 0 && audio_spec.format != AUDIO_F32SYS && audio_spec.format != AUDIO_S16SYS) {
+        /* the engine only writes float or 16 bit, let SDL convert from 16 bit for anything else */
+        SDL_AudioSpec want_s16 = *want;
+        SDL_CloseAudioDevice(device);
+        want_s16.format = AUDIO_S16SYS;
+        device = SDL_OpenAudioDevice(NULL, 0, &want_s16, &audio_spec, allowed_changes & ~SDL_AUDIO_ALLOW_FORMAT_CHANGE);
+    }
+    return device;
+}
+
+static void set_chunk_size(int frames) {
+    
+    /* use the largest chunk up to control_frames that divides the buffer evenly, see get_chunk_frames */
+    
+    chunk_frames = get_chunk_frames(frames, control_frames);
+    if(debuglog) { printf("chunk size:%d frames\n", chunk_frames); }
+}
+
 static void check_sdl_events(SDL_Event event) {
     
-    while (SDL_PollEvent(&event)) {
+    /* sleep until the first event arrives or the stats are due, then take the rest that are waiting */
+    int timeout = UI_WAIT_MILLISECONDS - (int)(SDL_GetTicks() - stats_shown_ticks);
+    if(timeout < 0) {
+        timeout = 0;
+    }
+    if(!SDL_WaitEventTimeout(&event, timeout)) {
+        return;
+    }
+    do {
         switch(event.type) {
             case SDL_QUIT:
                 quit = true;
                 break;
+            case SDL_WINDOWEVENT:
+                if(event.window.event == SDL_WINDOWEVENT_EXPOSED || event.window.event == SDL_WINDOWEVENT_SIZE_CHANGED) {
+                    redraw = true;
+                }
+                break;
             case SDL_KEYDOWN:
-                handle_key_down(&event.key.keysym);
+                /* held keys repeat key down events, only the first one starts a note */
+                if(event.key.repeat == 0) {
+                    handle_key_down(&event.key.keysym);
+                }
                 break;
             case SDL_KEYUP:
                 handle_key_up(&event.key.keysym);
                 break;
         }
-    }
+    } while (SDL_PollEvent(&event));
 }
 
 static void destroy_sdl(void) {
@@ -445,18 +1781,29 @@ static void destroy_sdl(void) {
 
 static void init_data(void) {
     
-    /* allocate memory for sine table and build it */
-    sine_wave_table = alloc_memory(sizeof(int16_t)*table_length, "PCM table");
-    build_sine_table(sine_wave_table, table_length);
+    struct engine_settings settings;
+    size_t extra_size;
     
-    /* set envelope increment size based on samplerate */
-    envelope_increment_base = 1 / (double)(sample_rate/2);
-}
-
-static void t_log(char *message) {
+    /* the arena of the engine also holds the device buffers, the headless render buffer and the render ring */
+    extra_size = 2 * (size_t)buffer_size * (sizeof(float) + sizeof(Sint16)); /* device scratch and samples */
+    extra_size += 2 * (size_t)buffer_size * sizeof(float); /* headless render buffer */
+    if(delivery_mode != DELIVERY_CALLBACK) {
+        extra_size += (size_t)(lookahead_blocks + 1) * buffer_size * audio_spec.channels * sizeof(float); /* render ring */
+    }
+    get_engine_settings(&settings);
+    init_engine_data(&settings, 1, extra_size);
+    SDL_AtomicSet(&timing_min_us, INT_MAX);
     
-    if(debuglog) {
-        printf("log: %s \n", message);
+    /* one buffer of what the engine renders, for devices that are not float stereo */
+    device_scratch = alloc_memory(sizeof(float)*buffer_size*2, "device scratch");
+    device_samples = alloc_memory(sizeof(Sint16)*buffer_size*2, "device samples");
+    
+    /* the engine the device plays, everything it shares with other engines is set up above */
+    main_engine = engine_create(&settings);
+    
+    /* start the render threads, all of their memory is set up here */
+    if(pool_threads != 1) {
+        start_worker_pool();
     }
 }
 
@@ -467,12 +1814,19 @@ static void handle_key_up(SDL_Keysym* keysym) {
             break;
         case SDLK_MINUS:
             break;
+        case SDLK_UP:
+        case SDLK_DOWN:
+        case SDLK_LEFT:
+        case SDLK_RIGHT:
+        case SDLK_F1:
+        case SDLK_F2:
+        case SDLK_F3:
+        case SDLK_F4:
+        case SDLK_F5:
+            break;
         default:
-            /* if the last notekey pressed is released */
-            if(last_key == keysym->sym) {
-                key_pressed = false;
-                last_note = -1;
-            }
+            /* release the voices that were started by this key */
+            send_note_event(main_engine, EVENT_NOTE_OFF, keysym->sym, 0);
             break;
     }
 }
@@ -492,67 +1846,106 @@ static void handle_key_down(SDL_Keysym* keysym) {
                 printf("decreased octave to:%d\n", octave);
             }
             break;
+        case SDLK_F1:
+        case SDLK_F2:
+        case SDLK_F3:
+        case SDLK_F4:
+        case SDLK_F5:
+            prepare_waveform(keysym->sym - SDLK_F1);
+            send_parameter_event(main_engine, PARAMETER_WAVEFORM, keysym->sym - SDLK_F1);
+            printf("waveform:%s\n", wave_names[keysym->sym - SDLK_F1]);
+            break;
+        case SDLK_F6:
+        case SDLK_F7:
+            filter_cutoff_steps += (keysym->sym == SDLK_F7) ? 1 : -1;
+            if(filter_cutoff_steps < -8) {
+                filter_cutoff_steps = -8;
+            }
+            if(filter_cutoff_steps > 8) {
+                filter_cutoff_steps = 8;
+            }
+            send_parameter_event(main_engine, PARAMETER_FILTER_CUTOFF, FILTER_DEFAULT_CUTOFF * pow(2.0, filter_cutoff_steps * 0.5));
+            printf("filter cutoff:%.0fHz\n", FILTER_DEFAULT_CUTOFF * pow(2.0, filter_cutoff_steps * 0.5));
+            break;
+        case SDLK_F8:
+        case SDLK_F9:
+            filter_resonance_steps += (keysym->sym == SDLK_F9) ? 1 : -1;
+            if(filter_resonance_steps < 0) {
+                filter_resonance_steps = 0;
+            }
+            if(filter_resonance_steps > 10) {
+                filter_resonance_steps = 10;
+            }
+            send_parameter_event(main_engine, PARAMETER_FILTER_RESONANCE, filter_resonance_steps * 0.1);
+            printf("filter resonance:%.1f\n", filter_resonance_steps * 0.1);
+            break;
+        case SDLK_F10:
+            vibrato_on = !vibrato_on;
+            send_parameter_event(main_engine, PARAMETER_VIBRATO, vibrato_on ? VIBRATO_CENTS : 0);
+            printf("vibrato:%s\n", vibrato_on ? "on" : "off");
+            break;
+        case SDLK_F11:
+            load_patch_file(main_engine);
+            break;
+        case SDLK_F12:
+            effects_steps = (effects_steps + 1) % 4;
+            send_parameter_event(main_engine, PARAMETER_DELAY_MIX, (effects_steps & 1) ? DELAY_KEY_MIX : 0);
+            send_parameter_event(main_engine, PARAMETER_REVERB_MIX, (effects_steps & 2) ? REVERB_KEY_MIX : 0);
+            printf("effects:%s\n", effects_names[effects_steps]);
+            break;
+        case SDLK_LEFT:
+            if(pan_steps > -4) {
+                pan_steps--;
+                send_parameter_event(main_engine, PARAMETER_PAN, pan_steps * 0.25);
+                printf("pan:%.2f\n", pan_steps * 0.25);
+            }
+            break;
+        case SDLK_RIGHT:
+            if(pan_steps < 4) {
+                pan_steps++;
+                send_parameter_event(main_engine, PARAMETER_PAN, pan_steps * 0.25);
+                printf("pan:%.2f\n", pan_steps * 0.25);
+            }
+            break;
+        case SDLK_UP:
+            if(envelope_speed < 8) {
+                envelope_speed++;
+                send_parameter_event(main_engine, PARAMETER_ENVELOPE_SPEED, envelope_speed);
+                printf("increased envelope speed to:%d\n", envelope_speed);
+            }
+            break;
+        case SDLK_DOWN:
+            if(envelope_speed > 1) {
+                envelope_speed--;
+                send_parameter_event(main_engine, PARAMETER_ENVELOPE_SPEED, envelope_speed);
+                printf("decreased envelope speed to:%d\n", envelope_speed);
+            }
+            break;
         default:
-            last_key = keysym->sym;
             handle_note_keys(keysym);
-            key_pressed = true;
             break;
     }
 }
 
-static double get_envelope_amp_by_node(int base_node, double cursor) {
-    
-    /* interpolate amp value for the current cursor position */
-
-    double n1 = base_node;
-    double n2 = base_node + 1;
-    double relative_cursor_pos = (cursor - n1) / (n2 - n1);
-    double amp_diff = (envelope_data[base_node+1] - envelope_data[base_node]);
-    double amp = envelope_data[base_node]+(relative_cursor_pos*amp_diff);
-    return amp;
-}
-
-static double update_envelope(void) {
-    
-    /* advance envelope cursor and return the target amplitude value */
-
-    double amp = 0;
-    if(key_pressed && envelope_cursor < 3 && envelope_cursor > 2) {
-        /* if a note key is longpressed and cursor is in range, stay for sustain */
-        amp = get_envelope_amp_by_node(2, envelope_cursor);
-    } else {
-        double speed_multiplier = pow(2, envelope_speed_scale);
-        double cursor_inc = envelope_increment_base * speed_multiplier;
-        envelope_cursor += cursor_inc;
-        if(envelope_cursor < 1) {
-            amp = get_envelope_amp_by_node(0, envelope_cursor);
-        } else if(envelope_cursor < 2) {
-            amp = get_envelope_amp_by_node(1, envelope_cursor);
-        } else if(envelope_cursor < 3) {
-            amp = get_envelope_amp_by_node(2, envelope_cursor);
-        } else {
-            amp = envelope_data[3];
-        }
-    }
-    return amp;
-}
-
 static void main_loop(void) {
     
-    /* check for keyboard events etc */
+    /* wait for keyboard events etc */
     check_sdl_events(event);
+    show_audio_stats();
     
-    /* update screen */
-    SDL_RenderClear(renderer);
-    SDL_RenderPresent(renderer);
-    SDL_Delay(16);
+    /* update screen, only when something on it changed */
+    if(redraw) {
+        SDL_RenderClear(renderer);
+        SDL_RenderPresent(renderer);
+        redraw = false;
+    }
 }
 
 static void handle_note_keys(SDL_Keysym* keysym) {
 
     /* change note depending on which key is pressed */
 
-    int new_note = note;
+    int new_note = -1;
     switch(keysym->sym) {
         case SDLK_z:
             new_note = 12;
@@ -659,7 +2052,7 @@ static void handle_note_keys(SDL_Keysym* keysym) {
     
     if(new_note > -1) {
 
-        note = new_note;
+        int note = new_note;
         note += (octave * 12);
         if(note > max_note) {
             note = max_note;
@@ -668,15 +2061,9 @@ static void handle_note_keys(SDL_Keysym* keysym) {
             note = min_note;
         }
 
-        /* if note is the same as last note, it's still held on sustain. Only set a new note if it differs from the last one */
-
-        if(note != last_note) {
-            print_note(note);
-            last_note = note;
-
-            /* reset envelope cursor */
-            envelope_cursor = 0;
-        }
+        /* ask the audio thread to start the note on a voice from the pool */
+        print_note(note);
+        send_note_event(main_engine, EVENT_NOTE_ON, keysym->sym, note);
     }
 }
 
@@ -726,3 +2113,4 @@ static void print_note(int note) {
     printf("note: %s%d pitch: %fHz\n", note_chars, note_octave, get_pitch(note));
 }
 
+